@@ -0,0 +1,308 @@
+/*********************************************************************
+-------------------------- END-OF-HEADER -----------------------------
+
+File    : FTPBench_Buffer.c
+Purpose : Throughput of buffered transfers over loopback for a range
+          of data buffer sizes
+*/
+
+/*********************************************************************
+*
+*       Usage
+*
+*  bench_buffer [<File> [<MBytes>]]
+*
+*  Creates <File> (default: bench_buffer.dat) with <MBytes> (default:
+*  256) unless it exists. For every data buffer size, the file is read
+*  into a buffer from the pool and sent over a TCP connection on the
+*  loopback interface, the way RETR sends if sendfile() is not used.
+*  The receiving thread writes into <File>.out the way STOR does if
+*  splice() is not used. The first line is the built-in buffer of the
+*  FTP server, used if no data buffer is configured.
+*/
+
+#include "../ftp/FTPServer_Linux.c"
+
+/*********************************************************************
+*
+*       Types, local
+*
+**********************************************************************
+*/
+
+typedef struct {
+  const char* sFile;
+  uint32_t    FileSize;
+  uint32_t    BufferSize;
+  int         hSock;
+  int         r;
+} _BENCH_XFER;
+
+/*********************************************************************
+*
+*       Static code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       _GetTime_us
+*/
+static int64_t _GetTime_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*********************************************************************
+*
+*       _CreateFile
+*/
+static int _CreateFile(const char* sFile, uint32_t FileSize) {
+  uint8_t  aData[64 * 1024];
+  uint32_t Pos;
+  int      hFile;
+
+  hFile = open(sFile, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (hFile < 0) {
+    return (errno == EEXIST) ? 0 : -1;
+  }
+  printf("Creating %u MB in %s\n", FileSize >> 20, sFile);
+  memset(aData, 0x5A, sizeof(aData));
+  for (Pos = 0; Pos < FileSize; Pos += sizeof(aData)) {
+    if (write(hFile, aData, sizeof(aData)) != (ssize_t)sizeof(aData)) {
+      close(hFile);
+      return -1;
+    }
+  }
+  close(hFile);
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _ConnectLoopback
+*
+*  Function description
+*    Opens a non-blocking TCP connection on the loopback interface,
+*    like the data connections of the server.
+*/
+static int _ConnectLoopback(int* phClient, int* phServer) {
+  struct sockaddr_in Addr;
+  socklen_t          AddrLen;
+  int                hListen;
+
+  memset(&Addr, 0, sizeof(Addr));
+  Addr.sin_family      = AF_INET;
+  Addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  AddrLen              = sizeof(Addr);
+  hListen = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ((hListen < 0)
+   || (bind(hListen, (struct sockaddr*)&Addr, sizeof(Addr)) != 0)
+   || (listen(hListen, 1) != 0)
+   || (getsockname(hListen, (struct sockaddr*)&Addr, &AddrLen) != 0)) {
+    if (hListen >= 0) {
+      close(hListen);
+    }
+    return -1;
+  }
+  *phClient = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if ((*phClient < 0) || (connect(*phClient, (struct sockaddr*)&Addr, sizeof(Addr)) != 0)) {
+    close(hListen);
+    return -1;
+  }
+  *phServer = accept4(hListen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  close(hListen);
+  if (*phServer < 0) {
+    return -1;
+  }
+  fcntl(*phClient, F_SETFL, fcntl(*phClient, F_GETFL) | O_NONBLOCK);
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _AllocBuffer
+*
+*  Function description
+*    Takes a buffer from the pool, or a built-in sized one if
+*    BufferSize is FTPS_DATA_BUFFER_SIZE.
+*/
+static void* _AllocBuffer(uint32_t* pBufferSize) {
+  if (*pBufferSize == FTPS_DATA_BUFFER_SIZE) {
+    return malloc(FTPS_DATA_BUFFER_SIZE);
+  }
+  return _AllocDataBuffer(NULL, pBufferSize);
+}
+
+/*********************************************************************
+*
+*       _FreeBuffer
+*/
+static void _FreeBuffer(void* pBuffer, uint32_t BufferSize) {
+  if (BufferSize == FTPS_DATA_BUFFER_SIZE) {
+    free(pBuffer);
+  } else {
+    _FreeDataBuffer(pBuffer);
+  }
+}
+
+/*********************************************************************
+*
+*       _SendTask
+*
+*  Function description
+*    Sends the file like the buffered loop of RETR.
+*/
+static void* _SendTask(void* p) {
+  _BENCH_XFER* pXfer;
+  void*        hFile;
+  uint8_t*     pBuffer;
+  uint32_t     BufferSize;
+  uint32_t     Pos;
+  uint32_t     NumBytes;
+
+  pXfer      = (_BENCH_XFER*)p;
+  BufferSize = pXfer->BufferSize;
+  pBuffer    = (uint8_t*)_AllocBuffer(&BufferSize);
+  hFile      = _FS_LINUX_Open(pXfer->sFile);
+  pXfer->r   = -1;
+  if ((pBuffer != NULL) && (hFile != NULL)) {
+    for (Pos = 0; Pos < pXfer->FileSize; Pos += NumBytes) {
+      NumBytes = MIN(BufferSize, pXfer->FileSize - Pos);
+      if ((_FS_LINUX_ReadAt(hFile, pBuffer, Pos, NumBytes) < 0)
+       || (_Send(pBuffer, (int)NumBytes, (FTPS_SOCKET)(intptr_t)pXfer->hSock) != (int)NumBytes)) {
+        break;
+      }
+    }
+    pXfer->r = (Pos == pXfer->FileSize) ? 0 : -1;
+  }
+  if (hFile != NULL) {
+    _FS_LINUX_Close(hFile);
+  }
+  if (pBuffer != NULL) {
+    _FreeBuffer(pBuffer, BufferSize);
+  }
+  shutdown(pXfer->hSock, SHUT_WR);
+  return NULL;
+}
+
+/*********************************************************************
+*
+*       _Receive
+*
+*  Function description
+*    Receives into a file like the buffered loop of STOR.
+*/
+static int _Receive(const char* sFile, uint32_t BufferSize, int hSock) {
+  void*    hFile;
+  uint8_t* pBuffer;
+  uint32_t Pos;
+  int      r;
+
+  pBuffer = (uint8_t*)_AllocBuffer(&BufferSize);
+  hFile   = _FS_LINUX_Create(sFile);
+  r       = -1;
+  if ((pBuffer != NULL) && (hFile != NULL)) {
+    Pos = 0;
+    for (;;) {
+      r = _Recv(pBuffer, (int)BufferSize, (FTPS_SOCKET)(intptr_t)hSock);
+      if (r <= 0) {
+        break;
+      }
+      if (_FS_LINUX_WriteAt(hFile, pBuffer, Pos, (uint32_t)r) < 0) {
+        r = -1;
+        break;
+      }
+      Pos += (uint32_t)r;
+    }
+  }
+  if (hFile != NULL) {
+    _FS_LINUX_Close(hFile);
+  }
+  if (pBuffer != NULL) {
+    _FreeBuffer(pBuffer, BufferSize);
+  }
+  return r;
+}
+
+/*********************************************************************
+*
+*       _Run
+*/
+static int _Run(const char* sFile, const char* sOutFile, uint32_t FileSize, uint32_t BufferSize) {
+  _BENCH_XFER Xfer;
+  pthread_t   ThreadId;
+  int64_t     t0;
+  int64_t     t1;
+  int         hClient;
+  int         r;
+
+  if (_ConnectLoopback(&hClient, &Xfer.hSock) < 0) {
+    printf("Could not connect over loopback\n");
+    return -1;
+  }
+  Xfer.sFile      = sFile;
+  Xfer.FileSize   = FileSize;
+  Xfer.BufferSize = BufferSize;
+  t0 = _GetTime_us();
+  pthread_create(&ThreadId, NULL, _SendTask, &Xfer);
+  r  = _Receive(sOutFile, BufferSize, hClient);
+  pthread_join(ThreadId, NULL);
+  t1 = _GetTime_us();
+  close(hClient);
+  close(Xfer.hSock);
+  if ((r < 0) || (Xfer.r < 0)) {
+    printf("%8u bytes  transfer failed\n", BufferSize);
+    return -1;
+  }
+  printf("%8u bytes  %8.1f MB/s  %u buffers allocated on demand\n", BufferSize, (double)FileSize / (double)(t1 - t0), _FTPServerGetNumDataBufferOverflows());
+  return 0;
+}
+
+/*********************************************************************
+*
+*       Public code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       main()
+*/
+int main(int argc, char* argv[]) {
+  const char* sFile;
+  char        acOutFile[256];
+  uint32_t    FileSize;
+  uint32_t    BufferSize;
+  struct stat Stat;
+
+  sFile    = (argc > 1) ? argv[1] : "bench_buffer.dat";
+  FileSize = ((argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 0) : 256) << 20;
+  if (_CreateFile(sFile, FileSize) < 0) {
+    printf("Could not create %s\n", sFile);
+    return 1;
+  }
+  if ((stat(sFile, &Stat) != 0) || (Stat.st_size > 0xFFFFFFFF)) {
+    printf("%s is not usable\n", sFile);
+    return 1;
+  }
+  FileSize = (uint32_t)Stat.st_size;
+  _FS_LINUX_ConfigBaseDir((sFile[0] == '/') ? "/" : "./");
+  snprintf(acOutFile, sizeof(acOutFile), "%s.out", sFile);
+  _Run(sFile, acOutFile, FileSize, FTPS_DATA_BUFFER_SIZE);
+  for (BufferSize = DATA_BUFFER_SIZE_MIN; BufferSize <= DATA_BUFFER_SIZE_MAX; BufferSize *= 2) {
+    if (_DATA_BUF_Config(BufferSize, 2) < 0) {
+      printf("Out of memory\n");
+      return 1;
+    }
+    _Run(sFile, acOutFile, FileSize, BufferSize);
+  }
+  unlink(acOutFile);
+  return 0;
+}
+
+/*************************** End of file ****************************/
@@ -0,0 +1,326 @@
+/*********************************************************************
+-------------------------- END-OF-HEADER -----------------------------
+
+File    : FTPBench_Client.c
+Purpose : Accept latency under connection churn and pipelined command
+          throughput, measured as a client of a running server
+*/
+
+/*********************************************************************
+*
+*       Usage
+*
+*  bench_client [<Host> [<Port> [<File>]]]
+*
+*  Connects to the server at <Host>:<Port> (default: 127.0.0.1:2121).
+*
+*  accept     CHURN_THREADS clients connect, wait for the sign-on
+*             message and disconnect again and again. Reports the time
+*             from connect() to the sign-on message.
+*  SIZE       Logs in as anonymous and requests the size of <File>
+*             (default: a.txt), once waiting for every reply and once
+*             sending PIPELINE_DEPTH commands at a time.
+*/
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/*********************************************************************
+*
+*       Defines, configurable
+*
+**********************************************************************
+*/
+
+#define CHURN_THREADS        8       // Clients connecting at the same time
+#define CHURN_CONNECTIONS    2000    // Connections per client
+#define NUM_COMMANDS         100000  // SIZE commands per run
+#define PIPELINE_DEPTH       100     // SIZE commands sent at once when pipelining
+
+/*********************************************************************
+*
+*       Types, local
+*
+**********************************************************************
+*/
+
+typedef struct {
+  int64_t* paLatency;           // Latency of every connection in us
+  int      NumErrors;
+} _BENCH_CHURN;
+
+/*********************************************************************
+*
+*       Static data
+*
+**********************************************************************
+*/
+
+static struct sockaddr_in _ServerAddr;
+
+/*********************************************************************
+*
+*       Static code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       _GetTime_us
+*/
+static int64_t _GetTime_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*********************************************************************
+*
+*       _Connect
+*/
+static int _Connect(void) {
+  int hSock;
+  int One;
+
+  hSock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (hSock < 0) {
+    return -1;
+  }
+  if (connect(hSock, (struct sockaddr*)&_ServerAddr, sizeof(_ServerAddr)) != 0) {
+    close(hSock);
+    return -1;
+  }
+  One = 1;
+  setsockopt(hSock, IPPROTO_TCP, TCP_NODELAY, &One, sizeof(One));
+  return hSock;
+}
+
+/*********************************************************************
+*
+*       _ReadLines
+*
+*  Function description
+*    Receives until NumLines reply lines have been completed.
+*
+*  Return value
+*    >= 0 :  Number of replies starting with '2'
+*      -1 :  Connection closed
+*/
+static int _ReadLines(int hSock, int NumLines) {
+  char    acBuffer[4096];
+  ssize_t NumBytes;
+  ssize_t i;
+  int     NumOK;
+  int     IsLineStart;
+
+  NumOK       = 0;
+  IsLineStart = 1;
+  while (NumLines > 0) {
+    NumBytes = recv(hSock, acBuffer, sizeof(acBuffer), 0);
+    if (NumBytes <= 0) {
+      return -1;
+    }
+    for (i = 0; i < NumBytes; i++) {
+      if (IsLineStart && (acBuffer[i] == '2')) {
+        NumOK++;
+      }
+      IsLineStart = (acBuffer[i] == '\n');
+      if (IsLineStart) {
+        NumLines--;
+      }
+    }
+  }
+  return NumOK;
+}
+
+/*********************************************************************
+*
+*       _SendAll
+*/
+static int _SendAll(int hSock, const char* pData, size_t NumBytes) {
+  ssize_t r;
+
+  while (NumBytes > 0) {
+    r = send(hSock, pData, NumBytes, MSG_NOSIGNAL);
+    if (r <= 0) {
+      return -1;
+    }
+    pData    += r;
+    NumBytes -= (size_t)r;
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _ChurnTask
+*/
+static void* _ChurnTask(void* p) {
+  _BENCH_CHURN* pChurn;
+  int64_t       t0;
+  int           hSock;
+  int           i;
+
+  pChurn = (_BENCH_CHURN*)p;
+  for (i = 0; i < CHURN_CONNECTIONS; i++) {
+    t0    = _GetTime_us();
+    hSock = _Connect();
+    if ((hSock < 0) || (_ReadLines(hSock, 1) != 1)) {
+      pChurn->NumErrors++;
+      pChurn->paLatency[i] = 0;
+    } else {
+      pChurn->paLatency[i] = _GetTime_us() - t0;
+    }
+    if (hSock >= 0) {
+      close(hSock);
+    }
+  }
+  return NULL;
+}
+
+/*********************************************************************
+*
+*       _CompareLatency
+*/
+static int _CompareLatency(const void* p0, const void* p1) {
+  int64_t v0;
+  int64_t v1;
+
+  v0 = *(const int64_t*)p0;
+  v1 = *(const int64_t*)p1;
+  return (v0 > v1) - (v0 < v1);
+}
+
+/*********************************************************************
+*
+*       _BenchAccept
+*/
+static void _BenchAccept(void) {
+  _BENCH_CHURN aChurn[CHURN_THREADS];
+  pthread_t    aThreadId[CHURN_THREADS];
+  int64_t*     paLatency;
+  int64_t      t0;
+  int64_t      t1;
+  unsigned     NumTotal;
+  int          NumErrors;
+  int          i;
+
+  NumTotal  = CHURN_THREADS * CHURN_CONNECTIONS;
+  paLatency = (int64_t*)malloc(NumTotal * sizeof(int64_t));
+  if (paLatency == NULL) {
+    return;
+  }
+  t0 = _GetTime_us();
+  for (i = 0; i < CHURN_THREADS; i++) {
+    aChurn[i].paLatency = paLatency + i * CHURN_CONNECTIONS;
+    aChurn[i].NumErrors = 0;
+    pthread_create(&aThreadId[i], NULL, _ChurnTask, &aChurn[i]);
+  }
+  NumErrors = 0;
+  for (i = 0; i < CHURN_THREADS; i++) {
+    pthread_join(aThreadId[i], NULL);
+    NumErrors += aChurn[i].NumErrors;
+  }
+  t1 = _GetTime_us();
+  qsort(paLatency, NumTotal, sizeof(int64_t), _CompareLatency);
+  printf("accept  %6.0f connections/s  median %6lld us  p99 %6lld us  max %7lld us  %d errors\n",
+         (double)NumTotal * 1000000.0 / (double)(t1 - t0),
+         (long long)paLatency[NumTotal / 2], (long long)paLatency[NumTotal * 99 / 100], (long long)paLatency[NumTotal - 1], NumErrors);
+  free(paLatency);
+}
+
+/*********************************************************************
+*
+*       _BenchSize
+*/
+static void _BenchSize(const char* sFile, int Depth) {
+  char*   pBatch;
+  char    acCmd[300];
+  int64_t t0;
+  int64_t t1;
+  size_t  CmdLen;
+  int     NumOK;
+  int     hSock;
+  int     r;
+  int     i;
+
+  hSock = _Connect();
+  if (hSock < 0) {
+    printf("Could not connect\n");
+    return;
+  }
+  if ((_ReadLines(hSock, 1) < 0)
+   || (_SendAll(hSock, "USER anonymous\r\n", 16) < 0) || (_ReadLines(hSock, 1) < 0)
+   || (_SendAll(hSock, "PASS bench\r\n", 12) < 0)     || (_ReadLines(hSock, 1) != 1)) {
+    printf("Could not log in\n");
+    close(hSock);
+    return;
+  }
+  snprintf(acCmd, sizeof(acCmd), "SIZE %s\r\n", sFile);
+  CmdLen = strlen(acCmd);
+  pBatch = (char*)malloc(CmdLen * Depth);
+  if (pBatch == NULL) {
+    close(hSock);
+    return;
+  }
+  for (i = 0; i < Depth; i++) {
+    memcpy(pBatch + i * CmdLen, acCmd, CmdLen);
+  }
+  NumOK = 0;
+  t0    = _GetTime_us();
+  for (i = 0; i < NUM_COMMANDS; i += Depth) {
+    if (_SendAll(hSock, pBatch, CmdLen * Depth) < 0) {
+      break;
+    }
+    r = _ReadLines(hSock, Depth);
+    if (r < 0) {
+      break;
+    }
+    NumOK += r;
+  }
+  t1 = _GetTime_us();
+  printf("SIZE    %3d at once  %8.0f commands/s  %d of %d OK\n", Depth,
+         (double)i * 1000000.0 / (double)(t1 - t0), NumOK, i);
+  free(pBatch);
+  close(hSock);
+}
+
+/*********************************************************************
+*
+*       Public code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       main()
+*/
+int main(int argc, char* argv[]) {
+  const char* sFile;
+
+  memset(&_ServerAddr, 0, sizeof(_ServerAddr));
+  _ServerAddr.sin_family = AF_INET;
+  _ServerAddr.sin_port   = htons((argc > 2) ? (uint16_t)atoi(argv[2]) : 2121);
+  if (inet_pton(AF_INET, (argc > 1) ? argv[1] : "127.0.0.1", &_ServerAddr.sin_addr) != 1) {
+    printf("Invalid address\n");
+    return 1;
+  }
+  sFile = (argc > 3) ? argv[3] : "a.txt";
+  _BenchAccept();
+  _BenchSize(sFile, 1);
+  _BenchSize(sFile, PIPELINE_DEPTH);
+  return 0;
+}
+
+/*************************** End of file ****************************/
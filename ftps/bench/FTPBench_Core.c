@@ -0,0 +1,395 @@
+/*********************************************************************
+-------------------------- END-OF-HEADER -----------------------------
+
+File    : FTPBench_Core.c
+Purpose : Command dispatch, pipelined commands and listing formatting
+          of the FTP server core, without sockets or file system
+*/
+
+/*********************************************************************
+*
+*       Usage
+*
+*  bench_core
+*
+*  dispatch   Commands dispatched per second by _ParseInput(), for
+*             verbs at the start and the end of the command table,
+*             a rejected command and an unknown verb.
+*  pipeline   SIZE commands per second if a client sends them without
+*             waiting for the replies, and send() calls per command.
+*  LIST, MLSD, NLST
+*             Listing entries formatted per second.
+*/
+
+#include "../ftp/src/IP_FTPServer.c"
+
+#include <stdio.h>
+#include <time.h>
+
+/*********************************************************************
+*
+*       Defines, configurable
+*
+**********************************************************************
+*/
+
+#define NUM_DISPATCH      2000000     // Commands dispatched per verb
+#define NUM_PIPELINED     2000000     // SIZE commands sent in one stream
+#define NUM_LIST_ENTRIES  1000        // Entries of the listed directory
+#define NUM_LIST_ROUNDS   2000        // Times the directory is listed
+
+/*********************************************************************
+*
+*       Types, local
+*
+**********************************************************************
+*/
+
+typedef struct {
+  char     acName[32];
+  uint32_t Size;
+  uint32_t Time;
+  int      IsDir;
+} _BENCH_ENTRY;
+
+/*********************************************************************
+*
+*       Static data
+*
+**********************************************************************
+*/
+
+static FTPS_CONTEXT   _Context;
+static _BENCH_ENTRY   _aEntry[NUM_LIST_ENTRIES];
+static uint8_t        _aDataBuffer[256 * 1024];
+static const char*    _sPipeline;       // Stream of commands returned by _Receive()
+static unsigned       _PipelineLen;
+static unsigned       _PipelineOff;
+static unsigned       _NumSendCalls;
+
+/*********************************************************************
+*
+*       Static code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       _GetTime_us
+*/
+static int64_t _GetTime_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*********************************************************************
+*
+*       _Send
+*
+*  Function description
+*    Counts and drops the output.
+*/
+static int _Send(const unsigned char* pData, int Len, FTPS_SOCKET hSock) {
+  (void)pData;
+  (void)hSock;
+  _NumSendCalls++;
+  return Len;
+}
+
+/*********************************************************************
+*
+*       _Receive
+*
+*  Function description
+*    Returns the next part of _sPipeline.
+*/
+static int _Receive(unsigned char* pData, int Len, FTPS_SOCKET hSock) {
+  unsigned NumBytes;
+
+  (void)hSock;
+  NumBytes = _PipelineLen - _PipelineOff;
+  if (NumBytes > (unsigned)Len) {
+    NumBytes = (unsigned)Len;
+  }
+  memcpy(pData, _sPipeline + _PipelineOff, NumBytes);
+  _PipelineOff += NumBytes;
+  return (int)NumBytes;
+}
+
+/*********************************************************************
+*
+*       _FindUser
+*/
+static int _FindUser(const char* sUser) {
+  (void)sUser;
+  return 1;
+}
+
+/*********************************************************************
+*
+*       _CheckPass
+*/
+static int _CheckPass(int UserId, const char* sPass) {
+  (void)UserId;
+  (void)sPass;
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _GetDirInfo
+*/
+static int _GetDirInfo(int UserId, const char* sDirIn, char* sDirOut, int SizeOfDirOut) {
+  (void)UserId;
+  (void)sDirIn;
+  (void)sDirOut;
+  (void)SizeOfDirOut;
+  return IP_FTPS_PERM_VISIBLE | IP_FTPS_PERM_READ | IP_FTPS_PERM_WRITE;
+}
+
+/*********************************************************************
+*
+*       _GetFileInfo
+*/
+static int _GetFileInfo(int UserId, const char* sFileIn, char* sFileOut, int FileOutSize) {
+  (void)UserId;
+  (void)sFileIn;
+  (void)sFileOut;
+  (void)FileOutSize;
+  return IP_FTPS_PERM_VISIBLE | IP_FTPS_PERM_READ | IP_FTPS_PERM_WRITE;
+}
+
+/*********************************************************************
+*
+*       _GetTimeDate
+*/
+static uint32_t _GetTimeDate(void) {
+  return (46u << 25) | (10u << 21) | (17u << 16);   // 2026-10-17
+}
+
+/*********************************************************************
+*
+*       _GetDirEntryFileName
+*/
+static void _GetDirEntryFileName(void* pFileEntry, char* sFileName, uint32_t SizeOfBuffer) {
+  strncpy(sFileName, ((_BENCH_ENTRY*)pFileEntry)->acName, SizeOfBuffer);
+  *(sFileName + SizeOfBuffer - 1) = 0;
+}
+
+/*********************************************************************
+*
+*       _GetDirEntryFileSize
+*/
+static uint32_t _GetDirEntryFileSize(void* pFileEntry, uint32_t* pFileSizeHigh) {
+  if (pFileSizeHigh != NULL) {
+    *pFileSizeHigh = 0;
+  }
+  return ((_BENCH_ENTRY*)pFileEntry)->Size;
+}
+
+/*********************************************************************
+*
+*       _GetDirEntryFileTime
+*/
+static uint32_t _GetDirEntryFileTime(void* pFileEntry) {
+  return ((_BENCH_ENTRY*)pFileEntry)->Time;
+}
+
+/*********************************************************************
+*
+*       _GetDirEntryAttributes
+*/
+static int _GetDirEntryAttributes(void* pFileEntry) {
+  return ((_BENCH_ENTRY*)pFileEntry)->IsDir;
+}
+
+/*********************************************************************
+*
+*       _GetFileStat
+*/
+static int _GetFileStat(const char* sFilename, IP_FS_FILE_STAT* pStat) {
+  (void)sFilename;
+  pStat->FileSize     = 123456789;
+  pStat->FileSizeHigh = 0;
+  pStat->FileTime     = _GetTimeDate();
+  pStat->Attributes   = 0;
+  return 0;
+}
+
+static const IP_FTPS_API _IP_API = {
+  .pfSend    = _Send,
+  .pfReceive = _Receive
+};
+
+static FTPS_ACCESS_CONTROL _Access = {
+  _FindUser,
+  _CheckPass,
+  _GetDirInfo,
+  _GetFileInfo
+};
+
+static const FTPS_APPLICATION _Application = {
+  .pAccess       = &_Access,
+  .pfGetTimeDate = _GetTimeDate
+};
+
+static const _FS_API _FS_API_Bench = {
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  _GetDirEntryFileName,
+  _GetDirEntryFileSize,
+  _GetDirEntryFileTime,
+  _GetDirEntryAttributes,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  NULL,
+  _GetFileStat
+};
+
+/*********************************************************************
+*
+*       _InitContext
+*/
+static void _InitContext(void) {
+  IP_FTPS_Start(&_Context, &_IP_API, (FTPS_SOCKET)1, &_FS_API_Bench, &_Application);   // Any handle but NULL, the stubs ignore it
+  _Context.UserId = 1;
+}
+
+/*********************************************************************
+*
+*       _BenchDispatch
+*/
+static void _BenchDispatch(const char* sLine) {
+  IN_BUFFER_DESC* pBufferDesc;
+  int64_t         t0;
+  int64_t         t1;
+  int             Len;
+  int             i;
+
+  pBufferDesc = &_Context.InBufferDesc;
+  Len = (int)strlen(sLine);
+  t0  = _GetTime_us();
+  for (i = 0; i < NUM_DISPATCH; i++) {
+    memcpy(_Context.acIn, sLine, Len);
+    _Context.acIn[Len]     = CR;
+    _Context.acIn[Len + 1] = LF;
+    pBufferDesc->RdOff     = 0;
+    pBufferDesc->Cnt       = Len + 2;
+    _Context.CtrlOut.Cnt   = 0;
+    _Context.UserId        = 1;
+    strcpy(_Context.acCurDir, "/a/b/");
+    _ParseInput(&_Context);
+  }
+  t1 = _GetTime_us();
+  printf("dispatch   %-16s %6.2f M commands/s  %6.1f ns\n", sLine,
+         (double)NUM_DISPATCH / (double)(t1 - t0), (double)(t1 - t0) * 1000.0 / NUM_DISPATCH);
+}
+
+/*********************************************************************
+*
+*       _BenchPipeline
+*/
+static void _BenchPipeline(void) {
+  static const char _acCmd[] = "SIZE /pub/file.bin\r\n";
+  char*             sPipeline;
+  int64_t           t0;
+  int64_t           t1;
+  unsigned          i;
+
+  _PipelineLen = NUM_PIPELINED * (sizeof(_acCmd) - 1);
+  sPipeline    = (char*)malloc(_PipelineLen);
+  if (sPipeline == NULL) {
+    return;
+  }
+  for (i = 0; i < NUM_PIPELINED; i++) {
+    memcpy(sPipeline + i * (sizeof(_acCmd) - 1), _acCmd, sizeof(_acCmd) - 1);
+  }
+  _sPipeline    = sPipeline;
+  _PipelineOff  = 0;
+  _NumSendCalls = 0;
+  _InitContext();
+  _NumSendCalls = 0;                      // Sign-on message is not counted
+  t0 = _GetTime_us();
+  while (_PipelineOff < _PipelineLen) {
+    if (IP_FTPS_Resume(&_Context) < 0) {
+      break;
+    }
+  }
+  t1 = _GetTime_us();
+  printf("pipeline   SIZE             %6.2f M commands/s  %6.3f send() calls per command\n",
+         (double)NUM_PIPELINED / (double)(t1 - t0), (double)_NumSendCalls / NUM_PIPELINED);
+  free(sPipeline);
+}
+
+/*********************************************************************
+*
+*       _BenchList
+*/
+static void _BenchList(const char* sFormat, int (*pf)(void* pContext, void* pFileEntry)) {
+  int64_t t0;
+  int64_t t1;
+  int     k;
+  int     i;
+
+  _InitContext();
+  _Context.DataOut.pBuffer    = _aDataBuffer;
+  _Context.DataOut.BufferSize = sizeof(_aDataBuffer);
+  _Context.sListDir           = "/big/";
+  _Context.ListYear           = (_GetTimeDate() >> 25) & 0x7F;
+  t0 = _GetTime_us();
+  for (k = 0; k < NUM_LIST_ROUNDS; k++) {
+    for (i = 0; i < NUM_LIST_ENTRIES; i++) {
+      pf(&_Context, &_aEntry[i]);
+    }
+  }
+  t1 = _GetTime_us();
+  printf("%-10s %-16s %6.2f M entries/s\n", sFormat, "",
+         (double)NUM_LIST_ROUNDS * NUM_LIST_ENTRIES / (double)(t1 - t0));
+}
+
+/*********************************************************************
+*
+*       Public code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       main()
+*/
+int main(void) {
+  int i;
+
+  _InitContext();
+  _BenchDispatch("CDUP");
+  _BenchDispatch("PWD");
+  _BenchDispatch("TYPE I");
+  _BenchDispatch("USER anonymous");
+  _BenchDispatch("XCUP");
+  _BenchDispatch("MKD");                  // Rejected, argument missing
+  _BenchDispatch("HELLO");                // Unknown verb
+  _BenchPipeline();
+  for (i = 0; i < NUM_LIST_ENTRIES; i++) {
+    snprintf(_aEntry[i].acName, sizeof(_aEntry[i].acName), "file_%06d.dat", i * 37);
+    _aEntry[i].Size  = (uint32_t)i * 7919u;
+    _aEntry[i].Time  = ((uint32_t)(40 + i % 7) << 25) | ((uint32_t)(1 + i % 12) << 21) | ((uint32_t)(1 + i % 28) << 16) | ((uint32_t)(i % 24) << 11) | ((uint32_t)(i % 60) << 5);
+    _aEntry[i].IsDir = ((i % 10) == 0);
+  }
+  _BenchList("LIST", _cbList);
+  _BenchList("MLSD", _cbMLSD);
+  _BenchList("NLST", _cbNLST);
+  return 0;
+}
+
+/*************************** End of file ****************************/
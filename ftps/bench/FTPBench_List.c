@@ -0,0 +1,246 @@
+/*********************************************************************
+-------------------------- END-OF-HEADER -----------------------------
+
+File    : FTPBench_List.c
+Purpose : Listing latency and memory of a large directory with the
+          metadata fetched on demand, by stat threads and through io_uring
+*/
+
+/*********************************************************************
+*
+*       Usage
+*
+*  bench_list [<Dir> [<NumEntries>]]
+*
+*  Creates <Dir> (default: bench_list.dir) with <NumEntries> files
+*  (default: 1000000) unless it exists, and lists it the way LIST does:
+*  name, size and time of every entry. Reports the time until the first
+*  entry is passed on, the time for the whole directory and the peak
+*  resident set size of the process during the run, which stays the
+*  same for any number of entries as long as the listing is streamed.
+*  The page cache is dropped before every run if permitted (root), else
+*  the runs are warm and mostly measure the syscall overhead.
+*/
+
+#include "../ftp/FTPServer_Linux.c"
+
+/*********************************************************************
+*
+*       Types, local
+*
+**********************************************************************
+*/
+
+typedef struct {
+  int64_t  t0;
+  int64_t  tFirst;
+  unsigned NumEntries;
+  uint32_t Check;
+} _BENCH_LIST;
+
+/*********************************************************************
+*
+*       Static code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       _GetTime_us
+*/
+static int64_t _GetTime_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*********************************************************************
+*
+*       _DropCaches
+*
+*  Return value
+*    1 :  Page cache dropped
+*    0 :  Not permitted, the run is warm
+*/
+static int _DropCaches(void) {
+  int hFile;
+  int r;
+
+  sync();
+  hFile = open("/proc/sys/vm/drop_caches", O_WRONLY | O_CLOEXEC);
+  if (hFile < 0) {
+    return 0;
+  }
+  r = (write(hFile, "3", 1) == 1);
+  close(hFile);
+  return r;
+}
+
+/*********************************************************************
+*
+*       _ResetPeakRSS
+*
+*  Function description
+*    Sets the peak resident set size of the process to the current one.
+*
+*  Return value
+*    1 :  Reset
+*    0 :  Not supported, the peak covers the previous runs as well
+*/
+static int _ResetPeakRSS(void) {
+  int hFile;
+  int r;
+
+  hFile = open("/proc/self/clear_refs", O_WRONLY | O_CLOEXEC);
+  if (hFile < 0) {
+    return 0;
+  }
+  r = (write(hFile, "5", 1) == 1);
+  close(hFile);
+  return r;
+}
+
+/*********************************************************************
+*
+*       _GetPeakRSS
+*
+*  Function description
+*    Returns the peak resident set size of the process in KB.
+*/
+static unsigned long _GetPeakRSS(void) {
+  char          acLine[128];
+  FILE*         pFile;
+  unsigned long NumKB;
+
+  NumKB = 0;
+  pFile = fopen("/proc/self/status", "r");
+  if (pFile != NULL) {
+    while (fgets(acLine, sizeof(acLine), pFile) != NULL) {
+      if (sscanf(acLine, "VmHWM: %lu", &NumKB) == 1) {
+        break;
+      }
+    }
+    fclose(pFile);
+  }
+  return NumKB;
+}
+
+/*********************************************************************
+*
+*       _CreateDir
+*/
+static int _CreateDir(const char* sDir, unsigned NumEntries) {
+  char     acPath[512];
+  unsigned i;
+  int      hFile;
+
+  if (mkdir(sDir, 0755) != 0) {
+    return (errno == EEXIST) ? 0 : -1;
+  }
+  printf("Creating %u files in %s\n", NumEntries, sDir);
+  for (i = 0; i < NumEntries; i++) {
+    snprintf(acPath, sizeof(acPath), "%s/f%07u", sDir, i);
+    hFile = open(acPath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (hFile < 0) {
+      return -1;
+    }
+    close(hFile);
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _cbList
+*/
+static int _cbList(void* pContext, void* pFileEntry) {
+  _BENCH_LIST* pList;
+  char         acName[256];
+  uint32_t     SizeHigh;
+
+  pList = (_BENCH_LIST*)pContext;
+  if (pList->NumEntries++ == 0) {
+    pList->tFirst = _GetTime_us();
+  }
+  _FS_LINUX_GetDirEntryFileName(pFileEntry, acName, sizeof(acName));
+  pList->Check += _FS_LINUX_GetDirEntryFileSize(pFileEntry, &SizeHigh);
+  pList->Check += _FS_LINUX_GetDirEntryFileTime(pFileEntry);
+  pList->Check += (uint32_t)_FS_LINUX_GetDirEntryAttributes(pFileEntry);
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _Run
+*/
+static void _Run(const char* sMode, const char* sDir, unsigned Flags) {
+  _BENCH_LIST List;
+  int64_t     t1;
+  int         IsCold;
+
+  IsCold = _DropCaches();
+  _ResetPeakRSS();
+  memset(&List, 0, sizeof(List));
+  List.t0 = _GetTime_us();
+  _FS_LINUX_ForEachDirEntryEx(&List, sDir, Flags, _cbList);
+  t1 = _GetTime_us();
+  printf("%-10s %s  %8u entries  first %8.2f ms  total %9.2f ms  peak RSS %7.1f MB\n",
+         sMode, IsCold ? "cold" : "warm", List.NumEntries,
+         (List.tFirst - List.t0) / 1000.0, (t1 - List.t0) / 1000.0, _GetPeakRSS() / 1024.0);
+}
+
+/*********************************************************************
+*
+*       Public code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       main()
+*/
+int main(int argc, char* argv[]) {
+  const char* sDir;
+  char        acDir[256];
+  unsigned    NumEntries;
+  pthread_t   ThreadId;
+  unsigned    i;
+
+  sDir       = (argc > 1) ? argv[1] : "bench_list.dir";
+  NumEntries = (argc > 2) ? (unsigned)strtoul(argv[2], NULL, 0) : 1000000;
+  if (_CreateDir(sDir, NumEntries) < 0) {
+    printf("Could not create %s\n", sDir);
+    return 1;
+  }
+  _FS_LINUX_ConfigBaseDir((sDir[0] == '/') ? "/" : "./");
+  snprintf(acDir, sizeof(acDir), "%s/", sDir);
+  //
+  // Metadata fetched by the listing thread, one fstatat() per entry
+  //
+  _Run("on demand", acDir, 0);
+  //
+  // Batches through io_uring
+  //
+  if (_STAT_RING_IsSupported()) {
+    _StatPool.UseRing = 1;
+    _Run("io_uring", acDir, IP_FS_DIR_ENTRY_STAT);
+    _StatPool.UseRing = 0;
+  } else {
+    printf("io_uring   statx() requests not supported by the kernel\n");
+  }
+  //
+  // Batches fetched by stat threads
+  //
+  _StatPool.NumThreads = STAT_THREADS;
+  for (i = 0; i < STAT_THREADS; i++) {
+    pthread_create(&ThreadId, NULL, _STAT_POOL_Task, NULL);
+    pthread_detach(ThreadId);
+  }
+  _Run("threads", acDir, IP_FS_DIR_ENTRY_STAT);
+  return 0;
+}
+
+/*************************** End of file ****************************/
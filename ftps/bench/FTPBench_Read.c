@@ -0,0 +1,234 @@
+/*********************************************************************
+-------------------------- END-OF-HEADER -----------------------------
+
+File    : FTPBench_Read.c
+Purpose : System calls per MB read by the file backend, compared with
+          the former FILE* based implementation
+*/
+
+/*********************************************************************
+*
+*       Usage
+*
+*  bench_read [<File> [<MBytes>]]
+*
+*  Creates <File> (default: bench_read.dat) with <MBytes> (default: 64)
+*  unless it exists and reads it the way RETR does without sendfile(),
+*  in pieces of the built-in and of the default data buffer size:
+*
+*  stdio      fseek() and fread() on a FILE* opened with "r+", as the
+*             backend did before it used file descriptors.
+*  pread      _FS_LINUX_ReadAt() of the Linux port.
+*
+*  Read system calls are taken from /proc/self/io. It does not count
+*  the lseek() system calls fseek() makes if the position is not in
+*  the stdio buffer.
+*/
+
+#include "../ftp/FTPServer_Linux.c"
+
+/*********************************************************************
+*
+*       Static code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       _GetTime_us
+*/
+static int64_t _GetTime_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*********************************************************************
+*
+*       _GetNumReadCalls
+*
+*  Function description
+*    Returns the number of read system calls of the process so far.
+*/
+static uint64_t _GetNumReadCalls(void) {
+  char               acLine[128];
+  FILE*              pFile;
+  unsigned long long NumCalls;
+
+  NumCalls = 0;
+  pFile    = fopen("/proc/self/io", "r");
+  if (pFile != NULL) {
+    while (fgets(acLine, sizeof(acLine), pFile) != NULL) {
+      if (sscanf(acLine, "syscr: %llu", &NumCalls) == 1) {
+        break;
+      }
+    }
+    fclose(pFile);
+  }
+  return NumCalls;
+}
+
+/*********************************************************************
+*
+*       _CreateFile
+*/
+static int _CreateFile(const char* sFile, uint32_t FileSize) {
+  uint8_t  aData[64 * 1024];
+  uint32_t Pos;
+  int      hFile;
+
+  hFile = open(sFile, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (hFile < 0) {
+    return (errno == EEXIST) ? 0 : -1;
+  }
+  printf("Creating %u MB in %s\n", FileSize >> 20, sFile);
+  memset(aData, 0x5A, sizeof(aData));
+  for (Pos = 0; Pos < FileSize; Pos += sizeof(aData)) {
+    if (write(hFile, aData, sizeof(aData)) != (ssize_t)sizeof(aData)) {
+      close(hFile);
+      return -1;
+    }
+  }
+  close(hFile);
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _ReadStdio
+*
+*  Function description
+*    Reads the file like the FILE* based backend: every piece is read
+*    by fseek() to its position and fread().
+*
+*  Return value
+*     0 :  O.K.
+*    -1 :  Error
+*/
+static int _ReadStdio(const char* sFile, uint32_t FileSize, uint8_t* pBuffer, uint32_t BufferSize) {
+  FILE*    pFile;
+  uint32_t Pos;
+  uint32_t NumBytes;
+  int      r;
+
+  pFile = fopen(sFile, "r+");
+  if (pFile == NULL) {
+    return -1;
+  }
+  r = 0;
+  for (Pos = 0; Pos < FileSize; Pos += NumBytes) {
+    NumBytes = MIN(BufferSize, FileSize - Pos);
+    fseek(pFile, (long)Pos, SEEK_SET);
+    if (fread(pBuffer, 1, NumBytes, pFile) != NumBytes) {
+      r = -1;
+      break;
+    }
+  }
+  fclose(pFile);
+  return r;
+}
+
+/*********************************************************************
+*
+*       _ReadPort
+*
+*  Function description
+*    Reads the file through the Linux port.
+*
+*  Return value
+*     0 :  O.K.
+*    -1 :  Error
+*/
+static int _ReadPort(const char* sFile, uint32_t FileSize, uint8_t* pBuffer, uint32_t BufferSize) {
+  void*    hFile;
+  uint32_t Pos;
+  uint32_t NumBytes;
+  int      r;
+
+  hFile = _FS_LINUX_Open(sFile);
+  if (hFile == NULL) {
+    return -1;
+  }
+  r = 0;
+  for (Pos = 0; Pos < FileSize; Pos += NumBytes) {
+    NumBytes = MIN(BufferSize, FileSize - Pos);
+    if (_FS_LINUX_ReadAt(hFile, pBuffer, Pos, NumBytes) < 0) {
+      r = -1;
+      break;
+    }
+  }
+  _FS_LINUX_Close(hFile);
+  return r;
+}
+
+/*********************************************************************
+*
+*       _Run
+*/
+static void _Run(const char* sMode, int (*pfRead)(const char*, uint32_t, uint8_t*, uint32_t), const char* sFile, uint32_t FileSize, uint32_t BufferSize) {
+  uint8_t* pBuffer;
+  uint64_t NumReads;
+  int64_t  t0;
+  int64_t  t1;
+  double   NumMB;
+  int      r;
+
+  pBuffer = (uint8_t*)malloc(BufferSize);
+  if (pBuffer == NULL) {
+    return;
+  }
+  NumReads = _GetNumReadCalls();
+  t0       = _GetTime_us();
+  r        = pfRead(sFile, FileSize, pBuffer, BufferSize);
+  t1       = _GetTime_us();
+  NumReads = _GetNumReadCalls() - NumReads;
+  free(pBuffer);
+  if (r < 0) {
+    printf("%-6s %8u bytes  read failed\n", sMode, BufferSize);
+    return;
+  }
+  NumMB = (double)FileSize / (1024.0 * 1024.0);
+  printf("%-6s %8u bytes  %8.1f reads/MB  %8.1f MB/s\n", sMode, BufferSize,
+         (double)NumReads / NumMB, (double)FileSize / (double)(t1 - t0));
+}
+
+/*********************************************************************
+*
+*       Public code
+*
+**********************************************************************
+*/
+
+/*********************************************************************
+*
+*       main()
+*/
+int main(int argc, char* argv[]) {
+  static const uint32_t _aBufferSize[] = { FTPS_DATA_BUFFER_SIZE, DATA_BUFFER_SIZE };
+  const char*           sFile;
+  uint32_t              FileSize;
+  struct stat           Stat;
+  unsigned              i;
+
+  sFile    = (argc > 1) ? argv[1] : "bench_read.dat";
+  FileSize = ((argc > 2) ? (uint32_t)strtoul(argv[2], NULL, 0) : 64) << 20;
+  if (_CreateFile(sFile, FileSize) < 0) {
+    printf("Could not create %s\n", sFile);
+    return 1;
+  }
+  if ((stat(sFile, &Stat) != 0) || (Stat.st_size > 0x7FFFFFFF)) {
+    printf("%s is not usable\n", sFile);
+    return 1;
+  }
+  FileSize = (uint32_t)Stat.st_size;
+  _FS_LINUX_ConfigBaseDir((sFile[0] == '/') ? "/" : "./");
+  for (i = 0; i < sizeof(_aBufferSize) / sizeof(_aBufferSize[0]); i++) {
+    _Run("stdio", _ReadStdio, sFile, FileSize, _aBufferSize[i]);
+    _Run("pread", _ReadPort,  sFile, FileSize, _aBufferSize[i]);
+  }
+  return 0;
+}
+
+/*************************** End of file ****************************/
@@ -6,17 +6,35 @@ Purpose : Implementation of file system on Linux OS
 Revision: $Rev: 6176 $
 */
 
+#define _GNU_SOURCE     // pipe2(), splice(), F_SETPIPE_SZ, O_NOATIME, pthread_setaffinity_np()
+#define _FILE_OFFSET_BITS 64  // 64-bit off_t, stat() and sendfile() on 32-bit targets
+
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <semaphore.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <errno.h>
 #include <unistd.h>
 #include <dirent.h>
-#include <libgen.h>
+#include <time.h>
+#include <fcntl.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <poll.h>
+#include <signal.h>
+#include <linux/io_uring.h>
 
 #include "IP_FTPServer.h"
 
@@ -30,7 +48,64 @@ Revision: $Rev: 6176 $
 //
 // FTP Sample
 //
-#define MAX_CONNECTIONS  2  // Number of connections to handle at the same time
+#define MAX_CONNECTIONS  8192  // Number of connections to handle at the same time
+#define NUM_WORKERS         0  // Number of threads executing FTP commands. 0: One per CPU core
+#define MAX_EVENTS         64  // Number of readiness events fetched at once by the reactor
+#define NUM_SHARDS          1  // Number of listening sockets, each with its own reactor (SO_REUSEPORT if > 1). 0: One per worker
+#define PIN_SHARDS          0  // 1: Pin the reactor of each shard to its own CPU
+#define MAX_SENDFILE_CHUNK  0x7FFFF000  // Largest number of bytes sendfile() transfers at once
+#define SPLICE_PIPE_SIZE    (1024 * 1024) // Requested capacity of the pipe used to splice uploads into files
+#define DIR_BUFFER_SIZE     (64 * 1024)   // Bytes of directory entries read by one getdents64() call
+#define STAT_BATCH_SIZE     256           // Directory entries LIST requests the metadata of at once
+#define STAT_THREADS        8             // Threads fetching metadata for LIST if io_uring is not available. 0: Fetch on demand
+#define TREE_THREADS        4             // Threads reading sibling directories ahead for LIST -R. 0: No read-ahead
+#define TREE_QUEUE_SIZE     64            // Directories queued for read-ahead at most
+#define MAX_TRANSFER_THREADS  256           // Threads that replace workers busy with a transfer at most. 0: A transfer blocks its worker
+#define SPARE_IDLE_TIME       30000         // Time [ms] a thread that is no longer needed waits to replace a worker before it ends
+
+//
+// Data connection buffers
+//
+#define DATA_BUFFER_SIZE      (256 * 1024)        // Default size of a data connection buffer
+#define DATA_BUFFER_SIZE_MIN  (64 * 1024)         // Smallest size accepted by _DATA_BUF_Config()
+#define DATA_BUFFER_SIZE_MAX  (4 * 1024 * 1024)   // Largest size accepted by _DATA_BUF_Config()
+#define DATA_BUFFER_COUNT     64                  // Number of preallocated data buffers (transfers at the same time)
+
+//
+// Directory listing cache
+//
+#define LIST_CACHE_SIZE       (16 * 1024 * 1024)  // Bytes of formatted listings kept in memory
+#define LIST_CACHE_MAX_ENTRY  (4 * 1024 * 1024)   // Largest listing that is cached
+#define LIST_CACHE_MAX_AGE    60000               // Time [ms] after which a cached listing is read again
+
+//
+// File metadata cache
+//
+#define STAT_CACHE_NUM_ENTRIES  16384             // Files and directories whose size, time and type are kept
+#define STAT_CACHE_NUM_DIRS     1024              // Hash buckets of the directories holding cached entries
+#define STAT_CACHE_MAX_AGE      10000             // Time [ms] after which the metadata of a file is read again
+#define STAT_CACHE_MIN_AGE      2                 // Time [s] a file has to be unmodified before its metadata is cached
+
+//
+// Open file cache
+//
+#define FD_CACHE_NUM_FILES    256                 // Files kept open for downloads at most. 0: Open the file for every transfer
+#define FD_CACHE_IDLE_TIME    30000               // Time [ms] a file no transfer uses is kept open
+
+//
+// Wall clock
+//
+#define TIME_DAY_CACHE_SIZE   64                  // Number of days the converted date of time stamps is kept for
+
+//
+// Passive mode data ports. Listening sockets for the range are bound once at startup and leased to the
+// sessions, which keeps PASV free of socket(), bind() and listen() calls and allows firewalls to open a
+// fixed range. 0: Let the stack assign an ephemeral port for every PASV command.
+//
+#define PASV_PORT_MIN         50000               // First port of the passive port range
+#define PASV_PORT_MAX         50255               // Last port of the passive port range
+#define DATA_CONNECT_TIMEOUT  10000               // Time [ms] a transfer command waits for the data connection (PASV: client connects, PORT: handshake completes)
+#define DATA_IDLE_TIMEOUT     120000              // Time [ms] a transfer waits for the client to accept or deliver data before the data connection is considered dead
 
 #ifndef TRUE
    #define TRUE (1)
@@ -48,15 +123,17 @@ Revision: $Rev: 6176 $
    #define MAX(a, b) ((a) > (b) ? (a) : (b))
 #endif
 
-#define _FS_LINUX_DOTDOT_HANDLE         0L
-#define _FS_LINUX_INVALID_HANDLE       -1L
+//
+// File handles are OS file descriptors. They are stored off by one so a valid handle is never NULL.
+//
+#define _FS_LINUX_FD2HANDLE(fd)        ((void *)(intptr_t)((fd) + 1))
+#define _FS_LINUX_HANDLE2FD(h)         ((int)(intptr_t)(h) - 1)
 
-#define _FS_LINUX_A_NORMAL             0x00    // Normal file.
-#define _FS_LINUX_A_RDONLY             0x01    // Read only file.
-#define _FS_LINUX_A_HIDDEN             0x02    // Hidden file.
-#define _FS_LINUX_A_SYSTEM             0x04    // System file.
-#define _FS_LINUX_A_SUBDIR             0x10    // Subdirectory.
-#define _FS_LINUX_A_ARCH               0x20    // Archive file.
+//
+// Range of UTC time stamps the packed date/time format can represent (1980 to 2107).
+//
+#define TIME_1980                      315532800LL
+#define TIME_2108                      4354819200LL
 
 /*********************************************************************
 *
@@ -70,20 +147,214 @@ enum {
   USER_ID_ADMIN
 };
 
-typedef struct _FS_FIND_DATA {
-  uint32_t  attrib;
-  time_t    time_create;
-  time_t    time_access;
-  time_t    time_write;
-  off_t     size;
-  char      name[260];
-} _FS_FIND_DATA;
-
-typedef struct _FS_FHANDLE {
-  DIR* dstream;
-  short dironly;
-  char* spec;
-} _FS_FHANDLE;
+typedef struct _FS_DIR_ENTRY {
+  int             hDir;         // Directory the entry belongs to, used to stat the entry on demand
+  const char*     sName;
+  unsigned char   Type;         // DT_... reported by the file system, DT_UNKNOWN if it does not provide the type
+  signed char     StatState;    // 0: Not read yet, 1: Stat is valid, -1: Entry can not be read (e.g. removed meanwhile)
+  char            IsNoFollow;   // Type of a symbolic link is the link itself, not its target (IP_FS_DIR_ENTRY_TREE)
+  struct stat     Stat;         // Only st_mode, st_size and st_mtime are used
+} _FS_DIR_ENTRY;
+
+typedef struct _FS_FOR_EACH {
+  void*           pContext;
+  void          (*pf)(void* pContext, void* pFileEntry);
+} _FS_FOR_EACH;
+
+typedef struct _STAT_BATCH {
+  struct _STAT_BATCH* pNext;    // Next batch waiting for stat threads
+  int             NumEntries;
+  atomic_int      NextEntry;    // Next entry to be fetched, claimed by the stat threads and the listing thread
+  int             NumHelpers;   // Stat threads working on this batch
+  pthread_cond_t  Cond;         // Signaled when an entry has been fetched or a stat thread leaves the batch
+  _FS_DIR_ENTRY   aEntry[STAT_BATCH_SIZE];
+  struct statx    aStatx[STAT_BATCH_SIZE];
+} _STAT_BATCH;
+
+typedef struct _STAT_POOL {
+  pthread_mutex_t Lock;         // Protects the list and the StatState of the entries of queued batches
+  pthread_cond_t  Cond;         // Signaled when a batch is queued
+  _STAT_BATCH*    pFirst;
+  int             UseRing;      // 1: Threads fetch metadata through their own io_uring
+  unsigned        NumThreads;   // Number of stat threads, only used without io_uring
+} _STAT_POOL;
+
+typedef struct _STAT_RING {
+  int                   hRing;
+  uint8_t*              pSq;        // Mappings, unmapped by _STAT_RING_Destroy()
+  uint8_t*              pCq;        // Same as pSq if the kernel maps both rings at once
+  size_t                SqSize;
+  size_t                CqSize;
+  size_t                SqeSize;
+  unsigned*             pSqTail;
+  unsigned*             pSqMask;
+  unsigned*             paSqIndex;
+  struct io_uring_sqe*  paSqe;
+  unsigned*             pCqHead;
+  unsigned*             pCqTail;
+  unsigned*             pCqMask;
+  struct io_uring_cqe*  paCqe;
+  int                   IsFailed;   // 1: io_uring_enter() has failed, the ring must not be used any more
+} _STAT_RING;
+
+typedef struct _TREE_POOL {
+  pthread_mutex_t Lock;
+  pthread_cond_t  Cond;         // Signaled when a directory is queued
+  unsigned        RdPos;
+  unsigned        WrPos;
+  unsigned        NumThreads;
+  char            aacPath[TREE_QUEUE_SIZE][256];
+} _TREE_POOL;
+
+typedef struct _DATA_BUF_POOL {
+  pthread_mutex_t Lock;
+  void*           pFirstFree;   // Free buffers are linked through their first bytes
+  uint8_t*        pMem;
+  uint32_t        BufferSize;
+  unsigned        NumBuffers;
+  unsigned        NumOverflows; // Buffers allocated with malloc() because the pool was empty
+} _DATA_BUF_POOL;
+
+typedef struct _PASV_LISTENER {
+  struct _PASV_LISTENER* pNext; // Next free listener
+  int             hSock;        // Listening socket, bound for the lifetime of the server
+  uint16_t        Port;
+} _PASV_LISTENER;
+
+typedef struct _PASV_POOL {
+  pthread_mutex_t Lock;
+  _PASV_LISTENER* pFirstFree;   // Listeners are leased from the head and returned to the tail so that a port rests as long as possible
+  _PASV_LISTENER* pLastFree;
+  _PASV_LISTENER* paListener;
+  _PASV_LISTENER** papByFd;     // Maps a socket descriptor to its listener, NULL for all other descriptors
+  int             NumFds;       // Number of entries of papByFd
+} _PASV_POOL;
+
+typedef struct _LIST_CACHE_ENTRY {
+  struct _LIST_CACHE_ENTRY* pPrev;  // LRU list, most recently used first
+  struct _LIST_CACHE_ENTRY* pNext;
+  char            acDir[FTPS_MAX_PATH_DIR];
+  int             UserId;
+  char            Format;
+  char            IsFilled;     // 0: Listing is being produced by a session, 1: Complete
+  char            IsStale;      // Dropped from the cache, freed as soon as no session uses it
+  char            IsTooLarge;   // Listing exceeds LIST_CACHE_MAX_ENTRY, sessions list the directory without the cache
+  int             RefCnt;       // Sessions producing or sending the listing
+  int             wd;           // inotify watch of the directory, -1 if none
+  int64_t         TimeFilled;
+  uint8_t*        pData;
+  uint32_t        NumBytes;
+  uint32_t        Capacity;
+} _LIST_CACHE_ENTRY;
+
+typedef struct _LIST_CACHE {
+  pthread_mutex_t    Lock;
+  pthread_cond_t     Cond;      // Signaled when a listing has been produced
+  _LIST_CACHE_ENTRY* pFirst;
+  _LIST_CACHE_ENTRY* pLast;
+  uint32_t           NumBytes;  // Data of all complete entries in the list
+  int                hNotify;   // inotify instance, -1 if not available
+} _LIST_CACHE;
+
+typedef struct _STAT_CACHE_DIR {
+  struct _STAT_CACHE_DIR*   pNextHash;    // Next directory of the same hash bucket
+  struct _STAT_CACHE_DIR*   pPrev;        // List of all directories, searched for the watch of an inotify event
+  struct _STAT_CACHE_DIR*   pNext;
+  struct _STAT_CACHE_ENTRY* pFirst;       // Cached entries of the directory
+  uint32_t        Hash;
+  int             RefCnt;       // Cached entries and lookups in progress
+  int             wd;           // inotify watch of the directory, -1 if none
+  char            acPath[1];    // Normalized path with trailing '/', allocated with the structure
+} _STAT_CACHE_DIR;
+
+typedef struct _STAT_CACHE_ENTRY {
+  struct _STAT_CACHE_ENTRY* pPrev;        // LRU list, most recently used first
+  struct _STAT_CACHE_ENTRY* pNext;
+  struct _STAT_CACHE_ENTRY* pNextHash;    // Next entry of the same hash bucket
+  struct _STAT_CACHE_ENTRY* pPrevInDir;   // Entries of the same directory
+  struct _STAT_CACHE_ENTRY* pNextInDir;
+  _STAT_CACHE_DIR* pDir;
+  uint32_t        Hash;
+  int64_t         TimeFilled;
+  IP_FS_FILE_STAT Stat;
+  const char*     sName;        // Name of the entry, points into acPath
+  char            acPath[1];    // Normalized path, allocated with the structure
+} _STAT_CACHE_ENTRY;
+
+typedef struct _STAT_CACHE {
+  pthread_mutex_t    Lock;
+  _STAT_CACHE_ENTRY* pFirst;
+  _STAT_CACHE_ENTRY* pLast;
+  _STAT_CACHE_DIR*   pFirstDir;
+  unsigned           NumEntries;
+  unsigned           Generation;  // Incremented whenever an entry is dropped because the file has changed
+  int                hNotify;     // inotify instance, -1 if not available
+  _STAT_CACHE_ENTRY* apEntry[STAT_CACHE_NUM_ENTRIES * 2];  // Hash table of the entries
+  _STAT_CACHE_DIR*   apDir[STAT_CACHE_NUM_DIRS];           // Hash table of the directories
+} _STAT_CACHE;
+
+typedef struct _FD_CACHE_ENTRY {
+  struct _FD_CACHE_ENTRY* pPrev;  // LRU list, most recently opened first
+  struct _FD_CACHE_ENTRY* pNext;
+  int             fd;
+  int             RefCnt;       // Transfers using the descriptor
+  char            IsStale;      // Dropped from the cache, closed as soon as no transfer uses it
+  dev_t           Dev;
+  ino_t           Ino;
+  int64_t         TimeUsed;     // Time the last transfer has ended
+  unsigned        Len;
+  char            acPath[1];    // Normalized path, allocated with the structure
+} _FD_CACHE_ENTRY;
+
+typedef struct _FD_CACHE {
+  pthread_mutex_t   Lock;
+  _FD_CACHE_ENTRY*  pFirst;
+  _FD_CACHE_ENTRY*  pLast;
+  _FD_CACHE_ENTRY** papByFd;    // Maps a descriptor to its entry, NULL for all other descriptors. NULL if the cache is disabled.
+  int               NumFds;     // Number of entries of papByFd
+  unsigned          NumFiles;   // Entries in the list
+  unsigned          MaxFiles;
+} _FD_CACHE;
+
+typedef struct _WORK_POOL {
+  pthread_mutex_t Lock;
+  pthread_cond_t  Cond;         // Signaled when a spare thread shall replace a worker
+  void*         (*pfTask)(void* Context);  // Thread function of a worker
+  unsigned        NumWorkers;   // Threads that shall be available for commands
+  unsigned        NumThreads;   // Threads taking sessions from the queue, including the ones in a transfer
+  unsigned        NumTransfers; // Threads in a transfer
+  unsigned        NumSpares;    // Threads waiting to replace a worker
+  unsigned        NumWakeups;   // Spares signaled to replace a worker that have not woken up yet
+} _WORK_POOL;
+
+typedef struct _SHARD {
+  int             hSockListen;  // Listening socket of this shard
+  int             hReserve;     // Descriptor released to reject a connection when the process is out of descriptors
+  int             hEpoll;       // Reactor watching the listening socket and all idle control connections of this shard
+  int             MaxConnections;
+  atomic_int      ConnectCnt;   // Connections accepted by this shard
+  int             Cpu;          // CPU the reactor runs on, -1: Not pinned
+  pthread_t       ThreadId;
+} _SHARD;
+
+typedef struct _SESSION {
+  _SHARD*         pShard;       // Shard that accepted the connection
+  int             hSock;        // Control connection
+  void*           pFTPS;        // Session state of the FTP server, IP_FTPS_GetSessionSize() bytes. NULL until the session is started.
+} _SESSION;
+
+typedef struct _WORK_SLOT {
+  atomic_size_t   Seq;          // Position the slot is ready for: Pos when free, Pos + 1 when filled
+  _SESSION*       pSession;
+} _WORK_SLOT;
+
+typedef struct _WORK_QUEUE {
+  _WORK_SLOT*     paSlot;       // Bounded multi-producer, multi-consumer queue of sessions to run, shared by all workers
+  size_t          Mask;         // Number of slots - 1, number of slots is a power of 2
+  atomic_size_t   WrPos;        // Shared by all producers
+  atomic_size_t   RdPos;        // Shared by all workers
+  sem_t           Sem;          // Counts queued sessions, lets an idle worker sleep
+} _WORK_QUEUE;
 
 /*********************************************************************
 *
@@ -91,9 +362,23 @@ typedef struct _FS_FHANDLE {
 *
 **********************************************************************
 */
-static int                  _ConnectCnt;
+static int                  _hShutdown = -1;  // eventfd, readable once the server shall shut down
+static _WORK_QUEUE          _WorkQueue;
+static _WORK_POOL           _WorkPool    = { .Lock = PTHREAD_MUTEX_INITIALIZER, .Cond = PTHREAD_COND_INITIALIZER };
 static const _FS_API *      _pFS_API;     // File system info
 static char                 _acBaseDir[256] = "./";
+static _DATA_BUF_POOL       _DataBufPool = { .Lock = PTHREAD_MUTEX_INITIALIZER };
+static _PASV_POOL           _PasvPool    = { .Lock = PTHREAD_MUTEX_INITIALIZER };
+static _STAT_POOL           _StatPool    = { .Lock = PTHREAD_MUTEX_INITIALIZER, .Cond = PTHREAD_COND_INITIALIZER };
+static _TREE_POOL           _TreePool    = { .Lock = PTHREAD_MUTEX_INITIALIZER, .Cond = PTHREAD_COND_INITIALIZER };
+static _LIST_CACHE          _ListCache   = { .Lock = PTHREAD_MUTEX_INITIALIZER, .Cond = PTHREAD_COND_INITIALIZER, .hNotify = -1 };
+static _STAT_CACHE          _StatCache   = { .Lock = PTHREAD_MUTEX_INITIALIZER, .hNotify = -1 };
+static _FD_CACHE            _FdCache     = { .Lock = PTHREAD_MUTEX_INITIALIZER };
+static uint64_t             _TimeDateNow;   // Current second (bits 32-63) and its packed date/time (bits 0-31)
+static uint64_t             _aDayCache[TIME_DAY_CACHE_SIZE];  // Day since 1970 (bits 16-47) and its packed date (bits 0-15)
+static __thread _STAT_RING* _pStatRing;   // io_uring of the calling thread, created by its first listing
+static __thread int         _StatRingFailed;
+static __thread int         _IsTransferring;  // Worker is in a transfer and has been replaced
 
 /*********************************************************************
 *
@@ -102,286 +387,6 @@ static char                 _acBaseDir[256] = "./";
 **********************************************************************
 */
 
-// 
-// Matches the regular language accepted by findfirst/findnext. More
-// precisely, * matches zero or more characters and ? matches any
-// characters, but only one. Every other characters match themself.
-// To respect the Windows behavior, *.* matches everything.
-// 
-static int _FS_LINUX_MatchSpec(const char* spec, const char* text) {
-  //
-  // On Windows, *.* matches everything.
-  //
-  if (strcmp(spec, "*.*") == 0) {
-    return 1;
-  }
-  // 
-  // If the whole specification string was consumed and
-  // the input text is also exhausted: it's a match.
-  // 
-  if (spec[0] == '\0' && text[0] == '\0') {
-    return 1;
-  }
-
-  /* A star matches 0 or more characters. */
-  if (spec[0] == '*') {
-    // 
-    // Skip the star and try to find a match after it
-    // by successively incrementing the text pointer.
-    // 
-    do {
-        if (_FS_LINUX_MatchSpec(spec + 1, text)) {
-            return 1;
-        }
-    } while (*text++ != '\0');
-  }
-
-  // 
-  // An interrogation mark matches any character. Other
-  // characters match themself. Also, if the input text
-  // is exhausted but the specification isn't, there is
-  // no match.
-  // 
-  if (text[0] != '\0' && (spec[0] == '?' || spec[0] == text[0])) {
-    return _FS_LINUX_MatchSpec(spec + 1, text + 1);
-  }
-
-  return 0;
-}
-
-// 
-// Closes the specified search handle and releases associated
-// resources. If successful, findclose returns 0. Otherwise, it
-// returns -1 and sets errno to ENOENT, indicating that no more
-// matching files could be found.
-// 
-static int _FS_LINUX_FindClose(int fhandle) {
-  struct _FS_FHANDLE* handle;
-
-  if (fhandle == _FS_LINUX_DOTDOT_HANDLE) {
-    return 0;
-  }
-
-  if (fhandle == _FS_LINUX_INVALID_HANDLE) {
-    return -1;
-  }
-
-  handle = (struct _FS_FHANDLE*) fhandle;
-
-  closedir(handle->dstream);
-  free(handle->spec);
-  free(handle);
-
-  return 0;
-}
-
-// 
-// Find the next entry, if any, that matches the filespec argument
-// of a previous call to findfirst, and then alter the fileinfo
-// structure contents accordingly. If successful, returns 0. Otherwise,
-// returns -1 and sets errno to EINVAL if handle or fileinfo was NULL
-// or if the operating system returned an unexpected error and ENOENT
-// if no more matching files could be found.
-// 
-static int _FS_LINUX_FindNext(int fhandle, _FS_FIND_DATA* fileinfo) {
-  struct dirent *entry;
-  struct _FS_FHANDLE* handle;
-  struct stat st;
-
-  if (fhandle == _FS_LINUX_DOTDOT_HANDLE) {
-    return -1;
-  }
-
-  if (fhandle == _FS_LINUX_INVALID_HANDLE || !fileinfo) {
-    return -1;
-  }
-
-  handle = (struct _FS_FHANDLE*) fhandle;
-
-  while ((entry = readdir(handle->dstream)) != NULL) {
-    if (!handle->dironly && !_FS_LINUX_MatchSpec(handle->spec, entry->d_name)) {
-      continue;
-    }
-
-    if (fstatat(dirfd(handle->dstream), entry->d_name, &st, 0) == -1) {
-      return -1;
-    }
-
-    if (handle->dironly && !S_ISDIR(st.st_mode)) {
-      continue;
-    }
-
-    fileinfo->attrib = S_ISDIR(st.st_mode) ? _FS_LINUX_A_SUBDIR : _FS_LINUX_A_NORMAL;
-    fileinfo->size = st.st_size;
-    fileinfo->time_create = st.st_ctime;
-    fileinfo->time_access = st.st_atime;
-    fileinfo->time_write = st.st_mtime;
-    strcpy(fileinfo->name, entry->d_name);
-
-    return 0;
-  }
-
-  return -1;
-}
-
-//
-// Perfom a scan in the directory identified by dirpath.
-//
-static int _FS_LINUX_InDirectory(const char* dirpath, const char* spec, _FS_FIND_DATA* fileinfo) {
-  DIR* dstream;
-  _FS_FHANDLE* ffhandle;
-
-  if (spec[0] == '\0') {
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-
-  if ((dstream = opendir(dirpath)) == NULL) {
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-
-  if ((ffhandle = malloc(sizeof(_FS_FHANDLE))) == NULL) {
-    closedir(dstream);
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-  //
-  // On Windows, *. returns only directories.
-  //
-  ffhandle->dironly = strcmp(spec, "*.") == 0 ? 1 : 0;
-  ffhandle->dstream = dstream;
-  ffhandle->spec = strdup(spec);
-
-  if (_FS_LINUX_FindNext((int) ffhandle, fileinfo) != 0) {
-    _FS_LINUX_FindClose((int) ffhandle);
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-
-  return (int) ffhandle;
-}
-
-//
-// On Windows, . and .. return canonicalized directory names.
-//
-static int _FS_LINUX_DdotDot(const char* filespec, _FS_FIND_DATA* fileinfo) {
-  char* dirname;
-  char* canonicalized;
-  struct stat st;
-
-  if (stat(filespec, &st) != 0) {
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-  //
-  // Resolve filespec to an absolute path.
-  //
-  if ((canonicalized = realpath(filespec, NULL)) == NULL) {
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-  //
-  // Retrieve the basename from it.
-  //
-  dirname = basename(canonicalized);
-  //
-  // Make sure that we actually have a basename.
-  //
-  if (dirname[0] == '\0') {
-    free(canonicalized);
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-  //
-  // Make sure that we won't overflow finddata_t::name.
-  //
-  if (strlen(dirname) > 259) {
-    free(canonicalized);
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-
-  fileinfo->attrib = S_ISDIR(st.st_mode) ? _FS_LINUX_A_SUBDIR : _FS_LINUX_A_NORMAL;
-  fileinfo->size = st.st_size;
-  fileinfo->time_create = st.st_ctime;
-  fileinfo->time_access = st.st_atime;
-  fileinfo->time_write = st.st_mtime;
-  strcpy(fileinfo->name, dirname);
-
-  free(canonicalized);
-
-  // 
-  // Return a special handle since we can't return
-  // NULL. The findnext and findclose functions know
-  // about this custom handle.
-  // 
-  return _FS_LINUX_DOTDOT_HANDLE;
-}
-
-// 
-// Returns a unique search handle identifying the file or group of
-// files matching the filespec specification, which can be used in
-// a subsequent call to findnext or to findclose. Otherwise, findfirst
-// returns NULL and sets errno to EINVAL if filespec or fileinfo
-// was NULL or if the operating system returned an unexpected error
-// and ENOENT if the file specification could not be matched.
-// 
-static int _FS_LINUX_FindFirst(const char* filespec, _FS_FIND_DATA* fileinfo) {
-  char* rmslash;      // Rightmost forward slash in filespec.
-  const char* spec;   // Specification string.
-
-  if (!fileinfo || !filespec) {
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-
-  if (filespec[0] == '\0') {
-    return _FS_LINUX_INVALID_HANDLE;
-  }
-
-  rmslash = strrchr(filespec, '/');
-
-  if (rmslash != NULL) {
-    // 
-    // At least one forward slash was found in the filespec
-    // string, and rmslash points to the rightmost one. The
-    // specification part, if any, begins right after it.
-    // 
-    spec = rmslash + 1;
-  } else {
-    // 
-    // Since no slash was found in the filespec string, its
-    // entire content can be used as our spec string.
-    // 
-    spec = filespec;
-  }
-
-  if (strcmp(spec, ".") == 0 || strcmp(spec, "..") == 0) {
-    //
-    // On Windows, . and .. must return canonicalized names.
-    //
-    return _FS_LINUX_DdotDot(filespec, fileinfo);
-  } else if (rmslash == filespec) {
-    // 
-    // Since the rightmost slash is the first character, we're
-    // looking for something located at the file system's root.
-    // 
-    return _FS_LINUX_InDirectory("/", spec, fileinfo);
-  } else if (rmslash != NULL) {
-    // 
-    // Since the rightmost slash isn't the first one, we're
-    // looking for something located in a specific folder. In
-    // order to open this folder, we split the folder path from
-    // the specification part by overwriting the rightmost
-    // forward slash.
-    // 
-    size_t pathlen = strlen(filespec) +1;
-    char* dirpath = alloca(pathlen);
-    memcpy(dirpath, filespec, pathlen);
-    dirpath[rmslash - filespec] = '\0';
-    return _FS_LINUX_InDirectory(dirpath, spec, fileinfo);
-  } else {
-    // 
-    // Since the filespec doesn't contain any forward slash,
-    // we're looking for something located in the current
-    // directory.
-    // 
-    return _FS_LINUX_InDirectory(".", spec, fileinfo);
-  }
-}
-
 /*********************************************************************
 *
 *       _ConvertFileName
@@ -420,567 +425,2931 @@ static void _ConvertFileName(char* sDest, const char* sSrc, unsigned BufferSize)
 
 /*********************************************************************
 *
-*       _FS_LINUX_Open
+*       _NormalizePath
+*
+*  Function description
+*    Removes empty and "." components from a path in place, so
+*    "a//b" and "a/./b" become "a/b". Such paths always name the same
+*    file. ".." is kept, as the component before it may be a link.
+*
+*  Return value
+*     0 :  Path has no "." or ".." components left
+*    -1 :  Path has a ".." component or ends with "/."
 */
-static void* _FS_LINUX_Open(const char* sFilename) {
-  char acFilename[256];
-  _FILE_HANDLE fileHandle;
-
-  _ConvertFileName(acFilename, sFilename, sizeof(acFilename));
-  fileHandle = fopen(acFilename, "r+");
-  if (fileHandle == (NULL)) {
-    fileHandle = 0;
+static int _NormalizePath(char* sPath) {
+  const char* s;
+  char*       d;
+
+  s = sPath;
+  d = sPath;
+  while (*s != 0) {
+    *d++ = *s;
+    if (*s++ == '/') {
+      while (1) {
+        if (*s == '/') {
+          s++;                        // "//"
+        } else if ((*s == '.') && (*(s + 1) == '/')) {
+          s += 2;                     // "/./"
+        } else {
+          break;
+        }
+      }
+    }
+  }
+  *d = 0;
+  for (s = strstr(sPath, "/."); s != NULL; s = strstr(s + 1, "/.")) {
+    if ((*(s + 2) == 0) || ((*(s + 2) == '.') && ((*(s + 3) == 0) || (*(s + 3) == '/')))) {
+      return -1;
+    }
   }
-  return (fileHandle);
+  return 0;
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_Close
+*       Wall clock.
+*
+*  Time stamps are converted into the packed date/time format of the
+*  FTP server (see _GetTimeDate()). Converting the date is the costly
+*  part, so the dates of recently used days are kept in a small table.
+*  Entries and the current time are packed into 64-bit values, so all
+*  threads can share them without a lock.
 */
-static int _FS_LINUX_Close(void* hFile) {
-  int32_t result;
-
-  result = fclose((FILE *)hFile);
-  if (result == (EOF))
-    return (-1);
-  return (0);
-}
 
 /*********************************************************************
 *
-*       _FS_LINUX_ReadAt
+*       _SYS_ToTimeDate
+*
+*  Function description
+*    Converts a UTC time stamp into the packed date/time format.
+*    Time stamps before 1980, which can not be represented, return 0.
 */
-static int _FS_LINUX_ReadAt(void* hFile, void* pDest, uint32_t Pos, uint32_t NumBytes) {
-  uint32_t result;
-
-  fseek ((FILE *) hFile, Pos, SEEK_SET);
-  result = fread ((void *) pDest, sizeof(uint8_t), (size_t) NumBytes, (FILE *) hFile);
-  if (result != NumBytes)
-    return (-1);
-  return (0);
+static uint32_t _SYS_ToTimeDate(time_t t) {
+  struct tm tm;
+  uint64_t  v;
+  uint32_t  Day;
+  uint32_t  Sec;
+  uint32_t  Date;
+  unsigned  i;
+
+  if ((t < TIME_1980) || (t >= TIME_2108)) {
+    return 0;
+  }
+  Day = (uint32_t)(t / 86400);
+  Sec = (uint32_t)(t % 86400);
+  i   = Day % TIME_DAY_CACHE_SIZE;
+  v   = __atomic_load_n(&_aDayCache[i], __ATOMIC_RELAXED);
+  if ((uint32_t)(v >> 16) == Day) {
+    Date = (uint32_t)v & 0xFFFF;
+  } else {
+    gmtime_r(&t, &tm);
+    Date = ((uint32_t)(tm.tm_year - 80) << 9) | ((uint32_t)(tm.tm_mon + 1) << 5) | (uint32_t)tm.tm_mday;
+    __atomic_store_n(&_aDayCache[i], ((uint64_t)Day << 16) | Date, __ATOMIC_RELAXED);
+  }
+  return (Date << 16) | ((Sec / 3600) << 11) | (((Sec / 60) % 60) << 5) | ((Sec % 60) / 2);
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_GetLen
+*       _SYS_GetTimeDate
+*
+*  Function description
+*    Returns the current time in the packed date/time format.
+*    CLOCK_REALTIME_COARSE is read from the vDSO without a system call,
+*    the conversion is done at most once per second for all threads.
 */
-static long _FS_LINUX_GetLen(void* hFile) {
-  long fileSize;
-
-  fseek ((FILE *) hFile, 0, SEEK_END);
-  fileSize = ftell(hFile);
-  fseek ((FILE *) hFile, 0, SEEK_SET);
-  return (fileSize);
+static uint32_t _SYS_GetTimeDate(void) {
+  struct timespec ts;
+  uint64_t        v;
+
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  v = __atomic_load_n(&_TimeDateNow, __ATOMIC_RELAXED);
+  if ((uint32_t)(v >> 32) != (uint32_t)ts.tv_sec) {
+    v = ((uint64_t)(uint32_t)ts.tv_sec << 32) | _SYS_ToTimeDate(ts.tv_sec);
+    __atomic_store_n(&_TimeDateNow, v, __ATOMIC_RELAXED);
+  }
+  return (uint32_t)v;
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_ForEachDirEntry
+*       _SYS_GetTime_ms
+*
+*  Function description
+*    Returns a monotonic time stamp in milliseconds, used for timeouts.
 */
-static void _FS_LINUX_ForEachDirEntry(void* pContext, const char* sDir, void (*pf)(void* pContext, void* pFileEntry)) {
-  int h;
-  _FS_FIND_DATA fd;
-  char acFilter[256];
-
-  strncpy(acFilter, _acBaseDir, sizeof(acFilter));
-  acFilter[sizeof(acFilter) - 1] = '\0';
-  if (sDir[0] == '/') {
-    strcat(acFilter, sDir + 1);
-  } else {
-    strcat(acFilter, sDir);
-  }
-  strcat(acFilter, "*.*");
+static int64_t _SYS_GetTime_ms(void) {
+  struct timespec ts;
 
-  h = _FS_LINUX_FindFirst(acFilter, &fd);
-  if (h != -1) {
-    do {
-      pf(pContext, &fd);
-    } while (_FS_LINUX_FindNext(h, &fd) == 0);
-    _FS_LINUX_FindClose(h);
-  }
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_GetDirEntryFileName
+*       Open file cache.
+*
+*  When many clients download the same files, every transfer opening
+*  and closing the file again is wasted work. Read-only descriptors of
+*  regular files are therefore shared by all transfers of a file and
+*  kept open for FD_CACHE_IDLE_TIME after the last one has ended. The
+*  transfers only use positional reads (pread(), sendfile() with an
+*  offset), so they do not disturb each other. Entries are keyed by
+*  path and inode: a file replaced by another one gets its own entry.
+*  The path is the one the client has used, normalized by
+*  _NormalizePath(); other names of the same file (links, "..") get
+*  their own entries. As a descriptor is only shared after the inode of
+*  the path has been checked, this costs descriptors, not correctness.
+*  Files the server overwrites or deletes are dropped right away. At
+*  most FD_CACHE_NUM_FILES files are kept open; when all of them are
+*  in use, further files are opened without the cache.
 */
-static void _FS_LINUX_GetDirEntryFileName(void* pFileEntry, char* sFileName, uint32_t SizeOfBuffer) {
-  _FS_FIND_DATA* pFD;
 
-  pFD = (_FS_FIND_DATA*)pFileEntry;
+/*********************************************************************
+*
+*       _FD_CACHE_Config
+*
+*  Function description
+*    Allocates the map from descriptors to entries.
+*
+*  Parameters
+*    MaxFiles   Number of files kept open at most. 0: No cache.
+*
+*  Return value
+*      0 :  O.K.
+*     -1 :  Out of memory
+*/
+static int _FD_CACHE_Config(unsigned MaxFiles) {
+  struct rlimit Limit;
+  rlim_t        NumFds;
 
-  strncpy(sFileName, pFD->name, SizeOfBuffer);
-  *(sFileName + SizeOfBuffer - 1) = 0;
+  if (MaxFiles == 0) {
+    return 0;
+  }
+  NumFds = 1024;
+  if (getrlimit(RLIMIT_NOFILE, &Limit) == 0) {
+    NumFds = MIN(Limit.rlim_cur, (rlim_t)1 << 20);
+  }
+  _FdCache.papByFd = (_FD_CACHE_ENTRY**)calloc(NumFds, sizeof(_FD_CACHE_ENTRY*));
+  if (_FdCache.papByFd == NULL) {
+    return -1;
+  }
+  _FdCache.NumFds   = (int)NumFds;
+  _FdCache.MaxFiles = MaxFiles;
+  return 0;
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_GetDirEntryFileSize
+*       _FD_CACHE_Drop
+*
+*  Function description
+*    Removes an entry from the cache. The descriptor is closed as soon
+*    as no transfer uses it any more. Has to be called with the cache locked.
 */
-static uint32_t _FS_LINUX_GetDirEntryFileSize (void* pFileEntry, uint32_t* pFileSizeHigh) {
-  _FS_FIND_DATA* pFD;
-
-  pFD = (struct _FS_FIND_DATA*)pFileEntry;
-  return (pFD->size);
+static void _FD_CACHE_Drop(_FD_CACHE_ENTRY* pEntry) {
+  if (pEntry->pPrev != NULL) {
+    pEntry->pPrev->pNext = pEntry->pNext;
+  } else {
+    _FdCache.pFirst = pEntry->pNext;
+  }
+  if (pEntry->pNext != NULL) {
+    pEntry->pNext->pPrev = pEntry->pPrev;
+  } else {
+    _FdCache.pLast = pEntry->pPrev;
+  }
+  _FdCache.NumFiles--;
+  pEntry->IsStale = 1;
+  if (pEntry->RefCnt == 0) {
+    _FdCache.papByFd[pEntry->fd] = NULL;
+    close(pEntry->fd);
+    free(pEntry);
+  }
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_GetDirEntryFileTime
+*       _FD_CACHE_Find
+*
+*  Function description
+*    Looks up the entry of a path. Has to be called with the cache locked.
 */
-static uint32_t _FS_LINUX_GetDirEntryFileTime (void* pFileEntry) {
-  _FS_FIND_DATA* pFD;
-  struct            tm* tm;
-  uint32_t Date, Time;
-
-  pFD = (_FS_FIND_DATA*)pFileEntry;
+static _FD_CACHE_ENTRY* _FD_CACHE_Find(const char* sPath, unsigned Len) {
+  _FD_CACHE_ENTRY* pEntry;
 
-  tm = gmtime( &pFD->time_write );
-  Time = ((tm->tm_hour        & 0x1F) << 11) + ((tm->tm_min       & 0x3F) << 5) + ((tm->tm_sec / 2) & 0x1F);
-  Date = (((tm->tm_year - 80) & 0x7F) << 9)  + (((tm->tm_mon + 1) & 0xF) << 5)  + (tm->tm_mday      & 0x1F);
-
-  return ((Date << 16) | Time);
+  for (pEntry = _FdCache.pFirst; pEntry != NULL; pEntry = pEntry->pNext) {
+    if ((pEntry->Len == Len) && (memcmp(pEntry->acPath, sPath, Len) == 0)) {
+      break;
+    }
+  }
+  return pEntry;
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_GetDirEntryAttributes
+*       _FD_CACHE_Open
+*
+*  Function description
+*    Returns a shared descriptor of a file if it is cached. Descriptors
+*    idle for more than FD_CACHE_IDLE_TIME are closed on the way.
+*
+*  Parameters
+*    sPath   Path of the file, normalized by _NormalizePath().
+*    pStat   Current stat of the path.
 *
 *  Return value
-*    bit 0   - 0: File, 1:Directory
+*    >= 0 :  Descriptor, released by _FD_CACHE_Close()
+*      -1 :  File not cached
 */
-static int _FS_LINUX_GetDirEntryAttributes(void* pFileEntry) {
-  _FS_FIND_DATA* pFD;
-
-  pFD = (_FS_FIND_DATA*)pFileEntry;
-  return ((pFD->attrib & _FS_LINUX_A_SUBDIR) ? 1 : 0);
+static int _FD_CACHE_Open(const char* sPath, const struct stat* pStat) {
+  _FD_CACHE_ENTRY* pEntry;
+  _FD_CACHE_ENTRY* pNext;
+  int64_t          Time;
+  int              fd;
+
+  Time = _SYS_GetTime_ms();
+  fd   = -1;
+  pthread_mutex_lock(&_FdCache.Lock);
+  for (pEntry = _FdCache.pFirst; pEntry != NULL; pEntry = pNext) {
+    pNext = pEntry->pNext;
+    if ((pEntry->RefCnt == 0) && ((Time - pEntry->TimeUsed) > FD_CACHE_IDLE_TIME)) {
+      _FD_CACHE_Drop(pEntry);
+    }
+  }
+  pEntry = _FD_CACHE_Find(sPath, strlen(sPath));
+  if (pEntry != NULL) {
+    if ((pEntry->Dev == pStat->st_dev) && (pEntry->Ino == pStat->st_ino)) {
+      //
+      // Hit. Move the entry to the front of the LRU list.
+      //
+      if (pEntry->pPrev != NULL) {
+        pEntry->pPrev->pNext = pEntry->pNext;
+        if (pEntry->pNext != NULL) {
+          pEntry->pNext->pPrev = pEntry->pPrev;
+        } else {
+          _FdCache.pLast = pEntry->pPrev;
+        }
+        pEntry->pPrev          = NULL;
+        pEntry->pNext          = _FdCache.pFirst;
+        _FdCache.pFirst->pPrev = pEntry;
+        _FdCache.pFirst        = pEntry;
+      }
+      pEntry->RefCnt++;
+      fd = pEntry->fd;
+    } else {
+      _FD_CACHE_Drop(pEntry);     // File has been replaced
+    }
+  }
+  pthread_mutex_unlock(&_FdCache.Lock);
+  return fd;
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_Create
+*       _FD_CACHE_Add
+*
+*  Function description
+*    Adds a descriptor that has just been opened to the cache. If the
+*    cache is full, the least recently used idle file is closed. If
+*    all files are in use, the descriptor is not cached.
+*
+*  Parameters
+*    sPath   Path of the file, normalized by _NormalizePath().
+*    fd      Descriptor, opened read-only.
+*    pStat   Stat of the descriptor.
 */
-static void* _FS_LINUX_Create(const char* sFileName) {
-  char acFilename[256];
-  _FILE_HANDLE fileHandle;
+static void _FD_CACHE_Add(const char* sPath, int fd, const struct stat* pStat) {
+  _FD_CACHE_ENTRY* pEntry;
+  unsigned         Len;
 
-  _ConvertFileName(acFilename, sFileName, sizeof(acFilename));
-  fileHandle = fopen (acFilename, "w+");
-  if (fileHandle == (NULL)) {
-    return (NULL);
+  if (fd >= _FdCache.NumFds) {
+    return;
+  }
+  Len = strlen(sPath);
+  pthread_mutex_lock(&_FdCache.Lock);
+  if (_FD_CACHE_Find(sPath, Len) != NULL) {
+    pthread_mutex_unlock(&_FdCache.Lock);   // Opened by another transfer in the meantime
+    return;
+  }
+  if (_FdCache.NumFiles >= _FdCache.MaxFiles) {
+    for (pEntry = _FdCache.pLast; pEntry != NULL; pEntry = pEntry->pPrev) {
+      if (pEntry->RefCnt == 0) {
+        break;
+      }
+    }
+    if (pEntry == NULL) {
+      pthread_mutex_unlock(&_FdCache.Lock);
+      return;
+    }
+    _FD_CACHE_Drop(pEntry);
+  }
+  pEntry = (_FD_CACHE_ENTRY*)calloc(1, sizeof(_FD_CACHE_ENTRY) + Len);
+  if (pEntry != NULL) {
+    memcpy(pEntry->acPath, sPath, Len + 1);
+    pEntry->Len    = Len;
+    pEntry->fd     = fd;
+    pEntry->RefCnt = 1;
+    pEntry->Dev    = pStat->st_dev;
+    pEntry->Ino    = pStat->st_ino;
+    pEntry->pNext  = _FdCache.pFirst;
+    if (_FdCache.pFirst != NULL) {
+      _FdCache.pFirst->pPrev = pEntry;
+    } else {
+      _FdCache.pLast = pEntry;
+    }
+    _FdCache.pFirst      = pEntry;
+    _FdCache.papByFd[fd] = pEntry;
+    _FdCache.NumFiles++;
   }
-  return (fileHandle);
+  pthread_mutex_unlock(&_FdCache.Lock);
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_WriteAt
+*       _FD_CACHE_Close
+*
+*  Function description
+*    Ends the use of a descriptor. A cached descriptor is kept open.
+*
+*  Return value
+*    1 :  Descriptor belongs to the cache
+*    0 :  Descriptor is not cached, the caller closes it
 */
-static int _FS_LINUX_WriteAt(void* hFile, void* pBuffer, uint32_t Pos, uint32_t NumBytes) {
-  uint32_t result;
+static int _FD_CACHE_Close(int fd) {
+  _FD_CACHE_ENTRY* pEntry;
+  int              r;
 
-  fseek ((FILE *) hFile, Pos, SEEK_SET);
-  result = fwrite ((void *) pBuffer, sizeof(uint8_t), (size_t) NumBytes, (FILE *)hFile);
-  if (result != NumBytes)
-    return (-1);
-  return (0);
+  if ((fd < 0) || (fd >= _FdCache.NumFds)) {
+    return 0;
+  }
+  r = 0;
+  pthread_mutex_lock(&_FdCache.Lock);
+  pEntry = _FdCache.papByFd[fd];
+  if (pEntry != NULL) {
+    r = 1;
+    pEntry->RefCnt--;
+    pEntry->TimeUsed = _SYS_GetTime_ms();
+    if (pEntry->IsStale && (pEntry->RefCnt == 0)) {
+      _FdCache.papByFd[fd] = NULL;
+      close(fd);
+      free(pEntry);
+    }
+  }
+  pthread_mutex_unlock(&_FdCache.Lock);
+  return r;
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_DeleteFile
-*/
-static int _FS_LINUX_DeleteFile(const char* sFilename) {
+*       _FD_CACHE_Invalidate
+*
+*  Function description
+*    Drops the entry of a file the server overwrites or deletes, or
+*    that no longer exists.
+*
+*  Parameters
+*    sPath   Path of the file as passed to the file system.
+*/
+static void _FD_CACHE_Invalidate(const char* sPath) {
+  _FD_CACHE_ENTRY* pEntry;
+  char             acPath[256];
 
-  char acFilename[256];
-  int32_t result;
+  if (_FdCache.papByFd == NULL) {
+    return;
+  }
+  strncpy(acPath, sPath, sizeof(acPath) - 1);
+  acPath[sizeof(acPath) - 1] = 0;
+  _NormalizePath(acPath);
+  pthread_mutex_lock(&_FdCache.Lock);
+  pEntry = _FD_CACHE_Find(acPath, strlen(acPath));
+  if (pEntry != NULL) {
+    _FD_CACHE_Drop(pEntry);
+  }
+  pthread_mutex_unlock(&_FdCache.Lock);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_Open
+*
+*  Function description
+*    Opens a file for reading. Access time updates are suppressed if
+*    the process is allowed to do so, as they cost a write per read.
+*    Regular files are shared through the open file cache.
+*/
+static void* _FS_LINUX_Open(const char* sFilename) {
+  char        acFilename[256];
+  struct stat st;
+  int         fd;
 
   _ConvertFileName(acFilename, sFilename, sizeof(acFilename));
-  result = remove ((const char *)acFilename);
-  if (result == -1)
-    return (-1);
-  return (0);
+  _NormalizePath(acFilename);
+  if (_FdCache.papByFd != NULL) {
+    if (stat(acFilename, &st) != 0) {
+      _FD_CACHE_Invalidate(acFilename);
+      return (NULL);
+    }
+    fd = _FD_CACHE_Open(acFilename, &st);
+    if (fd >= 0) {
+      return (_FS_LINUX_FD2HANDLE(fd));
+    }
+  }
+  fd = open(acFilename, O_RDONLY | O_NOATIME | O_CLOEXEC);
+  if ((fd < 0) && (errno == EPERM)) {
+    fd = open(acFilename, O_RDONLY | O_CLOEXEC);    // O_NOATIME is only permitted to the owner of the file
+  }
+  if (fd < 0) {
+    return (NULL);
+  }
+  if ((_FdCache.papByFd != NULL) && (fstat(fd, &st) == 0) && S_ISREG(st.st_mode)) {
+    _FD_CACHE_Add(acFilename, fd, &st);
+  }
+  return (_FS_LINUX_FD2HANDLE(fd));
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_MakeDir
+*       _FS_LINUX_Close
 */
-static int _FS_LINUX_MakeDir(const char* sDirname) {
-
-  char acDirname[256];
+static int _FS_LINUX_Close(void* hFile) {
   int32_t result;
 
-  _ConvertFileName(acDirname, sDirname, sizeof(acDirname));
-  /* Owner of file is granted all permissions. */
-  result = mkdir ((const char *)acDirname, 0700);
-  if (result == -1)
+  if (_FD_CACHE_Close(_FS_LINUX_HANDLE2FD(hFile))) {
+    return (0);
+  }
+  result = close(_FS_LINUX_HANDLE2FD(hFile));
+  if (result != 0)
     return (-1);
   return (0);
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_RemoveDir
+*       _FS_LINUX_ReadAt
 */
-static int _FS_LINUX_RemoveDir(const char* sDirname) {
+static int _FS_LINUX_ReadAt(void* hFile, void* pDest, uint32_t Pos, uint32_t NumBytes) {
+  ssize_t result;
+  uint8_t* p;
+
+  p = (uint8_t *)pDest;
+  while (NumBytes > 0) {
+    result = pread(_FS_LINUX_HANDLE2FD(hFile), p, (size_t) NumBytes, (off_t) Pos);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return (-1);
+    }
+    if (result == 0) {
+      return (-1);  // End of file reached before all bytes have been read
+    }
+    p        += result;
+    Pos      += result;
+    NumBytes -= result;
+  }
+  return (0);
+}
 
-  char acDirname[256];
-  int32_t result;
+/*********************************************************************
+*
+*       _FS_LINUX_GetLen
+*/
+static long _FS_LINUX_GetLen(void* hFile) {
+  struct stat st;
 
-  _ConvertFileName(acDirname, sDirname, sizeof(acDirname));
-  result = rmdir ((const char *)acDirname);
-  if (result == -1)
+  if (fstat(_FS_LINUX_HANDLE2FD(hFile), &st) != 0) {
     return (-1);
-  return (0);
+  }
+  return ((long)st.st_size);
 }
 
 /*********************************************************************
 *
-*       _FS_LINUX_ConfigBaseDir
+*       _FS_LINUX_GetFileDesc
+*
+*  Function description
+*    Returns the OS file descriptor of an open file so the IP stack
+*    can transfer it without copying the data through user space.
 */
-static void _FS_LINUX_ConfigBaseDir(const char* sDir) {
+static int _FS_LINUX_GetFileDesc(void* hFile) {
+  return _FS_LINUX_HANDLE2FD(hFile);
+}
 
-  if (strlen(sDir) < sizeof(_acBaseDir)) {
-    strncpy(_acBaseDir, sDir, sizeof(_acBaseDir));
+/*********************************************************************
+*
+*       _FS_LINUX_GetStat
+*
+*  Function description
+*    Reads the inode of a directory entry. Listings only pay for the
+*    stat if size, time or (on file systems without d_type) the type of
+*    an entry is requested, NLST usually does not need it at all.
+*
+*  Return value
+*    != NULL :  Stat of the entry
+*       NULL :  Entry can not be read
+*/
+static const struct stat* _FS_LINUX_GetStat(_FS_DIR_ENTRY* pEntry) {
+  if (pEntry->StatState == 0) {
+    pEntry->StatState = (fstatat(pEntry->hDir, pEntry->sName, &pEntry->Stat, 0) == 0) ? 1 : -1;
   }
+  return (pEntry->StatState > 0) ? &pEntry->Stat : NULL;
 }
 
 /*********************************************************************
 *
-*       SYS Net.
+*       Directory metadata batches.
+*
+*  LIST needs size and time of every entry. Fetching them one by one
+*  serializes the listing on the latency of the storage, which is
+*  significant on network file systems and disks. The entries are
+*  therefore collected in batches of STAT_BATCH_SIZE whose statx()
+*  requests are all submitted through an io_uring of the listing
+*  thread. Where io_uring is not available, STAT_THREADS threads fetch
+*  the entries of a batch in parallel.
 */
 
 /*********************************************************************
 *
-*       _SYS_NET_ListenSocket
+*       _STAT_RING_Create
+*
+*  Function description
+*    Sets up an io_uring with STAT_BATCH_SIZE submission entries.
+*
+*  Return value
+*    != NULL :  Ring
+*       NULL :  io_uring not available
 */
-static int _SYS_NET_ListenSocket(int *listenSocket, unsigned short portNumber) {
-  struct sockaddr_in  saServer;
-  int                 newSocket;
-  int                 nRet;
-  int                 one     = 1;
-  int                 status  = 0;
-
-  newSocket = socket(AF_INET, SOCK_STREAM, 0);
-  if (0 > newSocket) {
-    status = -1;
-    goto exit;
+static _STAT_RING* _STAT_RING_Create(void) {
+  struct io_uring_params Params;
+  _STAT_RING*            pRing;
+  uint8_t*               pSq;
+  uint8_t*               pCq;
+  size_t                 SqSize;
+  size_t                 CqSize;
+  int                    hRing;
+
+  memset(&Params, 0, sizeof(Params));
+  hRing = (int)syscall(__NR_io_uring_setup, STAT_BATCH_SIZE, &Params);
+  if (hRing < 0) {
+    return NULL;
   }
-
-  if (0 > setsockopt(newSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int))) {
-    status = -1;
-    goto error_cleanup;
+  SqSize = Params.sq_off.array + Params.sq_entries * sizeof(unsigned);
+  CqSize = Params.cq_off.cqes  + Params.cq_entries * sizeof(struct io_uring_cqe);
+  if (Params.features & IORING_FEAT_SINGLE_MMAP) {
+    SqSize = MAX(SqSize, CqSize);
   }
-
-  memset((unsigned char *)&saServer, 0x00, sizeof(struct sockaddr_in));
-
-  (saServer).sin_family         = AF_INET;
-  (saServer).sin_port           = htons((portNumber));
-  (saServer).sin_addr.s_addr    = INADDR_ANY;
-
-  nRet = bind(newSocket, (struct sockaddr*)&saServer, sizeof(struct sockaddr_in));
-  if (0 > nRet) {
-    status = -1;
-    goto error_cleanup;
+  pSq = (uint8_t*)mmap(NULL, SqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, hRing, IORING_OFF_SQ_RING);
+  if (pSq == MAP_FAILED) {
+    close(hRing);
+    return NULL;
+  }
+  pCq = pSq;
+  if ((Params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+    pCq = (uint8_t*)mmap(NULL, CqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, hRing, IORING_OFF_CQ_RING);
+    if (pCq == MAP_FAILED) {
+      munmap(pSq, SqSize);
+      close(hRing);
+      return NULL;
+    }
+  }
+  pRing = (_STAT_RING*)malloc(sizeof(_STAT_RING));
+  if (pRing != NULL) {
+    pRing->SqeSize = Params.sq_entries * sizeof(struct io_uring_sqe);
+    pRing->paSqe   = (struct io_uring_sqe*)mmap(NULL, pRing->SqeSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, hRing, IORING_OFF_SQES);
+    if (pRing->paSqe == MAP_FAILED) {
+      free(pRing);
+      pRing = NULL;
+    }
+  }
+  if (pRing == NULL) {
+    if (pCq != pSq) {
+      munmap(pCq, CqSize);
+    }
+    munmap(pSq, SqSize);
+    close(hRing);
+    return NULL;
   }
+  pRing->hRing     = hRing;
+  pRing->pSq       = pSq;
+  pRing->pCq       = pCq;
+  pRing->SqSize    = SqSize;
+  pRing->CqSize    = CqSize;
+  pRing->pSqTail   = (unsigned*)(pSq + Params.sq_off.tail);
+  pRing->pSqMask   = (unsigned*)(pSq + Params.sq_off.ring_mask);
+  pRing->paSqIndex = (unsigned*)(pSq + Params.sq_off.array);
+  pRing->pCqHead   = (unsigned*)(pCq + Params.cq_off.head);
+  pRing->pCqTail   = (unsigned*)(pCq + Params.cq_off.tail);
+  pRing->pCqMask   = (unsigned*)(pCq + Params.cq_off.ring_mask);
+  pRing->paCqe     = (struct io_uring_cqe*)(pCq + Params.cq_off.cqes);
+  pRing->IsFailed  = 0;
+  return pRing;
+}
 
-  nRet = listen(newSocket, SOMAXCONN);
-  if (nRet != 0) {
-    status = -1;
-    goto error_cleanup;
+/*********************************************************************
+*
+*       _STAT_RING_Destroy
+*
+*  Function description
+*    Unmaps and closes an io_uring set up by _STAT_RING_Create().
+*    No request may be in flight.
+*/
+static void _STAT_RING_Destroy(_STAT_RING* pRing) {
+  if (pRing == NULL) {
+    return;
+  }
+  munmap(pRing->paSqe, pRing->SqeSize);
+  if (pRing->pCq != pRing->pSq) {
+    munmap(pRing->pCq, pRing->CqSize);
   }
+  munmap(pRing->pSq, pRing->SqSize);
+  close(pRing->hRing);
+  free(pRing);
+}
 
-  *listenSocket = newSocket;
-  goto exit;
+/*********************************************************************
+*
+*       _STAT_RING_Run
+*
+*  Function description
+*    Submits a statx() request for every entry of a batch and calls pf
+*    for each entry as soon as its request completes. Entries whose
+*    request fails for other reasons than a missing file are left to
+*    _FS_LINUX_GetStat(). Once pf requests to stop, the remaining
+*    requests are only reaped, as the kernel still writes to the batch.
+*
+*  Return value
+*     0 :  O.K., pf has been called for all entries
+*     1 :  pf has requested to stop
+*    -1 :  Requests could not be submitted, pf has not been called
+*
+*  Notes
+*    (1) If io_uring_enter() fails while waiting for completions, the
+*        requests not consumed by the kernel yet are taken back and
+*        their entries are passed to pf without metadata, which is then
+*        fetched on demand. The requests in flight are reaped by polling
+*        the completion queue. The ring is marked as failed, so the
+*        caller falls back to stat() for the following batches.
+*/
+static int _STAT_RING_Run(_STAT_RING* pRing, _STAT_BATCH* pBatch, void* pContext, int (*pf)(void* pContext, void* pFileEntry)) {
+  struct io_uring_sqe* pSqe;
+  struct io_uring_cqe* pCqe;
+  _FS_DIR_ENTRY*       pEntry;
+  struct statx*        pStatx;
+  unsigned             SqTail;
+  unsigned             Head;
+  unsigned             Tail;
+  unsigned             Index;
+  int                  NumSubmit;
+  int                  NumDone;
+  int                  Stop;
+  int                  Res;
+  int                  r;
+  int                  i;
+
+  SqTail = *pRing->pSqTail;
+  for (i = 0; i < pBatch->NumEntries; i++) {
+    Index = (SqTail + i) & *pRing->pSqMask;
+    pSqe  = &pRing->paSqe[Index];
+    memset(pSqe, 0, sizeof(*pSqe));
+    pSqe->opcode    = IORING_OP_STATX;
+    pSqe->fd        = pBatch->aEntry[i].hDir;
+    pSqe->addr      = (uint64_t)(uintptr_t)pBatch->aEntry[i].sName;
+    pSqe->len       = STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME;
+    pSqe->off       = (uint64_t)(uintptr_t)&pBatch->aStatx[i];
+    pSqe->user_data = (uint64_t)i;
+    pRing->paSqIndex[Index] = Index;
+  }
+  __atomic_store_n(pRing->pSqTail, SqTail + pBatch->NumEntries, __ATOMIC_RELEASE);
+  do {
+    r = (int)syscall(__NR_io_uring_enter, pRing->hRing, pBatch->NumEntries, 0, 0, NULL, 0);
+  } while ((r < 0) && (errno == EINTR));
+  if (r <= 0) {
+    __atomic_store_n(pRing->pSqTail, SqTail, __ATOMIC_RELEASE);  // Nothing has been consumed, take the requests back
+    return -1;
+  }
+  NumSubmit = pBatch->NumEntries - r;
+  NumDone   = 0;
+  Stop      = 0;
+  for (;;) {
+    Head = *pRing->pCqHead;
+    Tail = __atomic_load_n(pRing->pCqTail, __ATOMIC_ACQUIRE);
+    while (Head != Tail) {
+      pCqe = &pRing->paCqe[Head & *pRing->pCqMask];
+      i    = (int)pCqe->user_data;
+      Res  = pCqe->res;
+      Head++;
+      __atomic_store_n(pRing->pCqHead, Head, __ATOMIC_RELEASE);
+      pEntry = &pBatch->aEntry[i];
+      pStatx = &pBatch->aStatx[i];
+      if (Res == 0) {
+        pEntry->Stat.st_mode  = pStatx->stx_mode;
+        pEntry->Stat.st_size  = (off_t)pStatx->stx_size;
+        pEntry->Stat.st_mtime = (time_t)pStatx->stx_mtime.tv_sec;
+        pEntry->StatState     = 1;
+      } else if (Res == -ENOENT) {
+        pEntry->StatState     = -1;
+      }
+      if (Stop == 0) {
+        Stop = pf(pContext, pEntry);
+      }
+      NumDone++;
+    }
+    if (NumDone == pBatch->NumEntries) {
+      return (Stop != 0) ? 1 : 0;
+    }
+    if (pRing->IsFailed) {
+      sched_yield();    // Requests in flight complete without io_uring_enter(), see (1)
+      continue;
+    }
+    r = (int)syscall(__NR_io_uring_enter, pRing->hRing, NumSubmit, 1, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (r > 0) {
+      NumSubmit -= r;
+    } else if ((r < 0) && (errno != EINTR)) {
+      pRing->IsFailed = 1;
+      SqTail += pBatch->NumEntries - NumSubmit;
+      __atomic_store_n(pRing->pSqTail, SqTail, __ATOMIC_RELEASE);  // Take back the requests not consumed, see (1)
+      for (i = pBatch->NumEntries - NumSubmit; i < pBatch->NumEntries; i++) {
+        if (Stop == 0) {
+          Stop = pf(pContext, &pBatch->aEntry[i]);  // Fetched on demand by _FS_LINUX_GetStat()
+        }
+        NumDone++;
+      }
+      NumSubmit = 0;
+    }
+  }
+}
 
-error_cleanup:
-  close(newSocket);
+/*********************************************************************
+*
+*       _STAT_POOL_Unlink
+*
+*  Function description
+*    Removes a batch from the list of batches waiting for stat threads.
+*    Has to be called with the pool locked.
+*/
+static void _STAT_POOL_Unlink(_STAT_BATCH* pBatch) {
+  _STAT_BATCH** ppBatch;
 
-exit:
-  return status;
+  for (ppBatch = &_StatPool.pFirst; *ppBatch != NULL; ppBatch = &(*ppBatch)->pNext) {
+    if (*ppBatch == pBatch) {
+      *ppBatch = pBatch->pNext;
+      break;
+    }
+  }
 }
 
-
 /*********************************************************************
 *
-*       _SYS_Sleep
+*       _STAT_POOL_FetchEntry
+*
+*  Function description
+*    Fetches the metadata of one entry of a batch and wakes the listing
+*    thread which may wait for it.
 */
-static int _SYS_NET_AcceptSocket(int *clientSocket, int listenSocket, signed int *isBreakSignalRequest) {
-  fd_set*             pSocketList     = NULL;
-  struct timeval      timeout;
-  struct sockaddr_in  sockAddr;
-  int                 nLen            = sizeof(struct sockaddr_in);
-  int          newClientSocket;
-  int             status          = 0;
+static void _STAT_POOL_FetchEntry(_STAT_BATCH* pBatch, int i) {
+  _FS_DIR_ENTRY* pEntry;
+  int            r;
+
+  pEntry = &pBatch->aEntry[i];
+  r      = fstatat(pEntry->hDir, pEntry->sName, &pEntry->Stat, 0);
+  pthread_mutex_lock(&_StatPool.Lock);
+  pEntry->StatState = (r == 0) ? 1 : -1;
+  pthread_cond_signal(&pBatch->Cond);
+  pthread_mutex_unlock(&_StatPool.Lock);
+}
 
-  if (NULL == (pSocketList = (fd_set*) malloc(sizeof(fd_set)))) {
-    status = -1;
-    goto exit;
+/*********************************************************************
+*
+*       _STAT_POOL_Run
+*
+*  Function description
+*    Lets the stat threads fetch the metadata of a batch. The calling
+*    thread helps fetching and calls pf for the entries in order as
+*    soon as they are available. Once pf requests to stop, the entries
+*    not claimed yet are dropped.
+*
+*  Return value
+*     0 :  O.K., pf has been called for all entries
+*     1 :  pf has requested to stop
+*/
+static int _STAT_POOL_Run(_STAT_BATCH* pBatch, void* pContext, int (*pf)(void* pContext, void* pFileEntry)) {
+  _STAT_BATCH**  ppBatch;
+  _FS_DIR_ENTRY* pEntry;
+  int            State;
+  int            Stop;
+  int            i;
+  int            j;
+
+  atomic_store(&pBatch->NextEntry, 0);
+  pBatch->NumHelpers = 0;
+  pBatch->pNext      = NULL;
+  pthread_mutex_lock(&_StatPool.Lock);
+  for (ppBatch = &_StatPool.pFirst; *ppBatch != NULL; ppBatch = &(*ppBatch)->pNext) {
+    ;
   }
+  *ppBatch = pBatch;
+  pthread_cond_broadcast(&_StatPool.Cond);
+  pthread_mutex_unlock(&_StatPool.Lock);
+  Stop = 0;
+  for (i = 0; i < pBatch->NumEntries; i++) {
+    pEntry = &pBatch->aEntry[i];
+    for (;;) {
+      pthread_mutex_lock(&_StatPool.Lock);
+      State = pEntry->StatState;
+      if ((State == 0) && (atomic_load(&pBatch->NextEntry) >= pBatch->NumEntries)) {
+        pthread_cond_wait(&pBatch->Cond, &_StatPool.Lock);  // All entries are claimed, wait for the stat threads
+        State = pEntry->StatState;
+      }
+      pthread_mutex_unlock(&_StatPool.Lock);
+      if (State != 0) {
+        break;
+      }
+      j = atomic_fetch_add(&pBatch->NextEntry, 1);
+      if (j < pBatch->NumEntries) {
+        _STAT_POOL_FetchEntry(pBatch, j);
+      }
+    }
+    Stop = pf(pContext, pEntry);
+    if (Stop != 0) {
+      atomic_store(&pBatch->NextEntry, pBatch->NumEntries);  // Stat threads do not claim further entries
+      break;
+    }
+  }
+  //
+  // Wait until no stat thread refers to the batch any more
+  //
+  pthread_mutex_lock(&_StatPool.Lock);
+  _STAT_POOL_Unlink(pBatch);
+  while (pBatch->NumHelpers > 0) {
+    pthread_cond_wait(&pBatch->Cond, &_StatPool.Lock);
+  }
+  pthread_mutex_unlock(&_StatPool.Lock);
+  return (Stop != 0) ? 1 : 0;
+}
 
-  while (1) {
-    /* add the socket of interest to the list */
-    FD_ZERO(pSocketList);
-    FD_SET(listenSocket, pSocketList);
-
-    /* poll every second to check break signal */
-    timeout.tv_sec  = 1;
-    timeout.tv_usec = 0;
+/*********************************************************************
+*
+*       _STAT_POOL_Task
+*
+*  Function description
+*    Stat thread. Fetches entries of the first queued batch.
+*/
+static void* _STAT_POOL_Task(void* pArg) {
+  _STAT_BATCH* pBatch;
+  int          i;
 
-    if (0 == select(FD_SETSIZE, pSocketList, NULL, NULL, &timeout))
-    {
-      /* time out occurred, check for break signal */
-      if (TRUE == *isBreakSignalRequest)
-          goto exit;
+  (void)pArg;
 
+  pthread_mutex_lock(&_StatPool.Lock);
+  for (;;) {
+    pBatch = _StatPool.pFirst;
+    if (pBatch == NULL) {
+      pthread_cond_wait(&_StatPool.Cond, &_StatPool.Lock);
       continue;
     }
-
-    newClientSocket = accept(listenSocket, (struct sockaddr*)&sockAddr, (socklen_t *)&nLen);
-    break;
+    pBatch->NumHelpers++;
+    pthread_mutex_unlock(&_StatPool.Lock);
+    for (;;) {
+      i = atomic_fetch_add(&pBatch->NextEntry, 1);
+      if (i >= pBatch->NumEntries) {
+        break;
+      }
+      _STAT_POOL_FetchEntry(pBatch, i);
+    }
+    pthread_mutex_lock(&_StatPool.Lock);
+    _STAT_POOL_Unlink(pBatch);                    // All entries are claimed
+    pBatch->NumHelpers--;
+    pthread_cond_signal(&pBatch->Cond);
   }
+  return NULL;
+}
 
-  if (0 > newClientSocket) {
-    status = -1;
-    goto exit;
+/*********************************************************************
+*
+*       _STAT_RING_IsSupported
+*
+*  Function description
+*    Checks if the kernel supports statx() requests through io_uring.
+*
+*  Return value
+*    1 :  Supported
+*    0 :  Not supported
+*
+*  Notes
+*    (1) Kernels 5.1 to 5.5 set up an io_uring but fail every statx()
+*        request with -EINVAL. They do not know IORING_REGISTER_PROBE
+*        either, which has been added together with IORING_OP_STATX.
+*/
+static int _STAT_RING_IsSupported(void) {
+  struct io_uring_params Params;
+  struct io_uring_probe* pProbe;
+  int                    hRing;
+  int                    r;
+
+  memset(&Params, 0, sizeof(Params));
+  hRing = (int)syscall(__NR_io_uring_setup, 1, &Params);
+  if (hRing < 0) {
+    return 0;
   }
-
-  *clientSocket = newClientSocket;
-
-exit:
-  if (NULL != pSocketList)
-    free(pSocketList);
-
-  return status;
-
+  r      = 0;
+  pProbe = (struct io_uring_probe*)calloc(1, sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op));
+  if (pProbe != NULL) {
+    if (syscall(__NR_io_uring_register, hRing, IORING_REGISTER_PROBE, pProbe, 256) == 0) {  // See (1)
+      if ((pProbe->last_op >= IORING_OP_STATX) && (pProbe->ops[IORING_OP_STATX].flags & IO_URING_OP_SUPPORTED)) {
+        r = 1;
+      }
+    }
+    free(pProbe);
+  }
+  close(hRing);
+  return r;
 }
 
 /*********************************************************************
 *
-*       _SYS_NET_ConnectSocket
+*       _STAT_Config
+*
+*  Function description
+*    Selects how LIST fetches metadata: through io_uring if the kernel
+*    permits it and supports statx() requests, else by NumThreads stat
+*    threads.
+*
+*  Return value
+*     0 :  O.K.
+*    -1 :  Error, threads could not be created
 */
-static int _SYS_NET_ConnectSocket(int *pConnectSocket, unsigned char *pIpAddress, unsigned short portNo) {
-  struct sockaddr_in  server;
-  int             status = 0;
+static int _STAT_Config(unsigned NumThreads) {
+  pthread_t ThreadId;
 
-  if (0 >= (*pConnectSocket = socket(AF_INET, SOCK_STREAM, 0))) {
-    status = -1;
-    goto exit;
+  if (_STAT_RING_IsSupported()) {
+    _StatPool.UseRing = 1;
+    return 0;
   }
-
-  memset((unsigned char *)&server, 0x00, sizeof(struct sockaddr_in));
-
-  (server).sin_family         = AF_INET;
-  (server).sin_port           = htons((portNo));
-
-  inet_pton(AF_INET, (char *)pIpAddress, &server.sin_addr);
-
-  if (0 != connect(*pConnectSocket, (struct sockaddr *)&server, sizeof(server))) {
-    status = -1;
-
+  _StatPool.NumThreads = NumThreads;
+  while (NumThreads-- > 0) {
+    if (pthread_create(&ThreadId, NULL, _STAT_POOL_Task, NULL) != 0) {
+      return -1;
+    }
+    pthread_detach(ThreadId);
   }
-
-exit:
-  return status;
+  return 0;
 }
 
-
 /*********************************************************************
 *
-*       _SYS_NET_CloseSocket
-*/
-static int _SYS_NET_CloseSocket(int socket) {
-  close(socket);
+*       _FS_LINUX_StatBatch
+*
+*  Function description
+*    Calls pf for all entries of a batch after fetching their metadata.
+*
+*  Return value
+*     0 :  O.K., pf has been called for all entries
+*     1 :  pf has requested to stop
+*/
+static int _FS_LINUX_StatBatch(_STAT_BATCH* pBatch, void* pContext, int (*pf)(void* pContext, void* pFileEntry)) {
+  int r;
+  int i;
+
+  if (_StatPool.UseRing && (_pStatRing == NULL) && (_StatRingFailed == 0)) {
+    _pStatRing      = _STAT_RING_Create();
+    _StatRingFailed = (_pStatRing == NULL);
+  }
+  if (_pStatRing != NULL) {
+    r = _STAT_RING_Run(_pStatRing, pBatch, pContext, pf);
+    if (_pStatRing->IsFailed) {
+      _STAT_RING_Destroy(_pStatRing);
+      _StatRingFailed = 1;    // The following batches are fetched by stat()
+      _pStatRing      = NULL;
+    }
+    if (r >= 0) {
+      return r;
+    }
+  } else if (_StatPool.NumThreads > 0) {
+    return _STAT_POOL_Run(pBatch, pContext, pf);
+  }
+  for (i = 0; i < pBatch->NumEntries; i++) {
+    if (pf(pContext, &pBatch->aEntry[i]) != 0) {  // Fetched on demand by _FS_LINUX_GetStat()
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       Directory read-ahead.
+*
+*  LIST -R lists the subdirectories of a directory one after the other.
+*  While the listing thread works on one of them, TREE_THREADS threads
+*  read the following siblings and fetch the metadata of their entries,
+*  so the listing thread finds them in the caches of the kernel. This
+*  overlaps the latency of the storage for sibling directories, while
+*  the listing itself stays in order.
+*/
+
+/*********************************************************************
+*
+*       _TREE_POOL_Read
+*
+*  Function description
+*    Reads a directory and the metadata of all its entries.
+*/
+static void _TREE_POOL_Read(const char* sDir, uint8_t* pBuffer) {
+  struct dirent64* pDirEnt;
+  struct stat      Stat;
+  ssize_t          NumBytes;
+  ssize_t          Off;
+  int              hDir;
+
+  hDir = open(sDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (hDir < 0) {
+    return;
+  }
+  for (;;) {
+    NumBytes = getdents64(hDir, pBuffer, DIR_BUFFER_SIZE);
+    if (NumBytes <= 0) {
+      break;
+    }
+    for (Off = 0; Off < NumBytes; Off += pDirEnt->d_reclen) {
+      pDirEnt = (struct dirent64*)(pBuffer + Off);
+      fstatat(hDir, pDirEnt->d_name, &Stat, 0);
+    }
+  }
+  close(hDir);
+}
+
+/*********************************************************************
+*
+*       _TREE_POOL_Task
+*
+*  Function description
+*    Read-ahead thread. Reads the queued directories.
+*/
+static void* _TREE_POOL_Task(void* pArg) {
+  char     acDir[256];
+  uint8_t* pBuffer;
+
+  (void)pArg;
+
+  pBuffer = (uint8_t*)malloc(DIR_BUFFER_SIZE);
+  if (pBuffer == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&_TreePool.Lock);
+  for (;;) {
+    if (_TreePool.RdPos == _TreePool.WrPos) {
+      pthread_cond_wait(&_TreePool.Cond, &_TreePool.Lock);
+      continue;
+    }
+    strcpy(acDir, _TreePool.aacPath[_TreePool.RdPos % TREE_QUEUE_SIZE]);
+    _TreePool.RdPos++;
+    pthread_mutex_unlock(&_TreePool.Lock);
+    _TREE_POOL_Read(acDir, pBuffer);
+    pthread_mutex_lock(&_TreePool.Lock);
+  }
+  return NULL;
+}
+
+/*********************************************************************
+*
+*       _TREE_POOL_Queue
+*
+*  Function description
+*    Queues the subdirectories following *pOff in a buffer of directory
+*    entries for read-ahead, until the queue is full. *pOff is advanced
+*    behind the last entry queued or skipped.
+*
+*  Parameters
+*    sDir       Directory the entries belong to, with trailing slash.
+*    pBuffer    Entries returned by getdents64().
+*    NumBytes   Number of bytes in pBuffer.
+*    pOff       In: First entry to look at. Out: First entry not queued yet.
+*/
+static void _TREE_POOL_Queue(const char* sDir, const uint8_t* pBuffer, ssize_t NumBytes, ssize_t* pOff) {
+  const struct dirent64* pDirEnt;
+  size_t                 LenDir;
+  ssize_t                Off;
+
+  LenDir = strlen(sDir);
+  pthread_mutex_lock(&_TreePool.Lock);
+  for (Off = *pOff; Off < NumBytes; Off += pDirEnt->d_reclen) {
+    pDirEnt = (const struct dirent64*)(pBuffer + Off);
+    if ((pDirEnt->d_type != DT_DIR) || (strcmp(pDirEnt->d_name, ".") == 0) || (strcmp(pDirEnt->d_name, "..") == 0)) {
+      continue;
+    }
+    if (LenDir + strlen(pDirEnt->d_name) >= sizeof(_TreePool.aacPath[0])) {
+      continue;
+    }
+    if (_TreePool.WrPos - _TreePool.RdPos == TREE_QUEUE_SIZE) {
+      break;                                        // Full, queued later or listed without read-ahead
+    }
+    strcpy(_TreePool.aacPath[_TreePool.WrPos % TREE_QUEUE_SIZE], sDir);
+    strcpy(_TreePool.aacPath[_TreePool.WrPos % TREE_QUEUE_SIZE] + LenDir, pDirEnt->d_name);
+    _TreePool.WrPos++;
+    pthread_cond_signal(&_TreePool.Cond);
+  }
+  pthread_mutex_unlock(&_TreePool.Lock);
+  *pOff = Off;
+}
+
+/*********************************************************************
+*
+*       _TREE_Config
+*
+*  Function description
+*    Starts NumThreads read-ahead threads. Nothing is started on a
+*    single CPU, where the threads would compete with the listing
+*    thread instead of working beside it.
+*
+*  Return value
+*     0 :  O.K.
+*    -1 :  Error, threads could not be created
+*/
+static int _TREE_Config(unsigned NumThreads) {
+  pthread_t ThreadId;
+
+  if (sysconf(_SC_NPROCESSORS_ONLN) < 2) {
+    return 0;
+  }
+  while (NumThreads-- > 0) {
+    if (pthread_create(&ThreadId, NULL, _TREE_POOL_Task, NULL) != 0) {
+      return -1;
+    }
+    pthread_detach(ThreadId);
+    _TreePool.NumThreads++;
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_ForEachDirEntryEx
+*
+*  Function description
+*    Reads the directory in large batches with getdents64() and calls
+*    pf for every entry until pf returns != 0. Metadata is fetched ahead
+*    in batches if IP_FS_DIR_ENTRY_STAT is set, else on demand by
+*    _FS_LINUX_GetStat(). Only a single getdents64() buffer and batch
+*    are held, however large the directory is. If IP_FS_DIR_ENTRY_TREE
+*    is set, the subdirectories following the entry passed to pf are
+*    read ahead. Symbolic links are not reported as directories then,
+*    so a link to a parent directory can not make a tree walk loop.
+*/
+static void _FS_LINUX_ForEachDirEntryEx(void* pContext, const char* sDir, unsigned Flags, int (*pf)(void* pContext, void* pFileEntry)) {
+  char               acDir[256];
+  _FS_DIR_ENTRY      Entry;
+  _FS_DIR_ENTRY*     pEntry;
+  _STAT_BATCH*       pBatch;
+  struct dirent64*   pDirEnt;
+  uint8_t*           pBuffer;
+  ssize_t            NumBytes;
+  ssize_t            Off;
+  ssize_t            OffAhead;
+  int                Stop;
+
+  _ConvertFileName(acDir, sDir, sizeof(acDir));
+  pBuffer = (uint8_t*)malloc(DIR_BUFFER_SIZE);
+  if (pBuffer == NULL) {
+    return;
+  }
+  pBatch = NULL;
+  if (Flags & IP_FS_DIR_ENTRY_STAT) {
+    pBatch = (_STAT_BATCH*)malloc(sizeof(_STAT_BATCH));
+    if (pBatch != NULL) {
+      pthread_cond_init(&pBatch->Cond, NULL);
+      pBatch->NumEntries = 0;
+    }
+  }
+  Entry.hDir = open(acDir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (Entry.hDir >= 0) {
+    Stop = 0;
+    while (Stop == 0) {
+      NumBytes = getdents64(Entry.hDir, pBuffer, DIR_BUFFER_SIZE);
+      if (NumBytes <= 0) {
+        break;
+      }
+      OffAhead = 0;
+      for (Off = 0; (Off < NumBytes) && (Stop == 0); Off += pDirEnt->d_reclen) {
+        pDirEnt = (struct dirent64*)(pBuffer + Off);
+        if ((Flags & IP_FS_DIR_ENTRY_TREE) && (_TreePool.NumThreads > 0) && (pDirEnt->d_type == DT_DIR)) {
+          OffAhead = MAX(OffAhead, Off + pDirEnt->d_reclen);
+          _TREE_POOL_Queue(acDir, pBuffer, NumBytes, &OffAhead);
+        }
+        pEntry  = (pBatch != NULL) ? &pBatch->aEntry[pBatch->NumEntries++] : &Entry;
+        pEntry->hDir      = Entry.hDir;
+        pEntry->sName     = pDirEnt->d_name;
+        pEntry->Type      = pDirEnt->d_type;
+        pEntry->StatState = 0;
+        pEntry->IsNoFollow = (Flags & IP_FS_DIR_ENTRY_TREE) ? 1 : 0;
+        if (pBatch == NULL) {
+          Stop = pf(pContext, pEntry);
+        } else if (pBatch->NumEntries == STAT_BATCH_SIZE) {
+          Stop = _FS_LINUX_StatBatch(pBatch, pContext, pf);
+          pBatch->NumEntries = 0;
+        }
+      }
+      //
+      // Names refer to the buffer, the batch has to be completed before it is reused
+      //
+      if ((pBatch != NULL) && (pBatch->NumEntries > 0)) {
+        if (Stop == 0) {
+          Stop = _FS_LINUX_StatBatch(pBatch, pContext, pf);
+        }
+        pBatch->NumEntries = 0;
+      }
+    }
+    close(Entry.hDir);                            // Released right away if the listing has been stopped
+  }
+  if (pBatch != NULL) {
+    pthread_cond_destroy(&pBatch->Cond);
+    free(pBatch);
+  }
+  free(pBuffer);
+}
+
+/*********************************************************************
+*
+*       _cbForEachDirEntry
+*/
+static int _cbForEachDirEntry(void* pContext, void* pFileEntry) {
+  _FS_FOR_EACH* pForEach;
+
+  pForEach = (_FS_FOR_EACH*)pContext;
+  pForEach->pf(pForEach->pContext, pFileEntry);
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_ForEachDirEntry
+*/
+static void _FS_LINUX_ForEachDirEntry(void* pContext, const char* sDir, void (*pf)(void* pContext, void* pFileEntry)) {
+  _FS_FOR_EACH ForEach;
+
+  ForEach.pContext = pContext;
+  ForEach.pf       = pf;
+  _FS_LINUX_ForEachDirEntryEx(&ForEach, sDir, 0, _cbForEachDirEntry);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_GetDirEntryFileName
+*/
+static void _FS_LINUX_GetDirEntryFileName(void* pFileEntry, char* sFileName, uint32_t SizeOfBuffer) {
+  _FS_DIR_ENTRY* pEntry;
+
+  pEntry = (_FS_DIR_ENTRY*)pFileEntry;
+
+  strncpy(sFileName, pEntry->sName, SizeOfBuffer);
+  *(sFileName + SizeOfBuffer - 1) = 0;
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_GetDirEntryFileSize
+*/
+static uint32_t _FS_LINUX_GetDirEntryFileSize (void* pFileEntry, uint32_t* pFileSizeHigh) {
+  const struct stat* pStat;
+
+  pStat = _FS_LINUX_GetStat((_FS_DIR_ENTRY*)pFileEntry);
+  if (pStat == NULL) {
+    return 0;
+  }
+  if (pFileSizeHigh != NULL) {
+    *pFileSizeHigh = (uint32_t)((uint64_t)pStat->st_size >> 32);
+  }
+  return ((uint32_t)pStat->st_size);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_GetDirEntryFileTime
+*/
+static uint32_t _FS_LINUX_GetDirEntryFileTime (void* pFileEntry) {
+  const struct stat* pStat;
+
+  pStat = _FS_LINUX_GetStat((_FS_DIR_ENTRY*)pFileEntry);
+  if (pStat == NULL) {
+    return 0;
+  }
+  return _SYS_ToTimeDate(pStat->st_mtime);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_GetDirEntryAttributes
+*
+*  Function description
+*    The type comes from the directory entry. Only symbolic links, which
+*    are listed as their target, and file systems that do not report the
+*    type need a stat.
+*
+*  Return value
+*    bit 0   - 0: File, 1:Directory
+*/
+static int _FS_LINUX_GetDirEntryAttributes(void* pFileEntry) {
+  _FS_DIR_ENTRY*     pEntry;
+  const struct stat* pStat;
+  struct stat        Stat;
+
+  pEntry = (_FS_DIR_ENTRY*)pFileEntry;
+  if ((pEntry->Type != DT_UNKNOWN) && ((pEntry->Type != DT_LNK) || pEntry->IsNoFollow)) {
+    return (pEntry->Type == DT_DIR) ? 1 : 0;
+  }
+  if (pEntry->IsNoFollow) {
+    return ((fstatat(pEntry->hDir, pEntry->sName, &Stat, AT_SYMLINK_NOFOLLOW) == 0) && S_ISDIR(Stat.st_mode)) ? 1 : 0;
+  }
+  pStat = _FS_LINUX_GetStat(pEntry);
+  return ((pStat != NULL) && S_ISDIR(pStat->st_mode)) ? 1 : 0;
+}
+
+/*********************************************************************
+*
+*       File metadata cache.
+*
+*  Clients synchronizing a tree send SIZE and MDTM for every file, over
+*  and over. Size, time and type of files are therefore kept in a hash
+*  table shared by all sessions, with the least recently used entries
+*  dropped beyond STAT_CACHE_NUM_ENTRIES. The directories holding
+*  cached entries are watched by inotify, an entry is dropped when its
+*  file changes. Files the server itself creates or deletes are dropped
+*  right away, before the client gets the reply. As inotify does not
+*  see every change (e.g. made by other hosts on NFS), entries are read
+*  again after STAT_CACHE_MAX_AGE. Entries are keyed by the path the
+*  client has used, normalized by _NormalizePath(). Paths with ".." are
+*  not cached. A change made through another name of the file (a link)
+*  is only seen through inotify. Files modified within the last
+*  STAT_CACHE_MIN_AGE seconds are not cached at all, they are likely
+*  being written.
+*/
+
+/*********************************************************************
+*
+*       _STAT_CACHE_Hash
+*
+*  Function description
+*    FNV-1a hash of a path.
+*/
+static uint32_t _STAT_CACHE_Hash(const char* s, unsigned Len) {
+  uint32_t Hash;
+
+  Hash = 2166136261u;
+  while (Len--) {
+    Hash = (Hash ^ (uint8_t)*s++) * 16777619u;
+  }
+  return Hash;
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_GetDir
+*
+*  Function description
+*    Returns the directory of a path, which is watched for changes from
+*    now on. The directory is kept until it is released by
+*    _STAT_CACHE_ReleaseDir(). Has to be called with the cache locked.
+*
+*  Parameters
+*    sPath   Normalized path of an entry of the directory.
+*    Len     Length of the directory in sPath, incl. the trailing '/'.
+*
+*  Return value
+*    != NULL :  Directory
+*       NULL :  Out of memory
+*/
+static _STAT_CACHE_DIR* _STAT_CACHE_GetDir(const char* sPath, unsigned Len) {
+  _STAT_CACHE_DIR** ppBucket;
+  _STAT_CACHE_DIR*  pDir;
+  uint32_t          Hash;
+
+  Hash     = _STAT_CACHE_Hash(sPath, Len);
+  ppBucket = &_StatCache.apDir[Hash % STAT_CACHE_NUM_DIRS];
+  for (pDir = *ppBucket; pDir != NULL; pDir = pDir->pNextHash) {
+    if ((pDir->Hash == Hash) && (strncmp(pDir->acPath, sPath, Len) == 0) && (pDir->acPath[Len] == 0)) {
+      pDir->RefCnt++;
+      return pDir;
+    }
+  }
+  pDir = (_STAT_CACHE_DIR*)calloc(1, sizeof(_STAT_CACHE_DIR) + Len);
+  if (pDir == NULL) {
+    return NULL;
+  }
+  memcpy(pDir->acPath, sPath, Len);
+  pDir->Hash   = Hash;
+  pDir->RefCnt = 1;
+  pDir->wd     = -1;
+  if (_StatCache.hNotify >= 0) {
+    pDir->wd = inotify_add_watch(_StatCache.hNotify, pDir->acPath, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+  }
+  pDir->pNextHash = *ppBucket;
+  *ppBucket       = pDir;
+  pDir->pNext     = _StatCache.pFirstDir;
+  if (_StatCache.pFirstDir != NULL) {
+    _StatCache.pFirstDir->pPrev = pDir;
+  }
+  _StatCache.pFirstDir = pDir;
+  return pDir;
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_ReleaseDir
+*
+*  Function description
+*    Ends a use of a directory. Once it holds no entries and no lookup
+*    is in progress, the directory is freed and its inotify watch is
+*    removed, unless another directory record (the same directory
+*    reached by a different path) refers to it.
+*    Has to be called with the cache locked.
+*/
+static void _STAT_CACHE_ReleaseDir(_STAT_CACHE_DIR* pDir) {
+  _STAT_CACHE_DIR** ppBucket;
+  _STAT_CACHE_DIR*  p;
+
+  if (--pDir->RefCnt > 0) {
+    return;
+  }
+  ppBucket = &_StatCache.apDir[pDir->Hash % STAT_CACHE_NUM_DIRS];
+  while (*ppBucket != pDir) {
+    ppBucket = &(*ppBucket)->pNextHash;
+  }
+  *ppBucket = pDir->pNextHash;
+  if (pDir->pPrev != NULL) {
+    pDir->pPrev->pNext = pDir->pNext;
+  } else {
+    _StatCache.pFirstDir = pDir->pNext;
+  }
+  if (pDir->pNext != NULL) {
+    pDir->pNext->pPrev = pDir->pPrev;
+  }
+  if (pDir->wd >= 0) {
+    for (p = _StatCache.pFirstDir; p != NULL; p = p->pNext) {
+      if (p->wd == pDir->wd) {
+        break;
+      }
+    }
+    if (p == NULL) {
+      inotify_rm_watch(_StatCache.hNotify, pDir->wd);
+    }
+  }
+  free(pDir);
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_Find
+*
+*  Function description
+*    Looks up the entry of a path. Has to be called with the cache locked.
+*/
+static _STAT_CACHE_ENTRY* _STAT_CACHE_Find(const char* sPath, uint32_t Hash) {
+  _STAT_CACHE_ENTRY* pEntry;
+
+  for (pEntry = _StatCache.apEntry[Hash % _COUNTOF(_StatCache.apEntry)]; pEntry != NULL; pEntry = pEntry->pNextHash) {
+    if ((pEntry->Hash == Hash) && (strcmp(pEntry->acPath, sPath) == 0)) {
+      break;
+    }
+  }
+  return pEntry;
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_Drop
+*
+*  Function description
+*    Removes an entry from the cache and frees it.
+*    Has to be called with the cache locked.
+*/
+static void _STAT_CACHE_Drop(_STAT_CACHE_ENTRY* pEntry) {
+  _STAT_CACHE_ENTRY** ppBucket;
+
+  ppBucket = &_StatCache.apEntry[pEntry->Hash % _COUNTOF(_StatCache.apEntry)];
+  while (*ppBucket != pEntry) {
+    ppBucket = &(*ppBucket)->pNextHash;
+  }
+  *ppBucket = pEntry->pNextHash;
+  if (pEntry->pPrev != NULL) {
+    pEntry->pPrev->pNext = pEntry->pNext;
+  } else {
+    _StatCache.pFirst = pEntry->pNext;
+  }
+  if (pEntry->pNext != NULL) {
+    pEntry->pNext->pPrev = pEntry->pPrev;
+  } else {
+    _StatCache.pLast = pEntry->pPrev;
+  }
+  if (pEntry->pPrevInDir != NULL) {
+    pEntry->pPrevInDir->pNextInDir = pEntry->pNextInDir;
+  } else {
+    pEntry->pDir->pFirst = pEntry->pNextInDir;
+  }
+  if (pEntry->pNextInDir != NULL) {
+    pEntry->pNextInDir->pPrevInDir = pEntry->pPrevInDir;
+  }
+  _StatCache.NumEntries--;
+  _STAT_CACHE_ReleaseDir(pEntry->pDir);
+  free(pEntry);
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_Add
+*
+*  Function description
+*    Adds the metadata of a file to the cache. The least recently used
+*    entry is dropped if the cache is full.
+*    Has to be called with the cache locked.
+*/
+static void _STAT_CACHE_Add(const char* sPath, uint32_t Hash, _STAT_CACHE_DIR* pDir, const IP_FS_FILE_STAT* pStat) {
+  _STAT_CACHE_ENTRY** ppBucket;
+  _STAT_CACHE_ENTRY*  pEntry;
+  unsigned            Len;
+
+  Len    = strlen(sPath);
+  pEntry = (_STAT_CACHE_ENTRY*)calloc(1, sizeof(_STAT_CACHE_ENTRY) + Len);
+  if (pEntry == NULL) {
+    return;
+  }
+  if (_StatCache.NumEntries >= STAT_CACHE_NUM_ENTRIES) {
+    _STAT_CACHE_Drop(_StatCache.pLast);
+  }
+  memcpy(pEntry->acPath, sPath, Len + 1);
+  pEntry->sName      = pEntry->acPath + strlen(pDir->acPath);
+  pEntry->Hash       = Hash;
+  pEntry->Stat       = *pStat;
+  pEntry->TimeFilled = _SYS_GetTime_ms();
+  pEntry->pDir       = pDir;
+  pDir->RefCnt++;
+  pEntry->pNextInDir = pDir->pFirst;
+  if (pDir->pFirst != NULL) {
+    pDir->pFirst->pPrevInDir = pEntry;
+  }
+  pDir->pFirst      = pEntry;
+  ppBucket          = &_StatCache.apEntry[Hash % _COUNTOF(_StatCache.apEntry)];
+  pEntry->pNextHash = *ppBucket;
+  *ppBucket         = pEntry;
+  pEntry->pNext     = _StatCache.pFirst;
+  if (_StatCache.pFirst != NULL) {
+    _StatCache.pFirst->pPrev = pEntry;
+  } else {
+    _StatCache.pLast = pEntry;
+  }
+  _StatCache.pFirst = pEntry;
+  _StatCache.NumEntries++;
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_Task
+*
+*  Function description
+*    Drops the entries of files inotify reports changes for. Events
+*    without a name (directory deleted, moved or no longer watched)
+*    drop all entries of the directory.
+*/
+static void* _STAT_CACHE_Task(void* pArg) {
+  union {
+    struct inotify_event Event;
+    char                 ac[4096];
+  } Buffer;
+  const struct inotify_event* pEvent;
+  _STAT_CACHE_DIR*            pDir;
+  _STAT_CACHE_DIR*            pNextDir;
+  _STAT_CACHE_ENTRY*          pEntry;
+  _STAT_CACHE_ENTRY*          pNext;
+  ssize_t                     NumBytes;
+  ssize_t                     Off;
+
+  (void)pArg;
+
+  for (;;) {
+    NumBytes = read(_StatCache.hNotify, &Buffer, sizeof(Buffer));
+    if (NumBytes <= 0) {
+      if ((NumBytes < 0) && (errno == EINTR)) {
+        continue;
+      }
+      break;
+    }
+    pthread_mutex_lock(&_StatCache.Lock);
+    for (Off = 0; Off < NumBytes; Off += sizeof(struct inotify_event) + pEvent->len) {
+      pEvent = (const struct inotify_event*)(Buffer.ac + Off);
+      if (pEvent->mask & IN_Q_OVERFLOW) {
+        while (_StatCache.pFirst != NULL) {   // Events have been lost
+          _STAT_CACHE_Drop(_StatCache.pFirst);
+        }
+      } else {
+        for (pDir = _StatCache.pFirstDir; pDir != NULL; pDir = pNextDir) {
+          pNextDir = pDir->pNext;
+          if (pDir->wd != pEvent->wd) {
+            continue;
+          }
+          pDir->RefCnt++;                     // Keep the directory while its entries are dropped
+          for (pEntry = pDir->pFirst; pEntry != NULL; pEntry = pNext) {
+            pNext = pEntry->pNextInDir;
+            if ((pEvent->len == 0) || (strcmp(pEntry->sName, pEvent->name) == 0)) {
+              _STAT_CACHE_Drop(pEntry);
+            }
+          }
+          _STAT_CACHE_ReleaseDir(pDir);
+        }
+      }
+    }
+    _StatCache.Generation++;
+    pthread_mutex_unlock(&_StatCache.Lock);
+  }
+  return NULL;
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_Init
+*
+*  Function description
+*    Starts watching for changes. Without inotify, entries only expire
+*    by age and by changes of the server itself.
+*/
+static void _STAT_CACHE_Init(void) {
+  pthread_t ThreadId;
+
+  _StatCache.hNotify = inotify_init1(IN_CLOEXEC);
+  if (_StatCache.hNotify < 0) {
+    return;
+  }
+  if (pthread_create(&ThreadId, NULL, _STAT_CACHE_Task, NULL) != 0) {
+    close(_StatCache.hNotify);
+    _StatCache.hNotify = -1;
+    return;
+  }
+  pthread_detach(ThreadId);
+}
+
+/*********************************************************************
+*
+*       _STAT_CACHE_Invalidate
+*
+*  Function description
+*    Drops the entry of a file the server changes. If the path has a
+*    ".." component, the entry can not be found and all entries are
+*    dropped.
+*
+*  Parameters
+*    sPath   Path of the file as passed to the file system.
+*/
+static void _STAT_CACHE_Invalidate(const char* sPath) {
+  _STAT_CACHE_ENTRY* pEntry;
+  char               acPath[256];
+
+  strncpy(acPath, sPath, sizeof(acPath) - 1);
+  acPath[sizeof(acPath) - 1] = 0;
+  pthread_mutex_lock(&_StatCache.Lock);
+  if (_NormalizePath(acPath) < 0) {
+    while (_StatCache.pFirst != NULL) {
+      _STAT_CACHE_Drop(_StatCache.pFirst);
+    }
+  } else {
+    pEntry = _STAT_CACHE_Find(acPath, _STAT_CACHE_Hash(acPath, strlen(acPath)));
+    if (pEntry != NULL) {
+      _STAT_CACHE_Drop(pEntry);
+    }
+  }
+  _StatCache.Generation++;
+  pthread_mutex_unlock(&_StatCache.Lock);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_GetFileStat
+*
+*  Function description
+*    Returns size, time and type of a file from the metadata cache. On a
+*    miss, the directory is watched before the file is read, so a change
+*    in between is not missed; the result is only cached if no change
+*    has been reported while the file was read.
+*
+*  Return value
+*      0 :  O.K.
+*     -1 :  File does not exist
+*/
+static int _FS_LINUX_GetFileStat(const char* sFilename, IP_FS_FILE_STAT* pStat) {
+  char               acFilename[256];
+  _STAT_CACHE_ENTRY* pEntry;
+  _STAT_CACHE_DIR*   pDir;
+  struct timespec    ts;
+  struct stat        st;
+  const char*        s;
+  uint32_t           Hash;
+  unsigned           Generation;
+  unsigned           Len;
+  int                IsCacheable;
+
+  _ConvertFileName(acFilename, sFilename, sizeof(acFilename));
+  IsCacheable = (_NormalizePath(acFilename) == 0);
+  Len  = strlen(acFilename);
+  Hash = _STAT_CACHE_Hash(acFilename, Len);
+  pthread_mutex_lock(&_StatCache.Lock);
+  pEntry = IsCacheable ? _STAT_CACHE_Find(acFilename, Hash) : NULL;
+  if ((pEntry != NULL) && ((_SYS_GetTime_ms() - pEntry->TimeFilled) > STAT_CACHE_MAX_AGE)) {
+    _STAT_CACHE_Drop(pEntry);
+    pEntry = NULL;
+  }
+  if (pEntry != NULL) {
+    //
+    // Hit. Move the entry to the front of the LRU list.
+    //
+    if (pEntry->pPrev != NULL) {
+      pEntry->pPrev->pNext = pEntry->pNext;
+      if (pEntry->pNext != NULL) {
+        pEntry->pNext->pPrev = pEntry->pPrev;
+      } else {
+        _StatCache.pLast = pEntry->pPrev;
+      }
+      pEntry->pPrev            = NULL;
+      pEntry->pNext            = _StatCache.pFirst;
+      _StatCache.pFirst->pPrev = pEntry;
+      _StatCache.pFirst        = pEntry;
+    }
+    *pStat = pEntry->Stat;
+    pthread_mutex_unlock(&_StatCache.Lock);
+    return 0;
+  }
+  //
+  // Miss. Watch the directory, then read the file.
+  //
+  pDir = NULL;
+  s    = strrchr(acFilename, '/');
+  if (IsCacheable && (s != NULL) && (s[1] != 0)) {
+    pDir = _STAT_CACHE_GetDir(acFilename, s + 1 - acFilename);
+  }
+  Generation = _StatCache.Generation;
+  pthread_mutex_unlock(&_StatCache.Lock);
+  if (stat(acFilename, &st) != 0) {
+    if (pDir != NULL) {
+      pthread_mutex_lock(&_StatCache.Lock);
+      _STAT_CACHE_ReleaseDir(pDir);
+      pthread_mutex_unlock(&_StatCache.Lock);
+    }
+    return -1;
+  }
+  memset(pStat, 0, sizeof(*pStat));
+  pStat->FileSize     = (uint32_t)st.st_size;
+  pStat->FileSizeHigh = (uint32_t)((uint64_t)st.st_size >> 32);
+  pStat->FileTime     = _SYS_ToTimeDate(st.st_mtime);
+  pStat->Attributes   = S_ISDIR(st.st_mode) ? IP_FS_ATTRIB_DIR : 0;
+  if (pDir != NULL) {
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    pthread_mutex_lock(&_StatCache.Lock);
+    if ((Generation == _StatCache.Generation) && (st.st_mtime <= ts.tv_sec - STAT_CACHE_MIN_AGE) && (_STAT_CACHE_Find(acFilename, Hash) == NULL)) {
+      _STAT_CACHE_Add(acFilename, Hash, pDir, pStat);
+    }
+    _STAT_CACHE_ReleaseDir(pDir);
+    pthread_mutex_unlock(&_StatCache.Lock);
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_Create
+*/
+static void* _FS_LINUX_Create(const char* sFileName) {
+  char acFilename[256];
+  int  fd;
+
+  _ConvertFileName(acFilename, sFileName, sizeof(acFilename));
+  _FD_CACHE_Invalidate(acFilename);
+  fd = open(acFilename, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  _STAT_CACHE_Invalidate(acFilename);
+  if (fd < 0) {
+    return (NULL);
+  }
+  return (_FS_LINUX_FD2HANDLE(fd));
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_WriteAt
+*/
+static int _FS_LINUX_WriteAt(void* hFile, void* pBuffer, uint32_t Pos, uint32_t NumBytes) {
+  ssize_t result;
+  const uint8_t* p;
+
+  p = (const uint8_t *)pBuffer;
+  while (NumBytes > 0) {
+    result = pwrite(_FS_LINUX_HANDLE2FD(hFile), p, (size_t) NumBytes, (off_t) Pos);
+    if (result < 0) {
+      if (errno == EINTR)
+        continue;
+      return (-1);
+    }
+    p        += result;
+    Pos      += result;
+    NumBytes -= result;
+  }
+  return (0);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_DeleteFile
+*/
+static int _FS_LINUX_DeleteFile(const char* sFilename) {
+
+  char acFilename[256];
+  int32_t result;
+
+  _ConvertFileName(acFilename, sFilename, sizeof(acFilename));
+  _FD_CACHE_Invalidate(acFilename);
+  result = remove ((const char *)acFilename);
+  _STAT_CACHE_Invalidate(acFilename);
+  if (result == -1)
+    return (-1);
+  return (0);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_MakeDir
+*/
+static int _FS_LINUX_MakeDir(const char* sDirname) {
+
+  char acDirname[256];
+  int32_t result;
+
+  _ConvertFileName(acDirname, sDirname, sizeof(acDirname));
+  /* Owner of file is granted all permissions. */
+  result = mkdir ((const char *)acDirname, 0700);
+  _STAT_CACHE_Invalidate(acDirname);
+  if (result == -1)
+    return (-1);
+  return (0);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_RemoveDir
+*/
+static int _FS_LINUX_RemoveDir(const char* sDirname) {
+
+  char acDirname[256];
+  int32_t result;
+
+  _ConvertFileName(acDirname, sDirname, sizeof(acDirname));
+  result = rmdir ((const char *)acDirname);
+  _STAT_CACHE_Invalidate(acDirname);
+  if (result == -1)
+    return (-1);
+  return (0);
+}
+
+/*********************************************************************
+*
+*       _FS_LINUX_ConfigBaseDir
+*/
+static void _FS_LINUX_ConfigBaseDir(const char* sDir) {
+
+  if (strlen(sDir) < sizeof(_acBaseDir)) {
+    strncpy(_acBaseDir, sDir, sizeof(_acBaseDir));
+  }
+}
+
+/*********************************************************************
+*
+*       SYS Net.
+*/
+
+/*********************************************************************
+*
+*       _SYS_NET_WaitSocket
+*
+*  Function description
+*    Waits until the socket is ready for the given poll() events.
+*    All sockets are non-blocking, this is the only place where a
+*    socket operation waits. The wait ends early when the server is
+*    shut down.
+*
+*  Parameters
+*    socket
+*    events      POLLIN or POLLOUT
+*    msTimeout   Timeout in milliseconds, -1: Wait forever
+*
+*  Return value
+*      0 :  Socket ready
+*     -1 :  Timeout, error or shutdown requested
+*/
+static int _SYS_NET_WaitSocket(int socket, short events, int msTimeout) {
+  struct pollfd  aPoll[2];
+  int            retValue;
+
+  aPoll[0].fd      = socket;
+  aPoll[0].events  = events;
+  aPoll[0].revents = 0;
+  aPoll[1].fd      = _hShutdown;
+  aPoll[1].events  = POLLIN;
+  aPoll[1].revents = 0;
+  do {
+    retValue = poll(aPoll, 2, msTimeout);
+  } while ((retValue < 0) && (errno == EINTR));
+  if (retValue <= 0) {
+    return -1;
+  }
+  if (aPoll[1].revents != 0) {
+    return -1;    // Shutdown requested
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_ListenSocket
+*/
+static int _SYS_NET_ListenSocket(int *listenSocket, unsigned short portNumber, int isReusePort) {
+  struct sockaddr_in  saServer;
+  int                 newSocket;
+  int                 nRet;
+  int                 one     = 1;
+  int                 status  = 0;
+
+  newSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (0 > newSocket) {
+    status = -1;
+    goto exit;
+  }
+
+  if (0 > setsockopt(newSocket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(int))) {
+    status = -1;
+    goto error_cleanup;
+  }
+
+  /* let several sockets listen on the same port, the kernel distributes the connections */
+  if (isReusePort) {
+    if (0 > setsockopt(newSocket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(int))) {
+      status = -1;
+      goto error_cleanup;
+    }
+  }
+
+  memset((unsigned char *)&saServer, 0x00, sizeof(struct sockaddr_in));
+
+  (saServer).sin_family         = AF_INET;
+  (saServer).sin_port           = htons((portNumber));
+  (saServer).sin_addr.s_addr    = INADDR_ANY;
+
+  nRet = bind(newSocket, (struct sockaddr*)&saServer, sizeof(struct sockaddr_in));
+  if (0 > nRet) {
+    status = -1;
+    goto error_cleanup;
+  }
+
+  nRet = listen(newSocket, SOMAXCONN);
+  if (nRet != 0) {
+    status = -1;
+    goto error_cleanup;
+  }
+
+  *listenSocket = newSocket;
+  goto exit;
+
+error_cleanup:
+  close(newSocket);
+
+exit:
+  return status;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_AcceptSocket
+*
+*  Function description
+*    Accepts a connection on a listening socket. The new socket is
+*    non-blocking like all other sockets.
+*
+*  Parameters
+*    msTimeout   Timeout in milliseconds, -1: Wait forever
+*/
+static int _SYS_NET_AcceptSocket(int *clientSocket, int listenSocket, int msTimeout) {
+  int  newClientSocket;
+
+  while (1) {
+    newClientSocket = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (newClientSocket >= 0) {
+      break;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN) && (errno != EWOULDBLOCK))
+      return -1;
+    if (0 != _SYS_NET_WaitSocket(listenSocket, POLLIN, msTimeout))
+      return -1;
+  }
+
+  *clientSocket = newClientSocket;
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_ConnectSocket
+*
+*  Function description
+*    Starts a connection. Returns as soon as the handshake is under way,
+*    _SYS_NET_ConnectWait() waits for it to complete.
+*/
+static int _SYS_NET_ConnectSocket(int *pConnectSocket, unsigned char *pIpAddress, unsigned short portNo) {
+  struct sockaddr_in  server;
+  int                 status   = 0;
+
+  if (0 > (*pConnectSocket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0))) {
+    status = -1;
+    goto exit;
+  }
+
+  memset((unsigned char *)&server, 0x00, sizeof(struct sockaddr_in));
+
+  (server).sin_family         = AF_INET;
+  (server).sin_port           = htons((portNo));
+
+  inet_pton(AF_INET, (char *)pIpAddress, &server.sin_addr);
+
+  if (0 != connect(*pConnectSocket, (struct sockaddr *)&server, sizeof(server))) {
+    if (errno != EINPROGRESS) {
+      close(*pConnectSocket);
+      status = -1;
+    }
+  }
+
+exit:
+  return status;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_ConnectWait
+*
+*  Function description
+*    Waits for a connection started by _SYS_NET_ConnectSocket().
+*
+*  Return value
+*     0 :  Connection established
+*    -1 :  Connection refused, timeout or shutdown
+*/
+static int _SYS_NET_ConnectWait(int socket, int msTimeout) {
+  int        error;
+  socklen_t  errorLen = sizeof(error);
+
+  if ((0 != _SYS_NET_WaitSocket(socket, POLLOUT, msTimeout)) ||
+      (0 != getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &errorLen)) ||
+      (0 != error)) {
+    return -1;
+  }
+  return 0;
+}
+
+
+/*********************************************************************
+*
+*       _SYS_NET_CloseSocket
+*/
+static int _SYS_NET_CloseSocket(int socket) {
+  close(socket);
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_ReadSocketAvailable
+*
+*  Function description
+*    Returns as soon as data is available. Waits if there is none.
+*
+*  Parameters
+*    msTimeout   Timeout in milliseconds, 0: Wait forever
+*/
+static int _SYS_NET_ReadSocketAvailable(int socket, unsigned char *pBuffer, uint32_t maxBytesToRead, uint32_t *pNumBytesRead, uint32_t msTimeout) {
+  int     retValue;
+
+  if ((NULL == pBuffer) || (NULL == pNumBytesRead)) {
+    return -1;
+  }
+
+  *pNumBytesRead = 0;
+
+  while (1) {
+    retValue = recv(socket, pBuffer, maxBytesToRead, 0);
+    if (retValue >= 0) {
+      break;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((EWOULDBLOCK != errno) && (EAGAIN != errno))
+      return -1;
+    if (0 != _SYS_NET_WaitSocket(socket, POLLIN, (msTimeout == 0) ? -1 : (int)msTimeout))
+      return -1;
+  }
+
+  if (0 == retValue) {
+    //Disconnected from the network
+  }
+
+  *pNumBytesRead = retValue;
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_WriteSocket
+*
+*  Function description
+*    Returns when all data has been handed to the stack.
+*/
+static int _SYS_NET_WriteSocket(int socket, const unsigned char * pBuffer, uint32_t numBytesToWrite, uint32_t *pNumBytesWritten) {
+  int       retValue;
+  uint32_t  numBytesWritten;
+
+  if ((NULL == pBuffer) || (NULL == pNumBytesWritten)) {
+    return -1;
+  }
+
+  numBytesWritten = 0;
+  while (numBytesWritten < numBytesToWrite) {
+    retValue = send(socket, (const char *)pBuffer + numBytesWritten, numBytesToWrite - numBytesWritten, MSG_NOSIGNAL);
+    if (0 > retValue) {
+      if (errno == EINTR)
+        continue;
+      if (((errno == EWOULDBLOCK) || (errno == EAGAIN)) && (0 == _SYS_NET_WaitSocket(socket, POLLOUT, DATA_IDLE_TIMEOUT)))
+        continue;
+      *pNumBytesWritten = numBytesWritten;
+      return -1;
+    }
+    numBytesWritten += retValue;
+  }
+
+  *pNumBytesWritten = numBytesWritten;
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_SendFile
+*
+*  Function description
+*    Sends NumBytes of a file, starting at Pos, to the socket.
+*    The data is moved by the kernel with sendfile() and never copied
+*    into user space.
+*/
+static int _SYS_NET_SendFile(int socket, int fileDesc, off_t pos, off_t numBytes) {
+  ssize_t  retValue;
+  size_t   chunk;
+
+  while (numBytes > 0) {
+    chunk = (numBytes > MAX_SENDFILE_CHUNK) ? MAX_SENDFILE_CHUNK : (size_t)numBytes;
+    retValue = sendfile(socket, fileDesc, &pos, chunk);
+    if (retValue < 0) {
+      if (errno == EINTR)
+        continue;
+      if (((errno == EWOULDBLOCK) || (errno == EAGAIN)) && (0 == _SYS_NET_WaitSocket(socket, POLLOUT, DATA_IDLE_TIMEOUT)))
+        continue;
+      return -1;
+    }
+    if (retValue == 0) {
+      return -1;    // File has been truncated while sending
+    }
+    numBytes -= retValue;
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_RecvFile
+*
+*  Function description
+*    Receives data from the socket until the peer closes the connection
+*    and writes it to the file, starting at Pos.
+*    The data is moved by the kernel with splice() through a pipe and
+*    never copied into user space.
+*
+*  Return value
+*    >= 0  Number of bytes stored
+*     -1   Error
+*/
+static off_t _SYS_NET_RecvFile(int socket, int fileDesc, off_t pos) {
+  int      aPipe[2];
+  ssize_t  numBytesIn;
+  ssize_t  numBytesOut;
+  size_t   pipeSize;
+  off_t    numBytesTotal;
+
+  if (0 != pipe2(aPipe, O_CLOEXEC)) {
+    return -1;
+  }
+  //
+  // A larger pipe means fewer splice() calls. The kernel may refuse, then the default size is used.
+  //
+  pipeSize = 65536;
+  if (fcntl(aPipe[1], F_SETPIPE_SZ, SPLICE_PIPE_SIZE) > 0) {
+    pipeSize = SPLICE_PIPE_SIZE;
+  }
+  numBytesTotal = 0;
+  while (1) {
+    numBytesIn = splice(socket, NULL, aPipe[1], NULL, pipeSize, SPLICE_F_MOVE | SPLICE_F_MORE);
+    if (numBytesIn < 0) {
+      if (errno == EINTR)
+        continue;
+      if (((errno == EWOULDBLOCK) || (errno == EAGAIN)) && (0 == _SYS_NET_WaitSocket(socket, POLLIN, DATA_IDLE_TIMEOUT)))
+        continue;
+      numBytesTotal = -1;
+      break;
+    }
+    if (numBytesIn == 0) {
+      break;        // Connection closed by peer, transfer complete
+    }
+    //
+    // Drain the pipe into the file
+    //
+    while (numBytesIn > 0) {
+      numBytesOut = splice(aPipe[0], NULL, fileDesc, &pos, numBytesIn, SPLICE_F_MOVE | SPLICE_F_MORE);
+      if (numBytesOut < 0) {
+        if (errno == EINTR)
+          continue;
+        numBytesTotal = -1;
+        goto exit;
+      }
+      numBytesIn    -= numBytesOut;
+      numBytesTotal += numBytesOut;
+    }
+  }
+
+exit:
+  close(aPipe[0]);
+  close(aPipe[1]);
+  return numBytesTotal;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_GetPeerName
+*/
+static int _SYS_NET_GetPeerName(int socket, unsigned short *pRetPortNo, uint32_t *pRetAddr) {
+
+  struct sockaddr_in      myAddress = { 0 };
+  socklen_t               addrLen = sizeof(myAddress);
+  int                     status = 0;
+
+  if (0 > getpeername(socket, (struct sockaddr *)&myAddress, &addrLen)) {
+    status = -1;
+    goto exit;
+  }
+
+  *pRetPortNo = htons(myAddress.sin_port);
+  *pRetAddr = htonl(myAddress.sin_addr.s_addr);
+
+exit:
+  return status;
+}
+
+/*********************************************************************
+*
+*       _SYS_NET_GetSockName
+*/
+static int _SYS_NET_GetSockName(int socket, unsigned short *pRetPortNo, uint32_t *pRetAddr) {
+
+  struct sockaddr_in      myAddress = { 0 };
+  socklen_t               addrLen = sizeof(myAddress);
+  int                     status = 0;
+
+  if (0 > getsockname(socket, (struct sockaddr *)&myAddress, &addrLen)) {
+    status = -1;
+    goto exit;
+  }
+
+  *pRetPortNo = htons(myAddress.sin_port);
+  *pRetAddr = htonl(myAddress.sin_addr.s_addr);
+
+exit:
+  return status;
+}
+
+/*********************************************************************
+*
+*       SYS Util.
+*/
+
+/*********************************************************************
+*
+*       _StoreU32BE
+*
+*  Function description:
+*    Stores a 32 bit value in big endian format into a byte array.
+*/
+static void _StoreU32BE(uint8_t *pBuffer, uint32_t Data) {
+  *pBuffer++ = (uint8_t)(Data >> 24);
+  *pBuffer++ = (uint8_t)(Data >> 16);
+  *pBuffer++ = (uint8_t)(Data >> 8);
+  *pBuffer   = (uint8_t) Data;
+}
+
+/*********************************************************************
+*
+*       _StoreU16LE
+*
+*  Function description:
+*    Writes 16 bit little endian.
+*/
+static void _StoreU16LE(uint8_t *pBuffer, uint16_t Data) {
+  *pBuffer++ = (uint8_t)Data;
+  Data >>= 8;
+  *pBuffer = (uint8_t)Data;
+}
+
+/*********************************************************************
+*
+*       Data buffer pool.
+*
+*  Buffers for the data connections are allocated once at startup so
+*  that a transfer does not need to call malloc() and the stacks of the
+*  session threads can stay small. If more transfers run at the same
+*  time than there are buffers, the others get a buffer of the same
+*  size from malloc(), which is counted and logged, rather than the
+*  small built-in buffer of the FTP server.
+*/
+
+/*********************************************************************
+*
+*       _DATA_BUF_Config
+*
+*  Function description
+*    Allocates the data buffer pool.
+*
+*  Parameters
+*    BufferSize   Size of a single buffer. Clipped to DATA_BUFFER_SIZE_MIN..DATA_BUFFER_SIZE_MAX.
+*    NumBuffers   Number of buffers, which is the number of transfers that can use a large buffer at the same time.
+*
+*  Return value
+*      0 :  O.K.
+*     -1 :  Error, out of memory
+*/
+static int _DATA_BUF_Config(uint32_t BufferSize, unsigned NumBuffers) {
+  uint8_t* pMem;
+  unsigned i;
+
+  BufferSize = MAX(BufferSize, DATA_BUFFER_SIZE_MIN);
+  BufferSize = MIN(BufferSize, DATA_BUFFER_SIZE_MAX);
+  pMem = (uint8_t*)malloc((size_t)BufferSize * NumBuffers);
+  if (pMem == NULL) {
+    return -1;
+  }
+  pthread_mutex_lock(&_DataBufPool.Lock);
+  free(_DataBufPool.pMem);
+  _DataBufPool.pMem       = pMem;
+  _DataBufPool.BufferSize = BufferSize;
+  _DataBufPool.NumBuffers = NumBuffers;
+  _DataBufPool.pFirstFree = NULL;
+  for (i = NumBuffers; i > 0; i--) {
+    *(void**)(pMem + (i - 1) * BufferSize) = _DataBufPool.pFirstFree;
+    _DataBufPool.pFirstFree = pMem + (i - 1) * BufferSize;
+  }
+  pthread_mutex_unlock(&_DataBufPool.Lock);
   return 0;
 }
 
 /*********************************************************************
 *
-*       _SYS_NET_ReadSocketAvailable
+*       _AllocDataBuffer
+*
+*  Function description
+*    Callback function that provides a buffer for the data connection of a session.
+*
+*  Parameters
+*    hCtrlSock   Control connection of the session. Not used, all sessions get buffers of the size set by _DATA_BUF_Config().
+*    pNumBytes   Receives the usable size of the buffer.
+*
+*  Return value
+*    != NULL :  Buffer
+*       NULL :  Out of memory, the FTP server uses its built-in buffer
+*/
+static void* _AllocDataBuffer(FTPS_SOCKET hCtrlSock, uint32_t* pNumBytes) {
+  void* p;
+
+  (void)hCtrlSock;
+
+  pthread_mutex_lock(&_DataBufPool.Lock);
+  p = _DataBufPool.pFirstFree;
+  if (p != NULL) {
+    _DataBufPool.pFirstFree = *(void**)p;
+  } else {
+    _DataBufPool.NumOverflows++;    // Reported by _FTPServerGetNumDataBufferOverflows()
+  }
+  *pNumBytes = _DataBufPool.BufferSize;
+  pthread_mutex_unlock(&_DataBufPool.Lock);
+  if (p == NULL) {
+    p = malloc(*pNumBytes);
+  }
+  return p;
+}
+
+/*********************************************************************
+*
+*       _FreeDataBuffer
+*
+*  Function description
+*    Callback function that returns a buffer to the pool.
+*/
+static void _FreeDataBuffer(void* pBuffer) {
+  uint8_t* p;
+
+  p = (uint8_t*)pBuffer;
+  if ((p < _DataBufPool.pMem) || (p >= _DataBufPool.pMem + (size_t)_DataBufPool.BufferSize * _DataBufPool.NumBuffers)) {
+    free(pBuffer);                                // Allocated because the pool was empty
+    return;
+  }
+  pthread_mutex_lock(&_DataBufPool.Lock);
+  *(void**)pBuffer = _DataBufPool.pFirstFree;
+  _DataBufPool.pFirstFree = pBuffer;
+  pthread_mutex_unlock(&_DataBufPool.Lock);
+}
+
+/*********************************************************************
+*
+*       Passive port pool.
+*
+*  Every port of the passive port range gets a listening socket at
+*  startup. PASV leases a free listener, the session returns it after
+*  the data connection has been accepted or when it is discarded.
+*/
+
+/*********************************************************************
+*
+*       _PASV_Config
+*
+*  Function description
+*    Binds the listening sockets of the passive port range.
+*    Ports that are in use by another application are skipped.
+*
+*  Parameters
+*    PortMin   First port of the range.
+*    PortMax   Last port of the range.
+*
+*  Return value
+*    >= 0 :  Number of listeners in the pool
+*      -1 :  Error, out of memory
+*/
+static int _PASV_Config(unsigned PortMin, unsigned PortMax) {
+  _PASV_LISTENER* pListener;
+  unsigned        NumPorts;
+  unsigned        Port;
+  int             NumListeners;
+  int             MaxFd;
+  int             hSock;
+  int             i;
+
+  if ((PortMin == 0) || (PortMax < PortMin)) {
+    return 0;
+  }
+  NumPorts                = PortMax - PortMin + 1;
+  _PasvPool.paListener    = (_PASV_LISTENER*)calloc(NumPorts, sizeof(_PASV_LISTENER));
+  if (_PasvPool.paListener == NULL) {
+    return -1;
+  }
+  NumListeners = 0;
+  MaxFd        = -1;
+  for (Port = PortMin; Port <= PortMax; Port++) {
+    if (_SYS_NET_ListenSocket(&hSock, (unsigned short)Port, FALSE) < 0) {
+      continue;
+    }
+    pListener        = &_PasvPool.paListener[NumListeners++];
+    pListener->hSock = hSock;
+    pListener->Port  = (uint16_t)Port;
+    MaxFd            = MAX(MaxFd, hSock);
+  }
+  if (NumListeners == 0) {
+    return 0;
+  }
+  _PasvPool.papByFd = (_PASV_LISTENER**)calloc(MaxFd + 1, sizeof(_PASV_LISTENER*));
+  if (_PasvPool.papByFd == NULL) {
+    return -1;
+  }
+  _PasvPool.NumFds = MaxFd + 1;
+  for (i = NumListeners - 1; i >= 0; i--) {
+    pListener                           = &_PasvPool.paListener[i];
+    _PasvPool.papByFd[pListener->hSock] = pListener;
+    pListener->pNext                    = _PasvPool.pFirstFree;
+    if (_PasvPool.pFirstFree == NULL) {
+      _PasvPool.pLastFree = pListener;
+    }
+    _PasvPool.pFirstFree = pListener;
+  }
+  return NumListeners;
+}
+
+/*********************************************************************
+*
+*       _PASV_Find
+*
+*  Function description
+*    Returns the listener a socket descriptor belongs to.
+*
+*  Return value
+*    != NULL :  Listener of the pool
+*       NULL :  Socket is not part of the pool
+*/
+static _PASV_LISTENER* _PASV_Find(int hSock) {
+  if ((hSock < 0) || (hSock >= _PasvPool.NumFds)) {
+    return NULL;
+  }
+  return _PasvPool.papByFd[hSock];
+}
+
+/*********************************************************************
+*
+*       _PASV_Lease
+*
+*  Function description
+*    Takes a listener from the pool. Connections that are still queued
+*    from a previous lease (client gave up before the server accepted)
+*    are dropped, so that the new session only sees its own client.
+*
+*  Return value
+*    != NULL :  Listener, exclusively owned by the caller
+*       NULL :  All ports of the range are in use
+*/
+static _PASV_LISTENER* _PASV_Lease(void) {
+  _PASV_LISTENER* pListener;
+  int             hSock;
+
+  pthread_mutex_lock(&_PasvPool.Lock);
+  pListener = _PasvPool.pFirstFree;
+  if (pListener != NULL) {
+    _PasvPool.pFirstFree = pListener->pNext;
+    if (_PasvPool.pFirstFree == NULL) {
+      _PasvPool.pLastFree = NULL;
+    }
+  }
+  pthread_mutex_unlock(&_PasvPool.Lock);
+  if (pListener != NULL) {
+    for (;;) {
+      hSock = accept4(pListener->hSock, NULL, NULL, SOCK_CLOEXEC);
+      if (hSock < 0) {
+        break;
+      }
+      close(hSock);
+    }
+  }
+  return pListener;
+}
+
+/*********************************************************************
+*
+*       _PASV_Return
+*
+*  Function description
+*    Returns a leased listener to the pool.
+*/
+static void _PASV_Return(_PASV_LISTENER* pListener) {
+  pthread_mutex_lock(&_PasvPool.Lock);
+  pListener->pNext = NULL;
+  if (_PasvPool.pLastFree != NULL) {
+    _PasvPool.pLastFree->pNext = pListener;
+  } else {
+    _PasvPool.pFirstFree = pListener;
+  }
+  _PasvPool.pLastFree = pListener;
+  pthread_mutex_unlock(&_PasvPool.Lock);
+}
+
+/*********************************************************************
+*
+*       Directory listing cache.
+*
+*  Formatted listings are kept per directory, user and format, so
+*  clients polling the same directory do not read it again and again.
+*  Sessions requesting a listing that is being produced wait for it
+*  instead of reading the directory themselves. Entries are dropped
+*  when inotify reports a change of the directory, when the server
+*  changes it and after LIST_CACHE_MAX_AGE, which catches changes that
+*  inotify does not see (e.g. made by other hosts on NFS).
 */
-static int _SYS_NET_ReadSocketAvailable(int socket, unsigned char *pBuffer, uint32_t maxBytesToRead, uint32_t *pNumBytesRead, uint32_t msTimeout) {
-  fd_set*         pSocketList = NULL;
-  struct timeval  timeout;
-  int             retValue;
-  int         status;
 
-  if ((NULL == pBuffer) || (NULL == pNumBytesRead)) {
-    status = -1;
-    goto exit;
-  }
+/*********************************************************************
+*
+*       _LIST_CACHE_Free
+*
+*  Function description
+*    Frees an entry that is no longer in the list and no longer used.
+*    The inotify watch is removed if no other entry refers to it.
+*    Has to be called with the cache locked.
+*/
+static void _LIST_CACHE_Free(_LIST_CACHE_ENTRY* pEntry) {
+  _LIST_CACHE_ENTRY* p;
 
-  if (0 != msTimeout) {
-    /* handle timeout case */
-    if (NULL == (pSocketList = (fd_set*) malloc(sizeof(fd_set)))) {
-      status = -1;
-      goto exit;
+  if (pEntry->wd >= 0) {
+    for (p = _ListCache.pFirst; p != NULL; p = p->pNext) {
+      if (p->wd == pEntry->wd) {
+        break;
+      }
     }
-
-    /* add the socket of interest to the list */
-    FD_ZERO(pSocketList);
-    FD_SET(socket, pSocketList);
-
-    /* compute timeout (milliseconds) */
-    timeout.tv_sec  = msTimeout / 1000;
-    timeout.tv_usec = (msTimeout % 1000) * 1000;    /* convert ms to us */
-
-    /* Note: Windows ignores the first parameter '1' */
-    /* other platforms may want (highest socket + 1) */
-
-    /*  The first argument to select is the highest file
-        descriptor value plus 1. In most cases, you can
-        just pass FD_SETSIZE and you'll be fine. */
-
-
-    if (0 == select(FD_SETSIZE, pSocketList, NULL, NULL, &timeout)) {
-      status = -1;
-      goto exit;
+    if (p == NULL) {
+      inotify_rm_watch(_ListCache.hNotify, pEntry->wd);
     }
   }
-
-  *pNumBytesRead = 0;
-
-  retValue = recv(socket, pBuffer, maxBytesToRead, 0);
-
-  if (retValue < 0) {
-    if ((EWOULDBLOCK == errno) || (EAGAIN == errno))
-      status = -1;
-    else
-      status = -1;
-    goto exit;
-  }
-
-  if (0 == retValue) {
-    //Disconnected from the network
-  }
-
-  *pNumBytesRead = retValue;
-
-  status = 0;
-
-exit:
-  if (NULL != pSocketList)
-    free(pSocketList);
-
-  return status;
-
+  free(pEntry->pData);
+  free(pEntry);
 }
 
 /*********************************************************************
 *
-*       _SYS_NET_WriteSocket
+*       _LIST_CACHE_Drop
+*
+*  Function description
+*    Removes an entry from the cache. It is freed as soon as no session
+*    uses it any more. Has to be called with the cache locked.
 */
-static int _SYS_NET_WriteSocket(int socket, const unsigned char * pBuffer, uint32_t numBytesToWrite, uint32_t *pNumBytesWritten) {
-  int     retValue;
-  int status;
-
-  if ((NULL == pBuffer) || (NULL == pNumBytesWritten)) {
-    status = -1;
-    goto exit;
+static void _LIST_CACHE_Drop(_LIST_CACHE_ENTRY* pEntry) {
+  if (pEntry->pPrev != NULL) {
+    pEntry->pPrev->pNext = pEntry->pNext;
+  } else {
+    _ListCache.pFirst = pEntry->pNext;
   }
-
-  retValue = send((int)socket, (const char *)pBuffer, numBytesToWrite, 0);
-  if (0 > retValue) {
-    if ((errno == EWOULDBLOCK) || (errno == EAGAIN))
-      status = -1;
-    else
-      status = -1;
-
-    *pNumBytesWritten = 0;
-    goto exit;
+  if (pEntry->pNext != NULL) {
+    pEntry->pNext->pPrev = pEntry->pPrev;
+  } else {
+    _ListCache.pLast = pEntry->pPrev;
+  }
+  if (pEntry->IsFilled) {
+    _ListCache.NumBytes -= pEntry->NumBytes;
+  }
+  pEntry->IsStale = 1;
+  if (pEntry->RefCnt == 0) {
+    _LIST_CACHE_Free(pEntry);
   }
-
-  *pNumBytesWritten = retValue;
-  status = 0;
-
-exit:
-  return status;
 }
 
 /*********************************************************************
 *
-*       _SYS_NET_GetPeerName
+*       _LIST_CACHE_Task
+*
+*  Function description
+*    Drops the entries of directories inotify reports changes for, and
+*    all entries if events have been lost.
 */
-static int _SYS_NET_GetPeerName(int socket, unsigned short *pRetPortNo, uint32_t *pRetAddr) {
-
-  struct sockaddr_in      myAddress = { 0 };
-  socklen_t               addrLen = sizeof(myAddress);
-  int                     status = 0;
-
-  if (0 > getpeername(socket, (struct sockaddr *)&myAddress, &addrLen)) {
-    status = -1;
-    goto exit;
+static void* _LIST_CACHE_Task(void* pArg) {
+  union {
+    struct inotify_event Event;
+    char                 ac[4096];
+  } Buffer;
+  const struct inotify_event* pEvent;
+  _LIST_CACHE_ENTRY*          pEntry;
+  _LIST_CACHE_ENTRY*          pNext;
+  ssize_t                     NumBytes;
+  ssize_t                     Off;
+
+  (void)pArg;
+
+  for (;;) {
+    NumBytes = read(_ListCache.hNotify, &Buffer, sizeof(Buffer));
+    if (NumBytes <= 0) {
+      if ((NumBytes < 0) && (errno == EINTR)) {
+        continue;
+      }
+      break;
+    }
+    pthread_mutex_lock(&_ListCache.Lock);
+    for (Off = 0; Off < NumBytes; Off += sizeof(struct inotify_event) + pEvent->len) {
+      pEvent = (const struct inotify_event*)(Buffer.ac + Off);
+      if (pEvent->mask & IN_Q_OVERFLOW) {
+        while (_ListCache.pFirst != NULL) {   // Events have been lost
+          _LIST_CACHE_Drop(_ListCache.pFirst);
+        }
+      } else {
+        for (pEntry = _ListCache.pFirst; pEntry != NULL; pEntry = pNext) {
+          pNext = pEntry->pNext;
+          if (pEntry->wd == pEvent->wd) {
+            _LIST_CACHE_Drop(pEntry);
+          }
+        }
+      }
+    }
+    pthread_mutex_unlock(&_ListCache.Lock);
   }
-
-  *pRetPortNo = htons(myAddress.sin_port);
-  *pRetAddr = htonl(myAddress.sin_addr.s_addr);
-
-exit:
-  return status;
+  return NULL;
 }
 
 /*********************************************************************
 *
-*       _SYS_NET_GetSockName
+*       _LIST_CACHE_Init
+*
+*  Function description
+*    Starts watching for changes. Without inotify, entries only expire
+*    by age and by changes of the server itself.
 */
-static int _SYS_NET_GetSockName(int socket, unsigned short *pRetPortNo, uint32_t *pRetAddr) {
-
-  struct sockaddr_in      myAddress = { 0 };
-  socklen_t               addrLen = sizeof(myAddress);
-  int                     status = 0;
+static void _LIST_CACHE_Init(void) {
+  pthread_t ThreadId;
 
-  if (0 > getsockname(socket, (struct sockaddr *)&myAddress, &addrLen)) {
-    status = -1;
-    goto exit;
+  _ListCache.hNotify = inotify_init1(IN_CLOEXEC);
+  if (_ListCache.hNotify < 0) {
+    return;
   }
-
-  *pRetPortNo = htons(myAddress.sin_port);
-  *pRetAddr = htonl(myAddress.sin_addr.s_addr);
-
-exit:
-  return status;
+  if (pthread_create(&ThreadId, NULL, _LIST_CACHE_Task, NULL) != 0) {
+    close(_ListCache.hNotify);
+    _ListCache.hNotify = -1;
+    return;
+  }
+  pthread_detach(ThreadId);
 }
 
 /*********************************************************************
 *
-*       SYS Util.
+*       _ListCacheOpen
+*
+*  Function description
+*    Callback function that looks up a listing. If another session is
+*    producing the listing, the function waits for it.
+*
+*  Return value
+*    IP_FTPS_LIST_CACHE_HIT  :  Listing in *ppData, *pNumBytes
+*    IP_FTPS_LIST_CACHE_FILL :  Caller lists the directory and passes the output to _ListCacheWrite()
+*    IP_FTPS_LIST_CACHE_MISS :  Directory can not be cached
 */
+static int _ListCacheOpen(int UserId, char Format, const char* sDir, void** phEntry, const void** ppData, uint32_t* pNumBytes) {
+  _LIST_CACHE_ENTRY* pEntry;
+  char               acPath[256];
+
+  if (strlen(sDir) >= sizeof(pEntry->acDir)) {
+    return IP_FTPS_LIST_CACHE_MISS;
+  }
+  pthread_mutex_lock(&_ListCache.Lock);
+  for (;;) {
+    for (pEntry = _ListCache.pFirst; pEntry != NULL; pEntry = pEntry->pNext) {
+      if ((pEntry->UserId == UserId) && (pEntry->Format == Format) && (strcmp(pEntry->acDir, sDir) == 0)) {
+        break;
+      }
+    }
+    if ((pEntry != NULL) && pEntry->IsFilled && ((_SYS_GetTime_ms() - pEntry->TimeFilled) > LIST_CACHE_MAX_AGE)) {
+      _LIST_CACHE_Drop(pEntry);
+      pEntry = NULL;
+    }
+    if (pEntry == NULL) {
+      break;
+    }
+    if (pEntry->IsFilled && pEntry->IsTooLarge) {
+      pthread_mutex_unlock(&_ListCache.Lock);
+      return IP_FTPS_LIST_CACHE_MISS;
+    }
+    if (pEntry->IsFilled) {
+      //
+      // Hit. Move the entry to the front of the LRU list.
+      //
+      if (pEntry->pPrev != NULL) {
+        pEntry->pPrev->pNext = pEntry->pNext;
+        if (pEntry->pNext != NULL) {
+          pEntry->pNext->pPrev = pEntry->pPrev;
+        } else {
+          _ListCache.pLast = pEntry->pPrev;
+        }
+        pEntry->pPrev            = NULL;
+        pEntry->pNext            = _ListCache.pFirst;
+        _ListCache.pFirst->pPrev = pEntry;
+        _ListCache.pFirst        = pEntry;
+      }
+      pEntry->RefCnt++;
+      pthread_mutex_unlock(&_ListCache.Lock);
+      *phEntry   = pEntry;
+      *ppData    = pEntry->pData;
+      *pNumBytes = pEntry->NumBytes;
+      return IP_FTPS_LIST_CACHE_HIT;
+    }
+    pthread_cond_wait(&_ListCache.Cond, &_ListCache.Lock);    // Another session is listing the directory
+  }
+  //
+  // Miss. The caller produces the listing, other sessions wait for it.
+  //
+  pEntry = (_LIST_CACHE_ENTRY*)calloc(1, sizeof(_LIST_CACHE_ENTRY));
+  if (pEntry == NULL) {
+    pthread_mutex_unlock(&_ListCache.Lock);
+    return IP_FTPS_LIST_CACHE_MISS;
+  }
+  strcpy(pEntry->acDir, sDir);
+  pEntry->UserId = UserId;
+  pEntry->Format = Format;
+  pEntry->RefCnt = 1;
+  pEntry->wd     = -1;
+  if (_ListCache.hNotify >= 0) {
+    _ConvertFileName(acPath, sDir, sizeof(acPath));
+    pEntry->wd = inotify_add_watch(_ListCache.hNotify, acPath, IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF);
+  }
+  pEntry->pNext = _ListCache.pFirst;
+  if (_ListCache.pFirst != NULL) {
+    _ListCache.pFirst->pPrev = pEntry;
+  } else {
+    _ListCache.pLast = pEntry;
+  }
+  _ListCache.pFirst = pEntry;
+  pthread_mutex_unlock(&_ListCache.Lock);
+  *phEntry = pEntry;
+  return IP_FTPS_LIST_CACHE_FILL;
+}
 
 /*********************************************************************
 *
-*       _StoreU32BE
+*       _ListCacheWrite
 *
-*  Function description:
-*    Stores a 32 bit value in big endian format into a byte array.
+*  Function description
+*    Callback function that appends output to a listing being produced.
+*    Only the producing session accesses the data, no lock is needed.
+*
+*  Return value
+*     0 :  O.K.
+*    -1 :  Listing exceeds LIST_CACHE_MAX_ENTRY or out of memory
 */
-static void _StoreU32BE(uint8_t *pBuffer, uint32_t Data) {
-  *pBuffer++ = (uint8_t)(Data >> 24);
-  *pBuffer++ = (uint8_t)(Data >> 16);
-  *pBuffer++ = (uint8_t)(Data >> 8);
-  *pBuffer   = (uint8_t) Data;
+static int _ListCacheWrite(void* hEntry, const void* pData, uint32_t NumBytes) {
+  _LIST_CACHE_ENTRY* pEntry;
+  uint8_t*           p;
+  uint32_t           Capacity;
+
+  pEntry = (_LIST_CACHE_ENTRY*)hEntry;
+  if (NumBytes > LIST_CACHE_MAX_ENTRY - pEntry->NumBytes) {
+    //
+    // Remember that the directory is too large, so that waiting and
+    // following sessions list it in parallel instead of one by one.
+    //
+    free(pEntry->pData);
+    pEntry->pData      = NULL;
+    pEntry->NumBytes   = 0;
+    pEntry->Capacity   = 0;
+    pEntry->IsTooLarge = 1;
+    return -1;
+  }
+  if (pEntry->NumBytes + NumBytes > pEntry->Capacity) {
+    Capacity = MAX(pEntry->Capacity * 2, 4096);
+    Capacity = MAX(Capacity, pEntry->NumBytes + NumBytes);
+    Capacity = MIN(Capacity, LIST_CACHE_MAX_ENTRY);
+    p = (uint8_t*)realloc(pEntry->pData, Capacity);
+    if (p == NULL) {
+      return -1;
+    }
+    pEntry->pData    = p;
+    pEntry->Capacity = Capacity;
+  }
+  memcpy(pEntry->pData + pEntry->NumBytes, pData, NumBytes);
+  pEntry->NumBytes += NumBytes;
+  return 0;
 }
 
 /*********************************************************************
 *
-*       _StoreU16LE
+*       _ListCacheClose
 *
-*  Function description:
-*    Writes 16 bit little endian.
+*  Function description
+*    Callback function that ends the use of an entry. Completes a fill
+*    if the entry has been opened with IP_FTPS_LIST_CACHE_FILL. Least
+*    recently used entries are dropped to stay within LIST_CACHE_SIZE.
 */
-static void _StoreU16LE(uint8_t *pBuffer, uint16_t Data) {
-  *pBuffer++ = (uint8_t)Data;
-  Data >>= 8;
-  *pBuffer = (uint8_t)Data;
+static void _ListCacheClose(void* hEntry, int Status) {
+  _LIST_CACHE_ENTRY* pEntry;
+
+  pEntry = (_LIST_CACHE_ENTRY*)hEntry;
+  pthread_mutex_lock(&_ListCache.Lock);
+  if (pEntry->IsFilled == 0) {
+    if ((Status < 0) && (pEntry->IsTooLarge == 0) && (pEntry->IsStale == 0)) {
+      _LIST_CACHE_Drop(pEntry);
+    }
+    if (pEntry->IsStale == 0) {
+      pEntry->IsFilled    = 1;
+      pEntry->TimeFilled  = _SYS_GetTime_ms();
+      _ListCache.NumBytes += pEntry->NumBytes;
+      while ((_ListCache.NumBytes > LIST_CACHE_SIZE) && (_ListCache.pLast != NULL)) {
+        _LIST_CACHE_Drop(_ListCache.pLast);
+      }
+    }
+    pthread_cond_broadcast(&_ListCache.Cond);
+  }
+  pEntry->RefCnt--;
+  if (pEntry->IsStale && (pEntry->RefCnt == 0)) {
+    _LIST_CACHE_Free(pEntry);
+  }
+  pthread_mutex_unlock(&_ListCache.Lock);
 }
 
 /*********************************************************************
 *
-*       _SYS_Sleep
+*       _ListCacheInvalidate
+*
+*  Function description
+*    Callback function that drops the listings of a directory the
+*    server has changed.
 */
-static void _SYS_Sleep(uint64_t milliseconds) {
-  usleep((useconds_t)(milliseconds*1000));
+static void _ListCacheInvalidate(const char* sDir) {
+  _LIST_CACHE_ENTRY* pEntry;
+  _LIST_CACHE_ENTRY* pNext;
+
+  pthread_mutex_lock(&_ListCache.Lock);
+  for (pEntry = _ListCache.pFirst; pEntry != NULL; pEntry = pNext) {
+    pNext = pEntry->pNext;
+    if (strcmp(pEntry->acDir, sDir) == 0) {
+      _LIST_CACHE_Drop(pEntry);
+    }
+  }
+  pthread_mutex_unlock(&_ListCache.Lock);
 }
 
 /*********************************************************************
@@ -1148,21 +3517,146 @@ static int _GetFileInfo(int UserId, const char * sFileIn, char * sFileOut, int F
 *    depends on the system time. If the year of the system time
 *    is identical to the year stored in the timestamp of the file,
 *    the time will be transmitted, if not the year.
+*    The time is UTC, like the time stamps of the files.
 */
 static uint32_t _GetTimeDate(void) {
-  uint32_t r;
-  uint16_t Sec, Min, Hour;
-  uint16_t Day, Month, Year;
+  return _SYS_GetTimeDate();
+}
+
+/*********************************************************************
+*
+*       Worker replacement.
+*
+*  A transfer runs in the worker that executes the command and can take
+*  as long as the client wants, for example if it does not read the data
+*  connection. Before a worker waits for a data connection, another
+*  thread takes its place, so the number of threads available for
+*  commands stays the same. A worker that has completed its transfer and
+*  is no longer needed waits as a spare to replace the next one.
+*/
+
+/*********************************************************************
+*
+*       _WORK_StartThread
+*
+*  Function description
+*    Adds a thread to the workers. Called with the lock held.
+*/
+static int _WORK_StartThread(void) {
+  pthread_t ThreadId;
+
+  if (pthread_create(&ThreadId, NULL, _WorkPool.pfTask, NULL) != 0) {
+    return -1;
+  }
+  pthread_detach(ThreadId);
+  _WorkPool.NumThreads++;
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _WORK_Config
+*
+*  Function description
+*    Starts the workers.
+*
+*  Parameters
+*    NumWorkers   Number of threads executing commands.
+*    pfTask       Thread function of a worker.
+*/
+static int _WORK_Config(unsigned NumWorkers, void* (*pfTask)(void* Context)) {
+  unsigned i;
+  int      r;
+
+  r = 0;
+  pthread_mutex_lock(&_WorkPool.Lock);
+  _WorkPool.pfTask     = pfTask;
+  _WorkPool.NumWorkers = NumWorkers;
+  for (i = 0; i < NumWorkers; i++) {
+    if (_WORK_StartThread() < 0) {
+      r = -1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&_WorkPool.Lock);
+  return r;
+}
+
+/*********************************************************************
+*
+*       _WORK_BeginTransfer
+*
+*  Function description
+*    Called by a worker before it waits for a data connection. Wakes up
+*    a spare or starts a thread that takes its place. With more than
+*    MAX_TRANSFER_THREADS transfers, the worker is not replaced and
+*    commands wait for the transfers to complete.
+*/
+static void _WORK_BeginTransfer(void) {
+  if (_IsTransferring || (_WorkPool.pfTask == NULL)) {
+    return;           // Already replaced for a previous transfer of the same command batch
+  }
+  _IsTransferring = 1;
+  pthread_mutex_lock(&_WorkPool.Lock);
+  _WorkPool.NumTransfers++;
+  if ((_WorkPool.NumThreads - _WorkPool.NumTransfers < _WorkPool.NumWorkers) &&
+      (_WorkPool.NumThreads < _WorkPool.NumWorkers + MAX_TRANSFER_THREADS)) {
+    if (_WorkPool.NumSpares > _WorkPool.NumWakeups) {
+      _WorkPool.NumWakeups++;
+      _WorkPool.NumThreads++;
+      pthread_cond_signal(&_WorkPool.Cond);
+    } else {
+      _WORK_StartThread();    // If this fails, the worker is not replaced
+    }
+  }
+  pthread_mutex_unlock(&_WorkPool.Lock);
+}
 
-  Sec   = 0;        // 0 based.  Valid range: 0..59
-  Min   = 0;        // 0 based.  Valid range: 0..59
-  Hour  = 0;        // 0 based.  Valid range: 0..23
-  Day   = 1;        // 1 based.    Means that 1 is 1. Valid range is 1..31 (depending on month)
-  Month = 1;        // 1 based.    Means that January is 1. Valid range is 1..12.
-  Year  = 28;        // 1980 based. Means that 2008 would be 28.
-  r   = Sec / 2 + (Min << 5) + (Hour  << 11);
-  r  |= (uint32_t)(Day + (Month << 5) + (Year  << 9)) << 16;
-  return (r);
+/*********************************************************************
+*
+*       _WORK_EndTransfer
+*
+*  Function description
+*    Called by a worker that has been replaced once the command that
+*    did the transfer has been executed. If there are more threads
+*    than needed, the worker waits up to SPARE_IDLE_TIME ms as spare.
+*
+*  Return value
+*     0 :  Continue as worker
+*    -1 :  Thread is no longer needed and shall end
+*/
+static int _WORK_EndTransfer(void) {
+  struct timespec ts;
+  int r;
+
+  r = 0;
+  _IsTransferring = 0;
+  pthread_mutex_lock(&_WorkPool.Lock);
+  _WorkPool.NumTransfers--;
+  if (_WorkPool.NumThreads - _WorkPool.NumTransfers > _WorkPool.NumWorkers) {
+    _WorkPool.NumThreads--;
+    _WorkPool.NumSpares++;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += SPARE_IDLE_TIME / 1000;
+    ts.tv_nsec += (SPARE_IDLE_TIME % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+      ts.tv_sec++;
+      ts.tv_nsec -= 1000000000L;
+    }
+    while (_WorkPool.NumWakeups == 0) {
+      if (pthread_cond_timedwait(&_WorkPool.Cond, &_WorkPool.Lock, &ts) == ETIMEDOUT) {
+        break;
+      }
+    }
+    _WorkPool.NumSpares--;
+    if (_WorkPool.NumWakeups > 0) {
+      _WorkPool.NumWakeups--;   // NumThreads has been incremented by the worker that has been replaced
+    } else {
+      r = -1;
+    }
+  }
+  pthread_mutex_unlock(&_WorkPool.Lock);
+  return r;
 }
 
 /**********************************************************************
@@ -1192,7 +3686,7 @@ static uint32_t _GetTimeDate(void) {
 static int _Send(const unsigned char * pData, int len, FTPS_SOCKET hSock) {
   uint32_t     retValue;
   int     status;
-  status = _SYS_NET_WriteSocket((int)hSock, pData, len, &retValue);
+  status = _SYS_NET_WriteSocket((int)(intptr_t)hSock, pData, len, &retValue);
   if (status < 0) {
     return (-1);
   }
@@ -1217,15 +3711,69 @@ static int _Send(const unsigned char * pData, int len, FTPS_SOCKET hSock) {
 *
 *  Notes
 *    (1) Returns as soon as something has been received (may be less than MaxNumBytes) or error happened
+*    (2) Fails if nothing is received for DATA_IDLE_TIMEOUT ms, so a stalled upload does not hold a worker.
+*        A control connection is only read when the reactor has reported it readable, it never waits.
+*/
+static int _Recv(unsigned char * pData, int len, FTPS_SOCKET hSock) {
+  uint32_t     retValue;
+  int     status;
+  status = _SYS_NET_ReadSocketAvailable((int)(intptr_t)hSock, pData, len, &retValue, DATA_IDLE_TIMEOUT);
+  if (status < 0) {
+    return (-1);
+  }
+  return (retValue);
+}
+
+/*********************************************************************
+*
+*       _SendFileDesc
+*
+*  Function description
+*    Callback function that sends a part of a file to the client
+*    without copying it through the data buffer of the FTP server.
+*
+*  Parameters
+*    hSock
+*    FileDesc  OS file descriptor returned by pfGetFileDesc
+*    Pos       Offset in file of the first byte to send
+*    NumBytes  Number of bytes to send, < 0: Until the end of the file
+*
+*  Return value
+*      0 :  O.K., all bytes sent
+*     -1 :  Error
+*/
+static int _SendFileDesc(FTPS_SOCKET hSock, int FileDesc, int64_t Pos, int64_t NumBytes) {
+  struct stat Stat;
+
+  if (NumBytes < 0) {
+    if (fstat(FileDesc, &Stat) != 0) {
+      return -1;
+    }
+    NumBytes = MAX((int64_t)Stat.st_size - Pos, 0);   // Size of the open file, not of the path
+  }
+  return _SYS_NET_SendFile((int)(intptr_t)hSock, FileDesc, (off_t)Pos, (off_t)NumBytes);
+}
+
+/*********************************************************************
+*
+*       _RecvFileDesc
+*
+*  Function description
+*    Callback function that stores everything the client sends on the
+*    data connection in a file without copying it through the buffers
+*    of the FTP server.
+*
+*  Parameters
+*    hSock
+*    FileDesc  OS file descriptor returned by pfGetFileDesc
+*    Pos       Offset in file of the first byte to store
+*
+*  Return value
+*    >= 0 :  O.K., number of bytes stored
+*     -1  :  Error
 */
-static int _Recv(unsigned char * pData, int len, FTPS_SOCKET hSock) {
-  uint32_t     retValue;
-  int     status;
-  status = _SYS_NET_ReadSocketAvailable((int)hSock, pData, len, &retValue, 0);
-  if (status < 0) {
-    return (-1);
-  }
-  return (retValue);
+static int64_t _RecvFileDesc(FTPS_SOCKET hSock, int FileDesc, int64_t Pos) {
+  return (int64_t)_SYS_NET_RecvFile((int)(intptr_t)hSock, FileDesc, (off_t)Pos);
 }
 
 /*********************************************************************
@@ -1234,7 +3782,8 @@ static int _Recv(unsigned char * pData, int len, FTPS_SOCKET hSock) {
 *
 *  Function description
 *    This function is called from the FTP server module if the client
-*    uses active FTP to establish the data connection.
+*    uses active FTP to establish the data connection. The connection is
+*    only started, _ConnectWait() completes it when the transfer begins.
 *    Callback function that handles the connect back to a FTP client on socket level if not using passive mode.
 *
 *  Parameters
@@ -1256,7 +3805,7 @@ static FTPS_SOCKET _Connect(FTPS_SOCKET hCtrlSock, uint16_t Port) {
   unsigned short   sin_port;
   unsigned char    str[INET_ADDRSTRLEN];
 
-  _SYS_NET_GetPeerName((int)hCtrlSock, &sin_port, &sin_addr);
+  _SYS_NET_GetPeerName((int)(intptr_t)hCtrlSock, &sin_port, &sin_addr);
   sin_addr = htonl(sin_addr);
   inet_ntop(AF_INET, &sin_addr, (char *)str, INET_ADDRSTRLEN);
 
@@ -1264,7 +3813,27 @@ static FTPS_SOCKET _Connect(FTPS_SOCKET hCtrlSock, uint16_t Port) {
   if(status < 0){
     return (NULL);
   }
-  return ((FTPS_SOCKET)DataSock);
+  return ((FTPS_SOCKET)(intptr_t)DataSock);
+}
+
+/*********************************************************************
+*
+*       _ConnectWait
+*
+*  Function description
+*    This function is called from the FTP server module when a transfer
+*    starts in active mode. It waits up to DATA_CONNECT_TIMEOUT ms for
+*    the connection started by _Connect() to be established, so a
+*    firewalled client does not hold a worker for the whole SYN retry
+*    period of the stack. The worker is replaced for the transfer.
+*
+*  Return value
+*     0 :  O.K., connection established
+*    -1 :  Error
+*/
+static int _ConnectWait(FTPS_SOCKET hDataSock) {
+  _WORK_BeginTransfer();
+  return _SYS_NET_ConnectWait((int)(intptr_t)hDataSock, DATA_CONNECT_TIMEOUT);
 }
 
 /*********************************************************************
@@ -1275,12 +3844,22 @@ static FTPS_SOCKET _Connect(FTPS_SOCKET hCtrlSock, uint16_t Port) {
 *    This function is called from the FTP server module to close the
 *    data connection.
 *    Callback function that disconnects a connection to the FTP client on socket level if not using passive mode.
+*    A listener of the passive port pool that has not accepted a connection yet is returned to the pool.
 *
 *  Parameters
 *    DataSocket
 */
 static void _Disconnect(FTPS_SOCKET hDataSock) {
-  _SYS_NET_CloseSocket((int) hDataSock);
+  _PASV_LISTENER* pListener;
+  int             hSock;
+
+  hSock     = (int)(intptr_t)hDataSock;
+  pListener = _PASV_Find(hSock);
+  if (pListener != NULL) {
+    _PASV_Return(pListener);
+  } else {
+    _SYS_NET_CloseSocket(hSock);
+  }
 }
 
 /*********************************************************************
@@ -1289,8 +3868,9 @@ static void _Disconnect(FTPS_SOCKET hDataSock) {
 *
 *  Function description
 *    This function is called from the FTP server module if the client
-*    uses passive FTP. It creates a socket and searches for a free port
-*    which can be used for the data connection.
+*    uses passive FTP. It leases a listener of the passive port pool or,
+*    if no port range is configured, creates a socket on a port assigned
+*    by the stack.
 *    Callback function that binds the server to a port and addr.
 *
 *  Parameters
@@ -1300,27 +3880,36 @@ static void _Disconnect(FTPS_SOCKET hDataSock) {
 *
 *  Return value
 *    > 0  : O.K.  Socket descriptor
-*    NULL : Error
+*    NULL : Error, all ports of the passive port range are in use
 */
 static FTPS_SOCKET _Listen(FTPS_SOCKET hCtrlSock, uint16_t *pPort, uint8_t * pIPAddr) {
+  _PASV_LISTENER*  pListener;
   int              DataSock;
   int                status;
   uint32_t     sin_addr;
   unsigned short   sin_port;
 
-  status = _SYS_NET_ListenSocket(&DataSock, 0);  // Let Stack find a free port
-  if (status < 0) {
-    return (NULL);
+  if (_PasvPool.paListener != NULL) {
+    pListener = _PASV_Lease();
+    if (pListener == NULL) {
+      return (NULL);
+    }
+    DataSock = pListener->hSock;
+    sin_port = pListener->Port;
+  } else {
+    status = _SYS_NET_ListenSocket(&DataSock, 0, FALSE);  // Let Stack find a free port
+    if (status < 0) {
+      return (NULL);
+    }
+    //
+    //  Get port number stack has assigned
+    //
+    _SYS_NET_GetSockName(DataSock, &sin_port, &sin_addr);
   }
-
-  //
-  //  Get port number stack has assigned
-  //
-  _SYS_NET_GetSockName(DataSock, &sin_port, &sin_addr);
   _StoreU16LE((uint8_t *)pPort, sin_port);
-  _SYS_NET_GetSockName((int)hCtrlSock, &sin_port, &sin_addr);
+  _SYS_NET_GetSockName((int)(intptr_t)hCtrlSock, &sin_port, &sin_addr);
   _StoreU32BE(pIPAddr, sin_addr);
-  return ((FTPS_SOCKET)DataSock);
+  return ((FTPS_SOCKET)(intptr_t)DataSock);
 }
 
 /*********************************************************************
@@ -1329,10 +3918,12 @@ static FTPS_SOCKET _Listen(FTPS_SOCKET hCtrlSock, uint16_t *pPort, uint8_t * pIP
 *
 *  Function description
 *    This function is called from the FTP server module if the client
-*    uses passive FTP. It sets the command socket to non-blocking before
-*    accept() will be called. This guarantees that the FTP server always
-*    returns even if the connection to the client gets lost while
-*    accept() waits for a connection. The timeout is set to 10 seconds.
+*    uses passive FTP and starts a transfer. It waits up to
+*    DATA_CONNECT_TIMEOUT ms for the client of the session to connect
+*    to the data port. Connections from other hosts are dropped, which
+*    keeps a third party from taking over the transfer of a session.
+*    The listener is returned to the passive port pool or closed.
+*    The worker is replaced for the transfer.
 *    Callback function that accepts incoming connections.
 *
 *  Parameters
@@ -1344,20 +3935,41 @@ static FTPS_SOCKET _Listen(FTPS_SOCKET hCtrlSock, uint16_t *pPort, uint8_t * pIP
 *     -1  :  Error
 */
 static int _Accept(FTPS_SOCKET hCtrlSock, FTPS_SOCKET * phDataSocket) {
-  int         Socket;
-  int       DataSock;
-  int         status;
-  int  isBreakRequest = FALSE;
-
-  (void)hCtrlSock;
-
-  Socket   = *(int*)phDataSocket;
-  status = _SYS_NET_AcceptSocket(&DataSock, Socket, &isBreakRequest);
-  if (status < 0) {
+  _PASV_LISTENER* pListener;
+  unsigned short  Port;
+  uint32_t        CtrlAddr;
+  uint32_t        DataAddr;
+  int64_t         Timeout;
+  int64_t         TimeEnd;
+  int             Socket;
+  int             DataSock;
+
+  Socket = (int)(intptr_t)*phDataSocket;
+  if (_SYS_NET_GetPeerName((int)(intptr_t)hCtrlSock, &Port, &CtrlAddr) < 0) {
     return (-1);
   }
-  *phDataSocket = (FTPS_SOCKET)DataSock;
-  _SYS_NET_CloseSocket(Socket);
+  _WORK_BeginTransfer();
+  TimeEnd = _SYS_GetTime_ms() + DATA_CONNECT_TIMEOUT;
+  for (;;) {
+    Timeout = TimeEnd - _SYS_GetTime_ms();
+    if (Timeout <= 0) {
+      return (-1);
+    }
+    if (_SYS_NET_AcceptSocket(&DataSock, Socket, (int)Timeout) < 0) {
+      return (-1);
+    }
+    if ((_SYS_NET_GetPeerName(DataSock, &Port, &DataAddr) == 0) && (DataAddr == CtrlAddr)) {
+      break;
+    }
+    _SYS_NET_CloseSocket(DataSock);
+  }
+  *phDataSocket = (FTPS_SOCKET)(intptr_t)DataSock;
+  pListener = _PASV_Find(Socket);
+  if (pListener != NULL) {
+    _PASV_Return(pListener);
+  } else {
+    _SYS_NET_CloseSocket(Socket);
+  }
   //
   // Successfully connected
   //
@@ -1387,7 +3999,13 @@ static FTPS_ACCESS_CONTROL _Access_Control = {
 
 static const FTPS_APPLICATION _Application = {
   &_Access_Control,
-  _GetTimeDate
+  _GetTimeDate,
+  _AllocDataBuffer,
+  _FreeDataBuffer,
+  _ListCacheOpen,
+  _ListCacheWrite,
+  _ListCacheClose,
+  _ListCacheInvalidate
 };
 
 static const IP_FTPS_API _IP_API = {
@@ -1396,7 +4014,10 @@ static const IP_FTPS_API _IP_API = {
   _Connect,
   _Disconnect,
   _Listen,
-  _Accept
+  _Accept,
+  _SendFileDesc,
+  _RecvFileDesc,
+  _ConnectWait
 };
 
 const _FS_API IP_FS_Linux = {
@@ -1426,6 +4047,18 @@ const _FS_API IP_FS_Linux = {
   //
   _FS_LINUX_MakeDir,
   _FS_LINUX_RemoveDir,
+  //
+  // Zero-copy operations
+  //
+  _FS_LINUX_GetFileDesc,
+  //
+  // Directory query with hints.
+  //
+  _FS_LINUX_ForEachDirEntryEx,
+  //
+  // File metadata without opening the file.
+  //
+  _FS_LINUX_GetFileStat
 };
 
 /*********************************************************************
@@ -1440,29 +4073,398 @@ const _FS_API IP_FS_Linux = {
 *       _AddToConnectCnt
 *
 */
-static void _AddToConnectCnt(int Delta) {
-  _ConnectCnt += Delta;
+static void _AddToConnectCnt(_SHARD* pShard, int Delta) {
+  atomic_fetch_add(&pShard->ConnectCnt, Delta);
+}
+
+/*********************************************************************
+*
+*       _TryAddConnection
+*
+*  Function description
+*    Counts a new connection if the connection limit of the shard allows it.
+*
+*  Return value
+*    1    Connection counted
+*    0    Connection limit reached
+*/
+static int _TryAddConnection(_SHARD* pShard) {
+  int Cnt;
+
+  Cnt = atomic_load(&pShard->ConnectCnt);
+  do {
+    if (Cnt >= pShard->MaxConnections) {
+      return 0;
+    }
+  } while (atomic_compare_exchange_weak(&pShard->ConnectCnt, &Cnt, Cnt + 1) == 0);
+  return 1;
+}
+
+/*********************************************************************
+*
+*       _WORK_Init
+*
+*  Function description
+*    Allocates the queue the workers take sessions from. The queue holds
+*    every connection the server accepts, so it can only be full if
+*    sessions are queued faster than the workers run them.
+*/
+static int _WORK_Init(void) {
+  size_t NumSlots;
+  size_t i;
+
+  NumSlots = 1;
+  while (NumSlots < MAX_CONNECTIONS) {
+    NumSlots <<= 1;
+  }
+  _WorkQueue.paSlot = (_WORK_SLOT*)malloc(NumSlots * sizeof(_WORK_SLOT));
+  if (_WorkQueue.paSlot == NULL) {
+    return -1;
+  }
+  for (i = 0; i < NumSlots; i++) {
+    atomic_init(&_WorkQueue.paSlot[i].Seq, i);
+    _WorkQueue.paSlot[i].pSession = NULL;
+  }
+  _WorkQueue.Mask = NumSlots - 1;
+  atomic_init(&_WorkQueue.WrPos, 0);
+  atomic_init(&_WorkQueue.RdPos, 0);
+  return sem_init(&_WorkQueue.Sem, 0, 0);
+}
+
+/*********************************************************************
+*
+*       _WORK_Put
+*
+*  Function description
+*    Adds a session to the queue without taking a lock. Any idle worker
+*    runs it, so a session never waits behind a busy worker while
+*    another one is idle. Can be called from any thread.
+*    A session is armed with EPOLLONESHOT, so it is queued at most once.
+*/
+static void _WORK_Put(_SESSION* pSession) {
+  _WORK_SLOT* pSlot;
+  size_t      Pos;
+  size_t      Seq;
+  intptr_t    Diff;
+
+  Pos = atomic_load_explicit(&_WorkQueue.WrPos, memory_order_relaxed);
+  while (1) {
+    pSlot = &_WorkQueue.paSlot[Pos & _WorkQueue.Mask];
+    Seq   = atomic_load_explicit(&pSlot->Seq, memory_order_acquire);
+    Diff  = (intptr_t)Seq - (intptr_t)Pos;
+    if (Diff == 0) {
+      //
+      // Slot is free, try to claim it
+      //
+      if (atomic_compare_exchange_weak_explicit(&_WorkQueue.WrPos, &Pos, Pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+        break;
+      }
+    } else if (Diff < 0) {
+      sched_yield();  // Slot still filled from the previous round: queue is full, let the workers catch up
+      Pos = atomic_load_explicit(&_WorkQueue.WrPos, memory_order_relaxed);
+    } else {
+      Pos = atomic_load_explicit(&_WorkQueue.WrPos, memory_order_relaxed);  // Another producer claimed the slot
+    }
+  }
+  pSlot->pSession = pSession;
+  atomic_store_explicit(&pSlot->Seq, Pos + 1, memory_order_release);
+  sem_post(&_WorkQueue.Sem);
+}
+
+/*********************************************************************
+*
+*       _WORK_Get
+*
+*  Function description
+*    Waits for and removes the next session from the queue.
+*
+*  Notes
+*    (1) Every token of the semaphore stands for a slot that has been
+*        claimed by a producer, and the workers claim the slots in the
+*        same order. The slot a worker claims may still be filled while
+*        a later one has already been posted. The worker keeps the slot
+*        and waits for it, taking another token instead would lose the
+*        wakeup of this session.
+*/
+static _SESSION* _WORK_Get(void) {
+  _WORK_SLOT* pSlot;
+  _SESSION*   pSession;
+  size_t      Pos;
+
+  while (sem_wait(&_WorkQueue.Sem) != 0) {
+    ;                 // Interrupted by a signal, wait again
+  }
+  Pos   = atomic_fetch_add_explicit(&_WorkQueue.RdPos, 1, memory_order_relaxed);
+  pSlot = &_WorkQueue.paSlot[Pos & _WorkQueue.Mask];
+  while (atomic_load_explicit(&pSlot->Seq, memory_order_acquire) != Pos + 1) {
+    sched_yield();    // Producer has claimed the slot but not filled it yet, see (1)
+  }
+  pSession = pSlot->pSession;
+  atomic_store_explicit(&pSlot->Seq, Pos + _WorkQueue.Mask + 1, memory_order_release);
+  return pSession;
+}
+
+/*********************************************************************
+*
+*       _SESSION_Arm
+*
+*  Function description
+*    Lets the reactor report the next time the control connection
+*    of the session becomes readable.
+*/
+static int _SESSION_Arm(_SESSION* pSession, int Op) {
+  struct epoll_event Event;
+
+  memset(&Event, 0, sizeof(Event));
+  Event.events   = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+  Event.data.ptr = pSession;
+  return epoll_ctl(pSession->pShard->hEpoll, Op, pSession->hSock, &Event);
 }
 
 /*********************************************************************
 *
-*       _FTPServerChildTask
+*       _SESSION_Close
 *
+*  Function description
+*    Ends the FTP session, closes its control connection and frees it.
 */
-static void* _FTPServerChildTask(void * Context) {
-  int                 hSock;
+static void _SESSION_Close(_SESSION* pSession) {
+  epoll_ctl(pSession->pShard->hEpoll, EPOLL_CTL_DEL, pSession->hSock, NULL);
+  IP_FTPS_End(pSession->pFTPS);
+  _SYS_NET_CloseSocket(pSession->hSock);
+  free(pSession->pFTPS);
+  _AddToConnectCnt(pSession->pShard, -1);
+  free(pSession);
+}
 
-  _pFS_API   = &IP_FS_Linux;
-  hSock      = (int)Context;
+/*********************************************************************
+*
+*       _SESSION_Start
+*
+*  Function description
+*    Starts the FTP session of a new control connection, sends the
+*    sign-on message and hands the connection to the reactor.
+*    Called by a worker, so a slow client does not delay accept().
+*/
+static void _SESSION_Start(_SESSION* pSession) {
+  pSession->pFTPS = malloc(IP_FTPS_GetSessionSize());
+  if (pSession->pFTPS != NULL) {
+    if (IP_FTPS_Start(pSession->pFTPS, &_IP_API, (FTPS_SOCKET)(intptr_t)pSession->hSock, _pFS_API, &_Application) == 0) {
+      if (_SESSION_Arm(pSession, EPOLL_CTL_ADD) == 0) {
+        return;
+      }
+    }
+    IP_FTPS_End(pSession->pFTPS);
+    free(pSession->pFTPS);
+  }
+  _SYS_NET_CloseSocket(pSession->hSock);
+  _AddToConnectCnt(pSession->pShard, -1);
+  free(pSession);
+}
 
-  IP_FTPS_Process(&_IP_API, Context, _pFS_API, &_Application);
+/*********************************************************************
+*
+*       _FTPServerWorkerTask
+*
+*  Function description
+*    Executes the commands of sessions that have been reported readable.
+*    A transfer keeps the worker busy until it is completed, another
+*    thread takes its place meanwhile. Idle sessions do not occupy a thread.
+*/
+static void* _FTPServerWorkerTask(void * Context) {
+  _SESSION* pSession;
 
-  _SYS_Sleep(2);          // Give connection some time to complete
-  _SYS_NET_CloseSocket(hSock);
-  _AddToConnectCnt(-1);
+  (void)Context;
+  while (1) {
+    pSession = _WORK_Get();
+    if (pSession->pFTPS == NULL) {
+      _SESSION_Start(pSession);
+      continue;
+    }
+    if (IP_FTPS_Resume(pSession->pFTPS) < 0) {
+      _SESSION_Close(pSession);
+    } else if (_SESSION_Arm(pSession, EPOLL_CTL_MOD) < 0) {
+      _SESSION_Close(pSession);
+    }
+    if (_IsTransferring && (_WORK_EndTransfer() < 0)) {
+      break;
+    }
+  }
+  _STAT_RING_Destroy(_pStatRing);   // io_uring of the listings this thread has done
+  _pStatRing = NULL;
   return (0);
 }
 
+/*********************************************************************
+*
+*       _RejectPending
+*
+*  Function description
+*    Called if accept4() has failed because no descriptor is left. The
+*    listening socket is level-triggered and would wake up the reactor
+*    again and again for the pending connection. The reserve descriptor
+*    is released to accept the connection and close it with a 421 reply.
+*
+*  Return value
+*     0 :  A connection has been rejected
+*    -1 :  No connection pending or no descriptor available
+*/
+static int _RejectPending(_SHARD* pShard) {
+  int hSock;
+
+  if (pShard->hReserve >= 0) {
+    close(pShard->hReserve);
+  }
+  hSock = accept4(pShard->hSockListen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (hSock >= 0) {
+    IP_FTPS_OnConnectionLimit(&_IP_API, (FTPS_SOCKET)(intptr_t)hSock);
+    _SYS_NET_CloseSocket(hSock);
+  }
+  pShard->hReserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  return (hSock >= 0) ? 0 : -1;
+}
+
+/*********************************************************************
+*
+*       _OnAccept
+*
+*  Function description
+*    Accepts all pending connections on the listening socket of a shard.
+*/
+static void _OnAccept(_SHARD* pShard) {
+  _SESSION* pSession;
+  int       hSock;
+  int       One;
+
+  One = 1;
+  while (1) {
+    hSock = accept4(pShard->hSockListen, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (hSock < 0) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;             // Interrupted, or the connection has been reset while it was pending
+      }
+      if ((errno == EMFILE) || (errno == ENFILE)) {
+        if (_RejectPending(pShard) == 0) {
+          continue;
+        }
+      }
+      break;                  // No more pending connections
+    }
+    //
+    // The FTP server already sends the replies to all received commands at once. Nagle's algorithm
+    // would hold back the replies to the next part of pipelined commands until the client
+    // acknowledges the previous ones, which the client delays as it is still waiting for replies.
+    //
+    setsockopt(hSock, IPPROTO_TCP, TCP_NODELAY, &One, sizeof(One));
+    if (_TryAddConnection(pShard)) {
+      pSession = (_SESSION*)malloc(sizeof(_SESSION));
+      if (pSession == NULL) {
+        _SYS_NET_CloseSocket(hSock);
+        _AddToConnectCnt(pShard, -1);
+        continue;
+      }
+      pSession->pShard = pShard;
+      pSession->hSock  = hSock;
+      pSession->pFTPS  = NULL;
+      _WORK_Put(pSession);    // The worker starts the session
+    } else {
+      //
+      // The reply fits into the empty send buffer of the new connection and is sent by the stack after the socket has been closed
+      //
+      IP_FTPS_OnConnectionLimit(&_IP_API, (FTPS_SOCKET)(intptr_t)hSock);
+      _SYS_NET_CloseSocket(hSock);
+    }
+  }
+}
+
+/*********************************************************************
+*
+*       _OnShutdownSignal
+*
+*  Function description
+*    Signal handler for SIGINT and SIGTERM. Wakes up every reactor and
+*    every waiting socket operation through the shutdown event.
+*/
+static void _OnShutdownSignal(int Signal) {
+  uint64_t One;
+  ssize_t  r;
+
+  (void)Signal;
+
+  One = 1;
+  r   = write(_hShutdown, &One, sizeof(One));
+  (void)r;
+}
+
+/*********************************************************************
+*
+*       _SHARD_Init
+*
+*  Function description
+*    Creates the listening socket and the reactor of a shard.
+*    With more than one shard, every shard listens on the same port
+*    (SO_REUSEPORT) and the kernel spreads the connections across them.
+*/
+static int _SHARD_Init(_SHARD* pShard, unsigned short Port, int isReusePort) {
+  struct epoll_event Event;
+
+  if (_SYS_NET_ListenSocket(&pShard->hSockListen, Port, isReusePort) < 0) {
+    return -1;
+  }
+  pShard->hEpoll = epoll_create1(EPOLL_CLOEXEC);
+  if (pShard->hEpoll < 0) {
+    return -1;
+  }
+  pShard->hReserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+  //
+  // The listening socket is identified by a NULL pointer, the shutdown event by its own address
+  //
+  memset(&Event, 0, sizeof(Event));
+  Event.events   = EPOLLIN;
+  Event.data.ptr = NULL;
+  if (epoll_ctl(pShard->hEpoll, EPOLL_CTL_ADD, pShard->hSockListen, &Event) < 0) {
+    return -1;
+  }
+  Event.data.ptr = &_hShutdown;
+  return epoll_ctl(pShard->hEpoll, EPOLL_CTL_ADD, _hShutdown, &Event);
+}
+
+/*********************************************************************
+*
+*       _FTPServerShardTask
+*
+*  Function description
+*    Runs the reactor of a shard: waits for new connections and for
+*    control connections becoming readable, and hands them to the workers.
+*    Returns when the server is shut down.
+*/
+static void* _FTPServerShardTask(void * Context) {
+  struct epoll_event aEvent[MAX_EVENTS];
+  _SHARD*   pShard;
+  cpu_set_t CpuSet;
+  int       NumEvents;
+  int       i;
+
+  pShard = (_SHARD*)Context;
+  if (pShard->Cpu >= 0) {
+    CPU_ZERO(&CpuSet);
+    CPU_SET(pShard->Cpu, &CpuSet);
+    pthread_setaffinity_np(pthread_self(), sizeof(CpuSet), &CpuSet);
+  }
+  do {
+    NumEvents = epoll_wait(pShard->hEpoll, aEvent, MAX_EVENTS, -1);
+    for (i = 0; i < NumEvents; i++) {
+      if (aEvent[i].data.ptr == NULL) {
+        _OnAccept(pShard);
+      } else if (aEvent[i].data.ptr == &_hShutdown) {
+        return (0);
+      } else {
+        _WORK_Put((_SESSION*)aEvent[i].data.ptr);
+      }
+    }
+  } while (1);
+}
+
 /*********************************************************************
 *
 *       Public code
@@ -1470,55 +4472,148 @@ static void* _FTPServerChildTask(void * Context) {
 **********************************************************************
 */
 
+/*********************************************************************
+*
+*       _FTPServerGetNumDataBufferOverflows
+*
+*  Function description
+*    Returns the number of data buffers that have been allocated with
+*    malloc() because all buffers of the pool were in use. If it keeps
+*    growing, DATA_BUFFER_COUNT is too small for the load.
+*/
+unsigned _FTPServerGetNumDataBufferOverflows(void) {
+  unsigned NumOverflows;
+
+  pthread_mutex_lock(&_DataBufPool.Lock);
+  NumOverflows = _DataBufPool.NumOverflows;
+  pthread_mutex_unlock(&_DataBufPool.Lock);
+  return NumOverflows;
+}
+
 /*********************************************************************
 *
 *       _FTPServerParentTask
 *
+*  Function description
+*    Starts the workers and the shards. The reactor of the first shard
+*    runs in the calling thread. Returns on SIGINT or SIGTERM.
 */
 void _FTPServerParentTask(void) {
-  int            hSockListen;
-  int                  hSock;
+  struct sigaction   Action;
+  _SHARD*          paShard;
+  long            NumShards;
+  long            NumWorkers;
+  long              NumCpus;
   int                      i;
-  pthread_t         ThreadId;
-  int                 status;
-  int          isBreakRequest = FALSE;
 
+  _pFS_API = &IP_FS_Linux;
+  //
+  // Shut down on SIGINT and SIGTERM. A client closing a connection must not terminate the server.
+  //
+  _hShutdown = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (_hShutdown < 0) {
+    perror("eventfd error");
+    exit(-1);
+  }
+  memset(&Action, 0, sizeof(Action));
+  Action.sa_handler = _OnShutdownSignal;
+  sigaction(SIGINT,  &Action, NULL);
+  sigaction(SIGTERM, &Action, NULL);
+  Action.sa_handler = SIG_IGN;
+  sigaction(SIGPIPE, &Action, NULL);
   //
   // Config Base Dir
   //
   _FS_LINUX_ConfigBaseDir("./");
   //
-  // Get a socket into listening state
+  // Allocate the buffers for the data connections
   //
-  status = _SYS_NET_ListenSocket(&hSockListen, 2121);
-  if (status < 0) {
-    perror("listen tcp error");
+  if (_DATA_BUF_Config(DATA_BUFFER_SIZE, DATA_BUFFER_COUNT) < 0) {
+    perror("data buffer allocation error");
     exit(-1);
   }
   //
-  // Loop once per client and create a thread for the actual server
+  // Watch cached directory listings for changes
   //
-  do {
-    //
-    // Wait for an incoming connection
-    //
-    status = _SYS_NET_AcceptSocket(&hSock, hSockListen, &isBreakRequest);
-    if (status < 0) {
-      continue;               // Error, try again.
+  _LIST_CACHE_Init();
+  //
+  // Watch files whose metadata is cached for changes
+  //
+  _STAT_CACHE_Init();
+  //
+  // Share descriptors of downloaded files
+  //
+  if (_FD_CACHE_Config(FD_CACHE_NUM_FILES) < 0) {
+    perror("open file cache allocation error");
+    exit(-1);
+  }
+  //
+  // Select how directory listings fetch metadata
+  //
+  if (_STAT_Config(STAT_THREADS) < 0) {
+    perror("stat thread creation error");
+    exit(-1);
+  }
+  //
+  // Start the threads reading directories ahead for LIST -R
+  //
+  if (_TREE_Config(TREE_THREADS) < 0) {
+    perror("read-ahead thread creation error");
+    exit(-1);
+  }
+  //
+  // Bind the listeners of the passive port range
+  //
+  if (_PASV_Config(PASV_PORT_MIN, PASV_PORT_MAX) < 0) {
+    perror("passive port pool allocation error");
+    exit(-1);
+  }
+  //
+  // Start the workers
+  //
+  NumCpus    = sysconf(_SC_NPROCESSORS_ONLN);
+  NumCpus    = MAX(NumCpus, 1);
+  NumWorkers = NUM_WORKERS;
+  if (NumWorkers <= 0) {
+    NumWorkers = NumCpus;
+  }
+  if (_WORK_Init() < 0) {
+    perror("work queue allocation error");
+    exit(-1);
+  }
+  if (_WORK_Config((unsigned)NumWorkers, _FTPServerWorkerTask) < 0) {
+    perror("thread creation error");
+    exit(-1);
+  }
+  //
+  // Get the sockets of all shards into listening state
+  //
+  NumShards = NUM_SHARDS;
+  if (NumShards <= 0) {
+    NumShards = NumWorkers;
+  }
+  paShard = (_SHARD*)calloc(NumShards, sizeof(_SHARD));
+  if (paShard == NULL) {
+    perror("shard allocation error");
+    exit(-1);
+  }
+  for (i = 0; i < NumShards; i++) {
+    paShard[i].MaxConnections = MAX(MAX_CONNECTIONS / NumShards, 1);
+    paShard[i].Cpu            = PIN_SHARDS ? (int)(i % NumCpus) : -1;
+    atomic_init(&paShard[i].ConnectCnt, 0);
+    if (_SHARD_Init(&paShard[i], 2121, (NumShards > 1)) < 0) {
+      perror("listen tcp error");
+      exit(-1);
     }
-    if (_ConnectCnt < MAX_CONNECTIONS) {
-      for (i = 0; i < MAX_CONNECTIONS; i++) {
-        pthread_create(&ThreadId, NULL, _FTPServerChildTask, (void*)hSock);
-        _AddToConnectCnt(1);
-        break;
-      }
-    } else {
-      IP_FTPS_OnConnectionLimit(&_IP_API, (FTPS_SOCKET)hSock);
-      _SYS_Sleep(2);          // Give connection some time to complete
-      _SYS_NET_CloseSocket(hSock);
+  }
+  for (i = 1; i < NumShards; i++) {
+    if (pthread_create(&paShard[i].ThreadId, NULL, _FTPServerShardTask, &paShard[i]) != 0) {
+      perror("thread creation error");
+      exit(-1);
     }
-  } while (1);
+    pthread_detach(paShard[i].ThreadId);
+  }
+  _FTPServerShardTask(&paShard[0]);
 }
 
 /*************************** End of file ****************************/
-
@@ -54,10 +54,17 @@ extern "C" {     /* Make sure we have C-declarations in C++ programs */
 */
 #define IP_FS_ATTRIB_DIR      (1 << 0)
 
+#define IP_FS_DIR_ENTRY_STAT  (1 << 0)    // pfForEachDirEntryEx(): Size and time of every entry will be requested
+#define IP_FS_DIR_ENTRY_TREE  (1 << 1)    // pfForEachDirEntryEx(): Subdirectories will be listed next and may be read ahead, links are not followed
+
 #define IP_FTPS_PERM_VISIBLE  (1 << 0)
 #define IP_FTPS_PERM_READ     (1 << 1)
 #define IP_FTPS_PERM_WRITE    (1 << 2)
 
+#define IP_FTPS_LIST_CACHE_MISS  0        // pfListCacheOpen(): Not cached, list the directory without the cache
+#define IP_FTPS_LIST_CACHE_HIT   1        // pfListCacheOpen(): Listing returned in *ppData, *pNumBytes
+#define IP_FTPS_LIST_CACHE_FILL  2        // pfListCacheOpen(): List the directory and pass the output to pfListCacheWrite()
+
 /*********************************************************************
 *
 *       Types
@@ -74,6 +81,16 @@ typedef struct {
   void        (*pfDisconnect) (FTPS_SOCKET hDataSock);
   FTPS_SOCKET (*pfListen)     (FTPS_SOCKET hCtrlSock, uint16_t * pPort, uint8_t * pIPAddr);
   int         (*pfAccept)     (FTPS_SOCKET hCtrlSock, FTPS_SOCKET * phDataSocket);
+  //
+  // Optional zero-copy operations. May be NULL.
+  // pfSendFileDesc sends until the end of the file if NumBytes is negative.
+  //
+  int         (*pfSendFileDesc)(FTPS_SOCKET hDataSock, int FileDesc, int64_t Pos, int64_t NumBytes);
+  int64_t     (*pfRecvFileDesc)(FTPS_SOCKET hDataSock, int FileDesc, int64_t Pos);
+  //
+  // Optional non-blocking connect. May be NULL, pfConnect has to return a connected socket then.
+  //
+  int         (*pfConnectWait) (FTPS_SOCKET hDataSock);
 } IP_FTPS_API;
 
 typedef void* FTPS_OUTPUT;
@@ -88,10 +105,31 @@ typedef struct {
 typedef struct {
   FTPS_ACCESS_CONTROL * pAccess;
   uint32_t (*pfGetTimeDate) (void);
+  //
+  // Optional data buffer management. May be NULL.
+  // pfAllocDataBuffer returns a buffer for the data connection of a session and its size in *pNumBytes.
+  //
+  void *   (*pfAllocDataBuffer)(FTPS_SOCKET hCtrlSock, uint32_t * pNumBytes);
+  void     (*pfFreeDataBuffer) (void * pBuffer);
+  //
+  // Optional cache of formatted directory listings. May be NULL.
+  // Every entry opened with IP_FTPS_LIST_CACHE_HIT or _FILL is closed by pfListCacheClose(), Status < 0 discards a fill.
+  //
+  int      (*pfListCacheOpen)      (int UserId, char Format, const char * sDir, void ** phEntry, const void ** ppData, uint32_t * pNumBytes);
+  int      (*pfListCacheWrite)     (void * hEntry, const void * pData, uint32_t NumBytes);
+  void     (*pfListCacheClose)     (void * hEntry, int Status);
+  void     (*pfListCacheInvalidate)(const char * sDir);
 } FTPS_APPLICATION;
 
 typedef void* _FILE_HANDLE;
 
+typedef struct {
+  uint32_t   FileSize;
+  uint32_t   FileSizeHigh;
+  uint32_t   FileTime;                  // Packed date/time as returned by pfGetDirEntryFileTime(), 0 if unknown
+  int        Attributes;                // IP_FS_ATTRIB_...
+} IP_FS_FILE_STAT;
+
 typedef struct {
   //
   // Read only file operations. These have to be present on ANY file system, even the simplest one.
@@ -119,6 +157,20 @@ typedef struct {
   //
   int        (*pfMKDir)                (const char* sDirName);
   int        (*pfRMDir)                (const char* sDirName);
+  //
+  // Optional zero-copy operations. May be NULL.
+  //
+  int        (*pfGetFileDesc)          (void* hFile);
+  //
+  // Optional directory query with hints (IP_FS_DIR_ENTRY_...) that allow the file system to prefetch. May be NULL.
+  // pf returns 0 to continue, != 0 to stop the query; the directory has to be released before pfForEachDirEntryEx() returns.
+  //
+  void       (*pfForEachDirEntryEx)    (void* pContext, const char* sDir, unsigned Flags, int (*pf)(void* pContext, void* pFileEntry));
+  //
+  // Optional query of size, time and attributes of a file without opening it. May be NULL.
+  // Returns 0 if the file exists, -1 if not.
+  //
+  int        (*pfGetFileStat)          (const char* sFilename, IP_FS_FILE_STAT* pStat);
 } _FS_API;
 
 /*********************************************************************
@@ -128,8 +180,15 @@ typedef struct {
 **********************************************************************
 */
 
-int  IP_FTPS_Process           (const IP_FTPS_API * pIP_API, FTPS_SOCKET hCtrlSock, const _FS_API * pFS_API, const FTPS_APPLICATION * pApplication);
-void IP_FTPS_OnConnectionLimit (const IP_FTPS_API * pIP_API, FTPS_SOCKET hCtrlSock);
+int      IP_FTPS_Process           (const IP_FTPS_API * pIP_API, FTPS_SOCKET hCtrlSock, const _FS_API * pFS_API, const FTPS_APPLICATION * pApplication);
+void     IP_FTPS_OnConnectionLimit (const IP_FTPS_API * pIP_API, FTPS_SOCKET hCtrlSock);
+//
+// Event driven operation: one session per control connection, resumed whenever the connection is readable.
+//
+unsigned IP_FTPS_GetSessionSize    (void);
+int      IP_FTPS_Start             (void * pSession, const IP_FTPS_API * pIP_API, FTPS_SOCKET hCtrlSock, const _FS_API * pFS_API, const FTPS_APPLICATION * pApplication);
+int      IP_FTPS_Resume            (void * pSession);
+void     IP_FTPS_End               (void * pSession);
 
 #if defined(__cplusplus)
   }
@@ -361,6 +361,10 @@ From RFC 959
   #define FTPS_BUFFER_SIZE       512
 #endif
 
+#ifndef   FTPS_DATA_BUFFER_SIZE
+  #define FTPS_DATA_BUFFER_SIZE  512      // Used if the application does not provide a data buffer
+#endif
+
 #ifndef   FTPS_MAX_PATH
   #define FTPS_MAX_PATH          128
 #endif
@@ -394,6 +398,35 @@ From RFC 959
 #define CR    0xd
 #define SPACE 0x20
 
+/*********************************************************************
+*
+*       Directory listings
+*/
+#define LIST_NAME_SIZE  64                        // Buffer for the name of a directory entry
+#define LIST_FLAGS      "1aAdFhlLnrRSt"           // Single letter "ls" options clients send with LIST
+#define LIST_LINE_SIZE  (LIST_NAME_SIZE + 80)     // Longest LIST or MLSD line: type, size, time or facts, name and CRLF
+#define LIST_FILTER_MAX_TOKENS   63               // Largest number of tokens of a LIST/NLST pattern, without '*'
+#define LIST_FILTER_NUM_CLASSES  32               // Largest number of character classes of a LIST/NLST pattern
+
+/*********************************************************************
+*
+*       Commands
+*/
+#define CMD_FLAG_LOGIN  (1 << 0)                  // Requires a logged in user, else 530
+#define CMD_FLAG_ARG    (1 << 1)                  // Requires an argument, else 501
+#define CMD_FLAG_DATA   (1 << 2)                  // Uses the data connection, requires PASV or PORT first, else 425
+
+#define CMD_KEY(c0, c1, c2, c3)  (((uint32_t)(c0) << 24) | ((uint32_t)(c1) << 16) | ((uint32_t)(c2) << 8) | (uint32_t)(c3))
+
+/*********************************************************************
+*
+*       Replies
+*
+*  Constant replies are complete string literals, "<Code> <Text>\r\n",
+*  which are copied into the output buffer as they are.
+*/
+#define SEND_REPLY(pOutContext, sReply)  _WriteMem((pOutContext), (sReply), sizeof(sReply) - 1)
+
 /*********************************************************************
 *
 *       Types
@@ -401,6 +434,13 @@ From RFC 959
 **********************************************************************
 */
 
+enum {
+  DATA_STATE_NONE = 0,                // No data connection, neither PASV nor PORT received
+  DATA_STATE_LISTEN,                  // PASV received, the client connects when it starts the transfer
+  DATA_STATE_CONNECTING,              // PORT received, connection to the client in progress
+  DATA_STATE_CONNECTED                // Data connection established
+};
+
 typedef struct {
   const IP_FTPS_API * pIP_API;
   FTPS_SOCKET Sock;
@@ -408,6 +448,7 @@ typedef struct {
   int Size;                      // Size of buffer
   int Cnt;                       // Number of bytes in buffer
   int RdOff;
+  int IsSkipLine;                // 1: Discarding the rest of a line that did not fit into the buffer
 } IN_BUFFER_DESC;
 
 typedef struct {
@@ -416,8 +457,26 @@ typedef struct {
   uint8_t * pBuffer;                  // Pointer to the data buffer
   int BufferSize;                // Size of buffer
   int Cnt;                       // Number of bytes in buffer
+  void * hCapture;               // Listing cache entry receiving a copy of the output, NULL if none
+  int (*pfCapture)(void * hCapture, const void * pData, uint32_t NumBytes);
 } OUT_BUFFER_CONTEXT;
 
+//
+// Compiled LIST/NLST pattern. The pattern is a sequence of tokens (character, '?' or "[...]"),
+// '*' between them. State j of the matcher means that the first j tokens have matched, so all
+// states fit into a 64-bit mask and a name is matched in a single pass, one mask operation per
+// character. Characters accepted by the same tokens share a class.
+//
+typedef struct {
+  uint64_t aMask[LIST_FILTER_NUM_CLASSES];  // Per class: states reached from state j - 1 (bit j) with a character of the class
+  uint64_t Loop;                            // States that consume any character ('*')
+  uint64_t Final;                           // State reached when all tokens have matched
+  uint8_t  aClass[256];                     // Class of a character
+  char     acPrefix[LIST_NAME_SIZE];        // Literal characters the pattern starts with
+  int      PrefixLen;
+  int      IsLiteral;                       // 1: Pattern is a plain name in acPrefix, compared as is
+} LIST_FILTER;
+
 typedef struct {
   const _FS_API          * pFS_API;       // File system info
   const FTPS_APPLICATION * pApplication;
@@ -426,8 +485,28 @@ typedef struct {
   OUT_BUFFER_CONTEXT       CtrlOut;
   char                     acCurDir[FTPS_MAX_PATH_DIR];  // "/" or "/Dir/" or "/Dir/Sub/..."
   int                      UserId;                       // 0: No user, < 0 user known, waiting for password, > 0 valid user
+  int                      DataState;                    // DATA_STATE_..., state of DataOut.Sock
+  void                   * pDataBuffer;                  // Data buffer allocated from the application, NULL if the built-in buffer is used
+  const char             * sListDir;                     // Directory being listed, "/" or "/Dir/" or "/Dir/Sub/..."
+  const char             * sListName;                    // MLST, _GetListArg(): Name of the entry to look for, NULL once found
+  int                      ListFoundDir;                 // _GetListArg(): Entry found is a directory
+  const LIST_FILTER      * pListFilter;                  // Only entries matching are listed, NULL: All entries
+  unsigned                 ListYear;                     // Current year (0: 1980), sampled once per listing
+  int                      ListError;                    // Data connection failed while listing, stop sending
+  int                   (* pfListEntry)(void * pContext, void * pFileEntry);  // _ForEachDirEntry(): Callback if the file system has no pfForEachDirEntryEx()
+  int                      ListStop;                     // _ForEachDirEntry(): pfListEntry has requested to stop
+  char                   * sListPath;                    // LIST -R: Directory being listed, FTPS_MAX_PATH bytes, extended for every level
+  uint8_t                  acIn[FTPS_BUFFER_SIZE];       // Control connection input buffer
+  uint8_t                  acOut[FTPS_BUFFER_SIZE];      // Control connection output buffer
+  uint8_t                  acData[FTPS_DATA_BUFFER_SIZE];  // Built-in data buffer
 } FTPS_CONTEXT;
 
+typedef struct {
+  uint32_t Key;                                 // Verb packed by CMD_KEY(), 0 as 4th character of 3 letter verbs
+  unsigned Flags;                               // CMD_FLAG_...
+  int   (* pfExec)(FTPS_CONTEXT * pContext);    // Called with the input buffer behind the verb and a single space
+} CMD_DESC;
+
 /*********************************************************************
 *
 *       static const
@@ -437,6 +516,21 @@ typedef struct {
 
 static const char _aV2C[16] = {'0', '1', '2', '3', '4', '5', '6', '7', '8', '9', 'A', 'B', 'C', 'D', 'E', 'F' };
 
+static const char _acDec2[201] = {    // "00" .. "99"
+  "0001020304050607080910111213141516171819"
+  "2021222324252627282930313233343536373839"
+  "4041424344454647484950515253545556575859"
+  "6061626364656667686970717273747576777879"
+  "8081828384858687888990919293949596979899"
+};
+
+static const char _aMonth[12][6] = { " Jan ", " Feb ", " Mar ", " Apr ", " May ", " Jun ", " Jul ", " Aug ", " Sep ", " Oct ", " Nov ", " Dec " };
+
+static const char _aListType[2][21] = {
+  "-rw-r--r--   1 root ",             // File
+  "drw-r--r--   1 root "              // Directory
+};
+
 /*********************************************************************
 *
 *       static Code
@@ -485,7 +579,79 @@ static char * _StoreUnsigned(char * pDest, uint32_t v, unsigned Base, int NumDig
   return pDest;
 }
 
+/*********************************************************************
+*
+*       _StoreDec
+*
+*  Function description
+*    Stores a decimal number without leading zeros, two digits per
+*    division using the _acDec2 table.
+*/
+static char * _StoreDec(char * pDest, uint32_t v) {
+  char ac[10];
+  char * p;
+  unsigned i;
+  int NumBytes;
+
+  p = &ac[sizeof(ac)];
+  while (v >= 100) {
+    i  = (v % 100) * 2;
+    v /= 100;
+    *--p = _acDec2[i + 1];
+    *--p = _acDec2[i];
+  }
+  if (v >= 10) {
+    *--p = _acDec2[v * 2 + 1];
+    *--p = _acDec2[v * 2];
+  } else {
+    *--p = (char)('0' + v);
+  }
+  NumBytes = &ac[sizeof(ac)] - p;
+  memcpy(pDest, p, NumBytes);
+  return pDest + NumBytes;
+}
+
+/*********************************************************************
+*
+*       _StoreDec2
+*
+*  Function description
+*    Stores a number < 100 as two decimal digits with leading zero.
+*/
+static char * _StoreDec2(char * pDest, unsigned v) {
+  *pDest++ = _acDec2[v * 2];
+  *pDest++ = _acDec2[v * 2 + 1];
+  return pDest;
+}
+
+/*********************************************************************
+*
+*       _StoreDec64
+*
+*  Function description
+*    Stores a 64-bit number given as high and low word in decimal.
+*    Only sizes of 4 GB and above take the slower 64-bit path.
+*/
+static char * _StoreDec64(char * pDest, uint32_t High, uint32_t Low) {
+  char ac[20];
+  char * p;
+  uint64_t v;
+  int NumBytes;
 
+  if (High == 0) {
+    return _StoreDec(pDest, Low);
+  }
+  v = ((uint64_t)High << 32) | Low;
+  p = &ac[sizeof(ac)];
+  while (v > 0xFFFFFFFFu) {
+    *--p = (char)('0' + (unsigned)(v % 10));
+    v /= 10;
+  }
+  pDest    = _StoreDec(pDest, (uint32_t)v);
+  NumBytes = &ac[sizeof(ac)] - p;
+  memcpy(pDest, p, NumBytes);
+  return pDest + NumBytes;
+}
 
 /*********************************************************************
 *
@@ -538,6 +704,11 @@ static int _Flush(OUT_BUFFER_CONTEXT * pOutContext) {
   r = 0;
   Len = pOutContext->Cnt;
   if (Len) {
+    if (pOutContext->hCapture != NULL) {
+      if (pOutContext->pfCapture(pOutContext->hCapture, pOutContext->pBuffer, Len) < 0) {
+        pOutContext->hCapture = NULL;      // Listing does not fit into the cache
+      }
+    }
     r = pOutContext->pIP_API->pfSend(pOutContext->pBuffer, Len, pOutContext->Sock);
     pOutContext->Cnt = 0;
   }
@@ -590,20 +761,68 @@ static int _WriteString(OUT_BUFFER_CONTEXT * pOutContext, const char *s) {
 *       _WriteMem
 */
 static int _WriteMem(OUT_BUFFER_CONTEXT * pOutContext, const char *pSrc, int NumBytes) {
-  char c;
+  int NumBytesAtOnce;
   int r;
 
   r = 0;
-  while (NumBytes-- > 0) {
-    c = *pSrc++;
-    r = _WriteChar(pOutContext, c);
-    if (r == -1) {
-      break;
+  while (NumBytes > 0) {
+    NumBytesAtOnce = _MIN(NumBytes, pOutContext->BufferSize - pOutContext->Cnt);
+    memcpy(pOutContext->pBuffer + pOutContext->Cnt, pSrc, NumBytesAtOnce);
+    pOutContext->Cnt += NumBytesAtOnce;
+    pSrc             += NumBytesAtOnce;
+    NumBytes         -= NumBytesAtOnce;
+    if (pOutContext->Cnt == pOutContext->BufferSize) {
+      r = _Flush(pOutContext);
+      if (r == -1) {
+        break;
+      }
     }
   }
   return r;
 }
 
+/*********************************************************************
+*
+*       _ReserveOut
+*
+*  Function description
+*    Returns a pointer to at least NumBytes of free space in the output
+*    buffer, so a complete line can be formatted in place. The buffer is
+*    flushed first if required. The formatted bytes are added to the
+*    buffer by _CommitOut().
+*
+*  Return value
+*    != NULL    Free space
+*    == NULL    Error, sending the buffer failed or buffer too small
+*/
+static char * _ReserveOut(OUT_BUFFER_CONTEXT * pOutContext, int NumBytes) {
+  if (pOutContext->BufferSize - pOutContext->Cnt < NumBytes) {
+    if (_Flush(pOutContext) < 0) {
+      return NULL;
+    }
+    if (pOutContext->BufferSize < NumBytes) {
+      return NULL;
+    }
+  }
+  return (char *)pOutContext->pBuffer + pOutContext->Cnt;
+}
+
+/*********************************************************************
+*
+*       _CommitOut
+*
+*  Function description
+*    Adds the bytes formatted into the space returned by _ReserveOut()
+*    to the output buffer. pEnd points behind the last byte.
+*/
+static int _CommitOut(OUT_BUFFER_CONTEXT * pOutContext, const char * pEnd) {
+  pOutContext->Cnt = pEnd - (const char *)pOutContext->pBuffer;
+  if (pOutContext->Cnt == pOutContext->BufferSize) {
+    return _Flush(pOutContext);
+  }
+  return 0;
+}
+
 /*********************************************************************
 *
 *       _WriteUnsigned
@@ -638,78 +857,60 @@ static int _WriteUnsigned(OUT_BUFFER_CONTEXT * pOutContext, uint32_t v, unsigned
 
 /*********************************************************************
 *
-*       _WriteDataPort
-*/
-static int _WriteDataPort(FTPS_CONTEXT * pContext, const char * pData, int NumBytes) {
-  return _WriteMem(&pContext->DataOut, pData, NumBytes);
-}
-
-/*********************************************************************
+*       _StoreListTime
 *
-*       _WriteStringDataPort
-*/
-static int _WriteStringDataPort(FTPS_CONTEXT * pContext, const char * s) {
-  return _WriteString(&pContext->DataOut, s);
-}
-
-/*********************************************************************
+*  Function description
+*    Stores the file time of a LIST entry. Entries of the current year
+*    show the time, all others the year.
 *
-*       _WriteUnsignedDataPort
+*    Format: " Month Day Time " for example " Jan 1 00:00 " or " Jan 1  1980 "
 */
-static int _WriteUnsignedDataPort(FTPS_CONTEXT * pContext,uint32_t v, unsigned Base, int NumDigits) {
-  return _WriteUnsigned(&pContext->DataOut, v, Base, NumDigits);
+static char * _StoreListTime(char * p, uint32_t FileTime, unsigned CurrYear) {
+  unsigned Month;
+  unsigned Year;
+
+  if ((FileTime == 0x00210000) || (FileTime == 0x0)) {  // Check if timestamp of file correlates with the MSDOS file system initialization date/time (1980-01-01 00:00)
+    memcpy(p, " Jan  1  1980 ", 14);
+    return p + 14;
+  }
+  Month = ((FileTime >> 21) & 0xF) - 1;
+  if (Month >= 12) {
+    Month = 0;                // Invalid time stamp
+  }
+  memcpy(p, _aMonth[Month], 5);
+  p += 5;
+  p = _StoreDec(p, (FileTime >> 16) & 0x1F);
+  *p++ = ' ';
+  Year = (FileTime >> 25) & 0x7F;
+  if (Year != CurrYear) {
+    *p++ = ' ';
+    p = _StoreDec(p, Year + 1980);
+  } else {
+    p = _StoreDec2(p, (FileTime >> 11) & 0x1F);
+    *p++ = ':';
+    p = _StoreDec2(p, (FileTime >> 5) & 0x3F);
+  }
+  *p++ = ' ';
+  return p;
 }
 
 /*********************************************************************
 *
-*       _WriteFileTimeDataPort
+*       _StoreFactTime
 *
 *  Function description
-*    Writes the file time to the data port.
-*
-*    Format: " Month Day Year " for example " Jan 1 00:00 " or " Jan 1  1980 "
+*    Stores a time stamp as used by MDTM and MLST (RFC 3659, 2.3),
+*    for example "20240131235958". The time stamp is UTC with a
+*    resolution of 2 seconds.
 */
-static void _WriteFileTimeDataPort(FTPS_CONTEXT * pContext, uint32_t FileTime) {
-  int Day;
-  int Month;
-  int Year;
-  int Hour;
-  int Minute;
-  int SystemTime;
-  int  CurrYear;
-  const char * s;
-  const char * asMonth[12] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
-
-  _WriteStringDataPort(pContext, " ");
-  Month = (FileTime >> 21) & 0xF;
-  s = asMonth[Month - 1];
-  _WriteStringDataPort(pContext, s);
-  _WriteStringDataPort(pContext, " ");
-  Day   = (FileTime >> 16) & 0x1F;
-  _WriteUnsignedDataPort(pContext, Day, 10, 0);
-  _WriteStringDataPort(pContext, " ");
-  SystemTime = pContext->pApplication->pfGetTimeDate();
-  CurrYear = (SystemTime >> 25) & 0x7F;
-  Year = (FileTime >> 25) & 0x7F;
-  if (CurrYear != Year) {
-    Year += 1980;
-    _WriteStringDataPort(pContext, " ");
-    _WriteUnsignedDataPort(pContext, Year, 10, 0);
-    _WriteStringDataPort(pContext, " ");
-  } else {
-    Hour = (FileTime >> 11) & 0x1F;
-    if (Hour < 10) {
-      _WriteUnsignedDataPort(pContext, 0, 10, 0);
-    }
-    _WriteUnsignedDataPort(pContext, Hour, 10, 0);
-    _WriteStringDataPort(pContext, ":");
-    Minute = (FileTime >> 5) & 0x3F;
-    if (Minute < 10) {
-      _WriteUnsignedDataPort(pContext, 0, 10, 0);
-    }
-    _WriteUnsignedDataPort(pContext, Minute, 10, 0);
-    _WriteStringDataPort(pContext, " ");
-  }
+static char * _StoreFactTime(char * p, uint32_t FileTime) {
+  p = _StoreDec (p, ((FileTime >> 25) & 0x7F) + 1980);
+  p = _StoreDec2(p, (FileTime >> 21) & 0x0F);
+  p = _StoreDec2(p, (FileTime >> 16) & 0x1F);
+  p = _StoreDec2(p, (FileTime >> 11) & 0x1F);
+  p = _StoreDec2(p, (FileTime >>  5) & 0x3F);
+  p = _StoreDec2(p, (FileTime & 0x1F) * 2);
+  return p;
 }
 
 /*********************************************************************
@@ -743,8 +944,7 @@ End:
   _WriteChar(pOutContext, ' ');
   _WriteMem(pOutContext, sLine, Cnt);
   _WriteChar(pOutContext, CR);
-  _WriteChar(pOutContext, LF);
-  return _Flush(pOutContext);
+  return _WriteChar(pOutContext, LF);
 }
 
 /*********************************************************************
@@ -753,9 +953,11 @@ End:
 *
 *  Function description
 *    Calls receive once, trying to read as many bytes as fit into the input buffer.
+*    The buffer is linear: unread bytes are moved to its start when there is
+*    no space left behind them, so a line is always contiguous in memory.
 *
 *  Return value
-*    0    Connection closed
+*    0    Connection closed or buffer full (not after _ProcessLines(), which discards a line that does not fit)
 *  > 0    Number of bytes read
 *  < 0    Error
 */
@@ -763,33 +965,22 @@ static int _Read(IN_BUFFER_DESC * pBufferDesc) {
   uint8_t * p;
   int WrOff;
   int i;
-  int Cnt;
-  int Size;
-  int Limit;
-  int NumBytes;
-
 
   if (pBufferDesc->Sock == NULL) {
     return -1;      // Error occurred.
   }
-  if (pBufferDesc->Cnt == 0) {
+  p = pBufferDesc->pBuffer;
+  if (pBufferDesc->RdOff + pBufferDesc->Cnt == pBufferDesc->Size) {
+    memmove(p, p + pBufferDesc->RdOff, pBufferDesc->Cnt);
     pBufferDesc->RdOff = 0;
   }
-  Cnt   = pBufferDesc->Cnt;
-  Size  = pBufferDesc->Size;
-  WrOff = pBufferDesc->RdOff + Cnt;
-  if (WrOff >= Size) {
-    WrOff -= Size;
-  }
-  p = pBufferDesc->pBuffer;
-  Limit = Size;
-  if (pBufferDesc->RdOff > WrOff) {
-    Limit = pBufferDesc->RdOff;
+  WrOff = pBufferDesc->RdOff + pBufferDesc->Cnt;
+  if (WrOff == pBufferDesc->Size) {
+    return 0;       // Line does not fit into the buffer
   }
-  NumBytes = Limit - WrOff;
-  i = pBufferDesc->pIP_API->pfReceive(p + WrOff, NumBytes, pBufferDesc->Sock);
+  i = pBufferDesc->pIP_API->pfReceive(p + WrOff, pBufferDesc->Size - WrOff, pBufferDesc->Sock);
   if (i > 0) {
-    pBufferDesc->Cnt = Cnt + i;
+    pBufferDesc->Cnt += i;
   }
   return i;
 }
@@ -802,23 +993,15 @@ static int _Read(IN_BUFFER_DESC * pBufferDesc) {
 *    Swallow the given number of bytes
 */
 static void _EatChars(IN_BUFFER_DESC * pBufferDesc, int NumChars) {
-  int RdPos;
-
   if (NumChars > pBufferDesc->Cnt) {
     FTPS_WARN(("_EatChars(): Trying to eat more bytes than in buffer"));
-    pBufferDesc->Cnt   = 0;
-    pBufferDesc->RdOff = 0;
-    return;
-  }
-  pBufferDesc->Cnt -= NumChars;
-  RdPos = pBufferDesc->RdOff + NumChars;
-  if (RdPos >= pBufferDesc->Size) {
-    RdPos -= pBufferDesc->Size;
+    NumChars = pBufferDesc->Cnt;
   }
+  pBufferDesc->Cnt   -= NumChars;
+  pBufferDesc->RdOff += NumChars;
   if (pBufferDesc->Cnt == 0) {
-    RdPos = 0;
+    pBufferDesc->RdOff = 0;
   }
-  pBufferDesc->RdOff = RdPos;
 }
 
 /*********************************************************************
@@ -833,19 +1016,10 @@ static void _EatChars(IN_BUFFER_DESC * pBufferDesc, int NumChars) {
 *    -1    no character at given buffer position
 */
 static int _GetCharND(IN_BUFFER_DESC * pBufferDesc, int Off) {
-  int r;
-  int Pos;
-
-  r = -1;
   if (Off >= pBufferDesc->Cnt) {
     return -1;
   }
-  Pos = pBufferDesc->RdOff + Off;
-  if (Pos >= pBufferDesc->Size) {
-    Pos -= pBufferDesc->Size;
-  }
-  r = *(pBufferDesc->pBuffer + Pos);
-  return r;
+  return *(pBufferDesc->pBuffer + pBufferDesc->RdOff + Off);
 }
 
 /*********************************************************************
@@ -864,43 +1038,22 @@ static int _GetCharND(IN_BUFFER_DESC * pBufferDesc, int Off) {
 *    "GET / \r\n" returns 8
 */
 static int _GetLineLen(IN_BUFFER_DESC * pBufferDesc) {
-  int i;
-  int c;
-
-  i = 0;
-  while((i + 1) < pBufferDesc->Cnt) {
-    c = _GetCharND(pBufferDesc, i);
-    i++;
-    if (c == 0x0D) {
-      c = _GetCharND(pBufferDesc, i);
-      if (c == 0x0A) {
-        return i + 1;
-      }
+  const uint8_t * pStart;
+  const uint8_t * pEnd;
+  const uint8_t * p;
+
+  pStart = pBufferDesc->pBuffer + pBufferDesc->RdOff;
+  pEnd   = pStart + pBufferDesc->Cnt - 1;       // LF has to follow CR
+  p      = pStart;
+  while (p < pEnd) {
+    p = (const uint8_t *)memchr(p, CR, pEnd - p);
+    if (p == NULL) {
+      break;
     }
-  }
-  return 0;
-}
-
-/*********************************************************************
-*
-*       _EatLine
-*
-*  Function description
-*    Swallow everything until end of line (0D 0A)
-*
-*  Return value
-*    0  No complete line in buffer
-*    1  Line eaten.
-*
-*/
-static int _EatLine(IN_BUFFER_DESC * pBufferDesc) {
-  int r;
-
-  r = -1;
-  r = _GetLineLen(pBufferDesc);
-  if (r > 0) {
-    _EatChars(pBufferDesc, r);
-    return 1;
+    if (*(p + 1) == LF) {
+      return p + 2 - pStart;
+    }
+    p++;
   }
   return 0;
 }
@@ -914,28 +1067,13 @@ static int _EatLine(IN_BUFFER_DESC * pBufferDesc) {
 *    >0  No of eaten white spaces
 */
 static int _EatWhite(IN_BUFFER_DESC * pBufferDesc) {
-  char c;
-  int RdOff;
   int r;
 
-  RdOff = pBufferDesc->RdOff;
   r = 0;
-  while (1) {
-    if (r == pBufferDesc->Cnt) {
-      break;                        // End of buffer reached
-    }
-    c = * (pBufferDesc->pBuffer + RdOff);
-    if (_IsWhite(c) == 0) {
-      break;
-    }
+  while ((r < pBufferDesc->Cnt) && _IsWhite(*(pBufferDesc->pBuffer + pBufferDesc->RdOff + r))) {
     r++;
-    RdOff++;
-    if (RdOff >= pBufferDesc->Size) {
-      RdOff = 0;
-    }
   }
-  pBufferDesc->RdOff = RdOff;
-  pBufferDesc->Cnt -= r;
+  _EatChars(pBufferDesc, r);
   return r;
 }
 
@@ -952,24 +1090,10 @@ static int _EatWhite(IN_BUFFER_DESC * pBufferDesc) {
 */
 static int _GetChar(IN_BUFFER_DESC * pBufferDesc) {
   int r;
-  int RdOff;
 
-  r = -1;
-  if (pBufferDesc->Cnt == 0) {
-    return -1;
-  }
-  RdOff = pBufferDesc->RdOff;
-  if (RdOff >= pBufferDesc->Size) {
-    RdOff -= pBufferDesc->Size;
-  }
-  r = *(pBufferDesc->pBuffer + RdOff);
-  //
-  // Adjust Cnt + RdOff
-  //
-  pBufferDesc->Cnt--;
-  pBufferDesc->RdOff++;
-  if (pBufferDesc->RdOff >= pBufferDesc->Size) {
-    pBufferDesc->RdOff = 0;
+  r = _GetCharND(pBufferDesc, 0);
+  if (r >= 0) {
+    _EatChars(pBufferDesc, 1);
   }
   return r;
 }
@@ -998,115 +1122,109 @@ static unsigned _GetDec(IN_BUFFER_DESC * pBufferDesc) {
 
 /*********************************************************************
 *
-*       _GetLine
+*       _GetArg
 *
 *  Function description
-*    Get & remove a line from buffer
+*    Returns the argument of the command, the rest of the line without
+*    leading white space, as view into the input buffer. The argument
+*    ends at the first control character, normally the CR of the line,
+*    which is replaced by a 0 so the argument can be used as string.
+*    The buffer position is not changed, the line is removed by
+*    _ParseInput() after the command.
+*
+*  Parameters
+*    ps     Receives a pointer to the argument.
+*
+*  Return value
+*    Length of the argument
 */
-static int _GetLine(IN_BUFFER_DESC * pBufferDesc, char * s, int NumBytes) {
-  char c;
-  uint8_t * pBuffer;
-  int RdOff;
-  int Cnt;
-  int i;
+static int _GetArg(IN_BUFFER_DESC * pBufferDesc, char ** ps) {
+  char * s;
+  int Len;
 
-  i = 0;
-  pBuffer = pBufferDesc->pBuffer;
-  RdOff   = pBufferDesc->RdOff;
-  Cnt     = pBufferDesc->Cnt;
-  do {
-    if (Cnt == 0) {
-      FTPS_WARN(("Line not terminated"));
-      return 0;
-    }
-    c = *(pBuffer + RdOff);
-    if ((c < 32)  || (c >= 127)) {
-      break;
-    }
-    *s++ = c;
-    i++;
-    if (i >= NumBytes) {
-      FTPS_WARN(("Error, string does not fit"));
-      return 0;
-    }
-    RdOff++;
-    Cnt--;
-    if (RdOff >= pBufferDesc->Size) {
-      RdOff = 0;
-    }
-  } while (1);
-  pBufferDesc->RdOff = RdOff;
-  pBufferDesc->Cnt   = Cnt;
-  *s = 0;
-  return i;
+  s = (char *)pBufferDesc->pBuffer + pBufferDesc->RdOff;
+  while (_IsWhite(*s)) {
+    s++;
+  }
+  Len = 0;
+  while ((uint8_t)s[Len] >= 32) {
+    Len++;
+  }
+  s[Len] = 0;
+  *ps = s;
+  return Len;
 }
 
 /*********************************************************************
 *
-*       _CompareCmd
+*       _GetPathArg
 *
 *  Function description
+*    Returns the argument of the command as absolute path. An absolute
+*    argument is returned in place in the input buffer, a relative one
+*    is appended to the current directory in sBuffer.
+*
+*  Parameters
+*    sBuffer    Buffer of FTPS_MAX_PATH bytes, used for relative paths.
 *
 *  Return value
-*    Number of bytes "swallowed"
+*    != NULL    Absolute path
+*    == NULL    Path does not fit into FTPS_MAX_PATH bytes
 */
-static int _CompareCmd(IN_BUFFER_DESC * pBufferDesc, const char * sCmd) {
-  char c;
-  char c1;
-  uint8_t * pBuffer;
-  int RdOff;
-  int i;
+static const char * _GetPathArg(FTPS_CONTEXT * pContext, char * sBuffer) {
+  char * s;
+  int LenDir;
+  int Len;
 
-  i = 0;
-  pBuffer = pBufferDesc->pBuffer;
-  RdOff   = pBufferDesc->RdOff;
-  do {
-    c = *sCmd++;
-    c = tolower(c);
-    c1 = *(pBuffer + RdOff);
-    c1 = tolower(c1);
-    if (c == 0) {           // Last char of Command reached ?
-      if (isalpha(c1) == 0) {
-        return i;           // Command found.
-      } else {
-        return 0;           // Command not found
-      }
-    }
-    if (c != c1) {
-      return 0;             // Command not found
-    }
-    i++;
-    RdOff++;
-    if (RdOff >= pBufferDesc->Size) {
-      RdOff = 0;
-    }
-  } while (1);
+  Len = _GetArg(&pContext->InBufferDesc, &s);
+  if (*s == '/') {
+    return (Len < FTPS_MAX_PATH) ? s : NULL;
+  }
+  LenDir = strlen(pContext->acCurDir);
+  if (LenDir + Len >= FTPS_MAX_PATH) {
+    return NULL;
+  }
+  memcpy(sBuffer, pContext->acCurDir, LenDir);
+  memcpy(sBuffer + LenDir, s, Len + 1);
+  return sBuffer;
 }
 
 /*********************************************************************
 *
-*       _ReadLine
+*       _GetCmdKey
 *
 *  Function description
-*    Make sure entire line is in buffer.
-*    If no entire line is in buffer, read data until an entire line is in buffer or buffer is full.
+*    Packs the verb at the start of the buffer into an integer, one
+*    upper case character per byte, as CMD_KEY() does.
+*
+*  Parameters
+*    pNumChars    Receives the number of characters of the verb.
 *
-*    >0  Number of bytes in line
-*   <=0  Error
+*  Return value
+*    != 0   Key of the verb
+*    == 0   No verb of 3 or 4 letters
 */
-static int _ReadLine(IN_BUFFER_DESC * pBufferDesc) {
+static uint32_t _GetCmdKey(IN_BUFFER_DESC * pBufferDesc, int * pNumChars) {
+  uint32_t Key;
+  int c;
   int i;
-  while (1) {
-    i = _GetLineLen(pBufferDesc);
-    if (i > 0) {
+
+  Key = 0;
+  for (i = 0; i < 5; i++) {
+    c = _GetCharND(pBufferDesc, i);
+    if ((c < 0) || (isalpha(c) == 0)) {
       break;
     }
-    i = _Read(pBufferDesc);
-    if (i <= 0) {
-      return -1;     // Error, close connection
-    }
+    Key = (Key << 8) | (uint32_t)(c & ~0x20);
   }
-  return i;          // Complete line in buffer
+  if ((i < 3) || (i > 4)) {
+    return 0;
+  }
+  if (i == 3) {
+    Key <<= 8;
+  }
+  *pNumChars = i;
+  return Key;
 }
 
 /*********************************************************************
@@ -1155,15 +1273,58 @@ static int _EatBytes(IN_BUFFER_DESC * pBufferDesc, int NumBytes) {
     pBufferDesc->Cnt = 0;
     return 0;
   }
-  pBufferDesc->Cnt = i;
+  _EatChars(pBufferDesc, NumBytes);
+  return NumBytes;
+}
+
+/*********************************************************************
+*
+*       _AllocDataBuffer
+*
+*  Function description
+*    Requests a data buffer from the application for the next transfer.
+*    The buffer is kept until the data connection is closed. If the
+*    application does not provide one, the small built-in buffer is used.
+*/
+static void _AllocDataBuffer(FTPS_CONTEXT * pContext) {
+  const FTPS_APPLICATION * pApplication;
+  void * pBuffer;
+  uint32_t NumBytes;
 
-  i =  pBufferDesc->RdOff;
-  i += NumBytes;
-  if (i >= pBufferDesc->Size) {
-    i -= pBufferDesc->Size;
+  pApplication = pContext->pApplication;
+  if ((pContext->pDataBuffer != NULL) || (pApplication->pfAllocDataBuffer == NULL)) {
+    return;
   }
-  pBufferDesc->RdOff = i;
-  return NumBytes;
+  NumBytes = 0;
+  pBuffer  = pApplication->pfAllocDataBuffer(pContext->CtrlOut.Sock, &NumBytes);
+  if (pBuffer == NULL) {
+    return;
+  }
+  if (NumBytes < FTPS_DATA_BUFFER_SIZE) {
+    pApplication->pfFreeDataBuffer(pBuffer);    // Smaller than the built-in buffer, listings format whole lines into it
+    return;
+  }
+  pContext->pDataBuffer        = pBuffer;
+  pContext->DataOut.pBuffer    = (uint8_t *)pBuffer;
+  pContext->DataOut.BufferSize = NumBytes;
+}
+
+/*********************************************************************
+*
+*       _FreeDataBuffer
+*
+*  Function description
+*    Returns the data buffer to the application and switches back to
+*    the built-in buffer.
+*/
+static void _FreeDataBuffer(FTPS_CONTEXT * pContext) {
+  if (pContext->pDataBuffer != NULL) {
+    pContext->pApplication->pfFreeDataBuffer(pContext->pDataBuffer);
+    pContext->pDataBuffer = NULL;
+  }
+  pContext->DataOut.pBuffer    = pContext->acData;
+  pContext->DataOut.BufferSize = sizeof(pContext->acData);
+  pContext->DataOut.Cnt        = 0;
 }
 
 /*********************************************************************
@@ -1179,30 +1340,126 @@ static void _Disconnect(FTPS_CONTEXT   * pContext) {
     pContext->DataOut.pIP_API->pfDisconnect(DataSock);
     pContext->DataOut.Sock = 0;
   }
+  pContext->DataState = DATA_STATE_NONE;
+  _FreeDataBuffer(pContext);
 }
 
 /*********************************************************************
 *
-*       _ReceiveFile
+*       _StartDataTransfer
 *
 *  Function description
+*    Announces a transfer and establishes the data connection. After
+*    PASV the connection from the client is accepted now, after PORT
+*    the connection started by the PORT command is completed. Either
+*    way the handshake overlaps with the transfer command. The port
+*    limits the time the handshake may take.
+*
+*  Return value
+*     0    O.K., data connection established
+*    -1    Error, 425 sent and data connection closed
 */
-static int _ReceiveFile(FTPS_CONTEXT * pContext, void * hFile) {
-  int  NumBytesAtOnce;
-  int  FilePos;
-  int  r;
+static int _StartDataTransfer(FTPS_CONTEXT * pContext) {
+  int r;
 
-  FilePos = 0;
-  NumBytesAtOnce = pContext->InBufferDesc.Size;
-  while (1) {
-    r = pContext->DataOut.pIP_API->pfReceive(pContext->InBufferDesc.pBuffer, NumBytesAtOnce, pContext->DataOut.Sock);
-    if ((r == -1) || (r == 0)) {
-      break;
+  SEND_REPLY(&pContext->CtrlOut, "150 File status okay; about to open data connection.\r\n");
+  if (_Flush(&pContext->CtrlOut) < 0) {     // Client may wait for the reply before it uses the data connection
+    return -1;
+  }
+  r = -1;
+  if (pContext->DataState == DATA_STATE_CONNECTED) {
+    r = 0;
+  } else if (pContext->DataState == DATA_STATE_LISTEN) {
+    r = pContext->DataOut.pIP_API->pfAccept(pContext->CtrlOut.Sock, &pContext->DataOut.Sock);
+    if (r == 0) {
+      pContext->DataState = DATA_STATE_CONNECTED;
+    }
+  } else if (pContext->DataState == DATA_STATE_CONNECTING) {
+    r = pContext->DataOut.pIP_API->pfConnectWait(pContext->DataOut.Sock);
+    if (r == 0) {
+      pContext->DataState = DATA_STATE_CONNECTED;
     }
-    pContext->pFS_API->pfWriteAt(hFile, pContext->InBufferDesc.pBuffer, FilePos, r);
-    FilePos += r;
   }
-  return r;
+  if (r != 0) {
+    SEND_REPLY(&pContext->CtrlOut, "425 Can't open data connection.\r\n");
+    _Disconnect(pContext);
+    return -1;
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _InvalidateDirList
+*
+*  Function description
+*    Drops cached listings of the directory containing sPath after the
+*    server has changed it.
+*/
+static void _InvalidateDirList(FTPS_CONTEXT * pContext, const char * sPath) {
+  char acDir[FTPS_MAX_PATH];
+  const char * s;
+  unsigned Len;
+
+  if (pContext->pApplication->pfListCacheInvalidate == NULL) {
+    return;
+  }
+  s = strrchr(sPath, '/');
+  if (s == NULL) {
+    return;
+  }
+  Len = (unsigned)(s - sPath) + 1;
+  if (Len >= sizeof(acDir)) {
+    return;
+  }
+  memcpy(acDir, sPath, Len);
+  acDir[Len] = 0;
+  pContext->pApplication->pfListCacheInvalidate(acDir);
+}
+
+/*********************************************************************
+*
+*       _ReceiveFile
+*
+*  Function description
+*    Stores everything received on the data connection in the file.
+*    If the IP stack and the file system both support it, the data is
+*    moved into the file by descriptor without passing the input buffer.
+*
+*  Return value
+*    0    O.K., connection closed by client
+*   -1    Error
+*/
+static int _ReceiveFile(FTPS_CONTEXT * pContext, void * hFile) {
+  int  NumBytesAtOnce;
+  int  FilePos;
+  int  FileDesc;
+  int  r;
+
+  //
+  // Use zero-copy transfer if available
+  //
+  if ((pContext->DataOut.pIP_API->pfRecvFileDesc != NULL) && (pContext->pFS_API->pfGetFileDesc != NULL)) {
+    FileDesc = pContext->pFS_API->pfGetFileDesc(hFile);
+    if (FileDesc >= 0) {
+      if (pContext->DataOut.pIP_API->pfRecvFileDesc(pContext->DataOut.Sock, FileDesc, 0) < 0) {
+        return -1;
+      }
+      return 0;
+    }
+  }
+  FilePos = 0;
+  _AllocDataBuffer(pContext);
+  NumBytesAtOnce = pContext->DataOut.BufferSize;
+  while (1) {
+    r = pContext->DataOut.pIP_API->pfReceive(pContext->DataOut.pBuffer, NumBytesAtOnce, pContext->DataOut.Sock);
+    if ((r == -1) || (r == 0)) {
+      break;
+    }
+    pContext->pFS_API->pfWriteAt(hFile, pContext->DataOut.pBuffer, FilePos, r);
+    FilePos += r;
+  }
+  return r;
 }
 
 /*********************************************************************
@@ -1210,16 +1467,38 @@ static int _ReceiveFile(FTPS_CONTEXT * pContext, void * hFile) {
 *       _SendFile
 *
 *  Function description
+*    Sends the entire file on the data connection.
+*    If the IP stack and the file system both support it, the file is
+*    handed to the stack by descriptor and never copied through the
+*    data buffer. Otherwise the file is read and sent in chunks.
+*
+*  Parameters
+*    pContext   Context of the FTP session
+*    hFile      Handle of the open file
+*    sFilename  Name of the file, used to query its 64-bit size
 */
 static int _SendFile(FTPS_CONTEXT * pContext, void * hFile) {
-  int FileLen;
-  int FilePos;
-  int NumBytesAtOnce;
+  long FileLen;
+  long FilePos;
+  int  NumBytesAtOnce;
+  int  FileDesc;
   OUT_BUFFER_CONTEXT * pOutContext;
   int r;
 
   pOutContext = &pContext->DataOut;
   FileLen =  pContext->pFS_API->pfGetLen(hFile);
+  //
+  // Use zero-copy transfer if available.
+  // pfGetLen() returns a long, which is 32 bits on some targets, so the file is sent until its end
+  // and the size is taken from the descriptor by the IP stack.
+  //
+  if ((pOutContext->pIP_API->pfSendFileDesc != NULL) && (pContext->pFS_API->pfGetFileDesc != NULL)) {
+    FileDesc = pContext->pFS_API->pfGetFileDesc(hFile);
+    if (FileDesc >= 0) {
+      return pOutContext->pIP_API->pfSendFileDesc(pOutContext->Sock, FileDesc, 0, -1);
+    }
+  }
+  _AllocDataBuffer(pContext);
   FilePos = 0;
   while (FileLen > 0) {
     //
@@ -1288,10 +1567,10 @@ static int _ExecCDUP(FTPS_CONTEXT * pContext) {
   perm = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, pContext->acCurDir, NULL, 0);
   if ((perm & IP_FTPS_PERM_VISIBLE) == 0) {
     *(s + i + 1) = c;       // Replace character
-    _SendFTPString(&pContext->CtrlOut, 550, "Requested action not taken.");
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
     return 1;               // No permission to read this directory
   }
-  _SendFTPString(&pContext->CtrlOut, 200, "CDUP command successful.");
+  SEND_REPLY(&pContext->CtrlOut, "200 CDUP command successful.\r\n");
   return 0;
 }
 
@@ -1320,68 +1599,51 @@ static int _ExecCDUP(FTPS_CONTEXT * pContext) {
 *
 */
 static int _ExecCWD(FTPS_CONTEXT * pContext) {
-  char acDirName[64];
+  char acDirName[FTPS_MAX_PATH];
+  const char * sDirName;
+  const char * s;
+  char * sArg;
   uint32_t  LenDirName;
   uint32_t  i;
-  const char * s;
 
   //
   // Get directory name.
   //
-  _EatWhite(&pContext->InBufferDesc);
-  _GetLine(&pContext->InBufferDesc, &acDirName[0], sizeof(acDirName));
-  _EatLine(&pContext->InBufferDesc);
-  LenDirName = strlen(acDirName);
-  if (LenDirName == 2) {
-    if (acDirName[0] == '.') {
-      if (acDirName[1] == '.') {
-        return _ExecCDUP(pContext);
-      }
-    }
+  _GetArg(&pContext->InBufferDesc, &sArg);
+  if (strcmp(sArg, "..") == 0) {
+    return _ExecCDUP(pContext);
   }
   //
-  // Handle absolute name, such as "/bin" or "/bin/sub" or "/bin/sub/"
+  // Make the name absolute, such as "/bin" or "/bin/sub" or "/bin/sub/".
+  // It has to fit into the current directory with a trailing '/'.
   //
-  if (acDirName[0] == '/') {
-    if (LenDirName >= sizeof(pContext->acCurDir)) {
-      goto ErrDirNameTooLong;
-    }
+  sDirName = _GetPathArg(pContext, acDirName);
+  if (sDirName == NULL) {
+    goto ErrDirNameTooLong;
   }
-  //
-  // Handle relative name, such as "sub"
-  //
-  else {
-    i = strlen(pContext->acCurDir);
-    if ((LenDirName + i) >= sizeof(pContext->acCurDir)) {
-      goto ErrDirNameTooLong;
-    }
-    memmove(&acDirName[i], &acDirName[0], LenDirName);
-    memcpy(&acDirName[0], pContext->acCurDir, i);
-    acDirName[LenDirName + i] = 0;
+  LenDirName = strlen(sDirName);
+  if (LenDirName + ((sDirName[LenDirName - 1] != '/') ? 1 : 0) >= sizeof(pContext->acCurDir)) {
+    goto ErrDirNameTooLong;
   }
   //
   // Check if this directory exists and is valid for current user
   //
-  s = acDirName;
+  s = sDirName;
   if (*s == '/') {
     s++;
   }
   i = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, s, NULL, 0);
   if ((i & IP_FTPS_PERM_READ) == 0) {
-
-  _SendFTPString(&pContext->CtrlOut, 550, "Access denied.");
+    SEND_REPLY(&pContext->CtrlOut, "550 Access denied.\r\n");
     return 0;    // No permission to read this directory
   }
-  strcpy(pContext->acCurDir, acDirName);
   //
   // Make sure directory is valid: Last char needs to be '/'
   //
-  LenDirName = strlen(acDirName);
-  if (acDirName[LenDirName - 1] != '/') {
-    if (LenDirName >= sizeof(acDirName) - 1) {
-      goto ErrDirNameTooLong;
-    }
-    strcat(pContext->acCurDir, "/");
+  memcpy(pContext->acCurDir, sDirName, LenDirName + 1);
+  if (sDirName[LenDirName - 1] != '/') {
+    pContext->acCurDir[LenDirName]     = '/';
+    pContext->acCurDir[LenDirName + 1] = 0;
   }
   //
   // Send reply
@@ -1389,11 +1651,10 @@ static int _ExecCWD(FTPS_CONTEXT * pContext) {
   _WriteString(&pContext->CtrlOut, "250 directory changed to ");
   _WriteString(&pContext->CtrlOut, pContext->acCurDir);
   _WriteString(&pContext->CtrlOut, "\r\n");
-  _Flush(&pContext->CtrlOut);
   return 0;
 
 ErrDirNameTooLong:
-  _SendFTPString(&pContext->CtrlOut, 550, "Directory name size too long");
+  SEND_REPLY(&pContext->CtrlOut, "550 Directory name size too long\r\n");
   return 0;
 }
 
@@ -1419,110 +1680,1026 @@ ErrDirNameTooLong:
 *
 */
 static int _ExecDELE(FTPS_CONTEXT * pContext) {
-  char acFilename[64];
+  char acFilename[FTPS_MAX_PATH];
+  const char * sFilename;
   int i;
-  int LenFileName;
 
-  _EatWhite(&pContext->InBufferDesc);
-  _GetLine(&pContext->InBufferDesc, &acFilename[0], sizeof(acFilename));
-  _EatLine(&pContext->InBufferDesc);
+  sFilename = _GetPathArg(pContext, acFilename);
   //
   // Check if we have write permission
   //
   i = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, pContext->acCurDir, NULL, 0);
   if ((i & IP_FTPS_PERM_WRITE) == 0) {
-    _SendFTPString(&pContext->CtrlOut, 553, "Requested action not taken - Not allowed.");
+    SEND_REPLY(&pContext->CtrlOut, "553 Requested action not taken - Not allowed.\r\n");
     return 0;   // No write permission for this directory
   }
-  if (acFilename[0] != '/') {            // Relative file name ?
-    //
-    // Add current directory to file name
-    //
-    i = strlen(pContext->acCurDir);
-    LenFileName = strlen(acFilename);
-    if (LenFileName + i >= sizeof(acFilename)) {
-      _SendFTPString(&pContext->CtrlOut, 550, "Filename size too long");
-      return 1;
-    }
-    memmove(&acFilename[i], &acFilename[0], LenFileName + 1);
-    memcpy(&acFilename[0], pContext->acCurDir, i);
+  if (sFilename == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Filename size too long\r\n");
+    return 1;
   }
-  i = _DeleteFile(pContext, &acFilename[0]);
+  i = _DeleteFile(pContext, (void *)sFilename);
   if (i == -1) {
-    _SendFTPString(&pContext->CtrlOut, 550, "Requested action not taken.");
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
+  } else {
+    _InvalidateDirList(pContext, sFilename);
+    SEND_REPLY(&pContext->CtrlOut, "250 File removed!\r\n");
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _ExecFEAT
+*
+*  Function description
+*    Execute FEAT command: Feature list
+*
+*  Add. information
+*    RFC 2389 says:
+*         The FEAT command consists solely of the word "FEAT".  It has no
+*         parameters or arguments.
+*
+*         Where a server-FTP process does not support all the extended
+*         commands, but does support some, the server should respond with
+*         a multi-line reply listing each supported extension.
+*/
+static int _ExecFEAT(FTPS_CONTEXT * pContext) {
+  _WriteString(&pContext->CtrlOut, "211-Extensions supported:\r\n");
+  if (pContext->pFS_API->pfGetFileStat != NULL) {
+    _WriteString(&pContext->CtrlOut, " MDTM\r\n");
+  }
+  _WriteString(&pContext->CtrlOut, " MLST type*;size*;modify*;perm*;\r\n"
+                                   " SIZE\r\n");
+  return SEND_REPLY(&pContext->CtrlOut, "211 End\r\n");
+}
+
+/*********************************************************************
+*
+*       _cbForEachDirEntry
+*
+*  Function description
+*    Passes the entries to pContext->pfListEntry for file systems which
+*    can not stop a query. Entries after a stop are skipped.
+*/
+static void _cbForEachDirEntry(void * pvoidContext, void * pFileEntry) {
+  FTPS_CONTEXT * pContext;
+  pContext = (FTPS_CONTEXT *)pvoidContext;
+
+  if (pContext->ListStop == 0) {
+    pContext->ListStop = pContext->pfListEntry(pContext, pFileEntry);
+  }
+}
+
+/*********************************************************************
+*
+*       _ForEachDirEntry
+*
+*  Function description
+*    Calls pf for every entry of a directory until pf returns != 0.
+*    Flags (IP_FS_DIR_ENTRY_...) tell the file system what the callback
+*    is going to query, so it can fetch that for many entries at once.
+*/
+static void _ForEachDirEntry(FTPS_CONTEXT * pContext, const char * sDir, unsigned Flags, int (*pf)(void * pContext, void * pFileEntry)) {
+  int (*pfPrev)(void * pContext, void * pFileEntry);
+
+  if (pContext->pFS_API->pfForEachDirEntryEx != NULL) {
+    pContext->pFS_API->pfForEachDirEntryEx(pContext, sDir, Flags, pf);
   } else {
-    _SendFTPString(&pContext->CtrlOut, 250, "File removed!");
+    pfPrev = pContext->pfListEntry;             // pf may list a subdirectory (LIST -R)
+    pContext->pfListEntry = pf;
+    pContext->ListStop    = 0;
+    pContext->pFS_API->pfForEachDirEntry(pContext, sDir, _cbForEachDirEntry);
+    pContext->pfListEntry = pfPrev;
+    pContext->ListStop    = 0;
+  }
+}
+
+/*********************************************************************
+*
+*       _SendDirList
+*
+*  Function description
+*    Sends the listing of a directory on the data connection. Only the
+*    entries matching pContext->pListFilter are listed if it is set.
+*    If the application caches listings, a cached listing is sent as is.
+*    Otherwise the directory is listed and the output is passed to the
+*    cache as well. The output is sent whenever the data buffer is full,
+*    so memory use does not depend on the size of the directory. The
+*    listing stops as soon as the data connection fails. Listings are
+*    cached per user, because the visible entries depend on the
+*    permissions of the user. Filtered listings are not cached.
+*
+*  Parameters
+*    sDir     Directory to list, "/" or "/Dir/" or "/Dir/Sub/...".
+*    Format   Identifies the format of the listing in the cache
+*             ('L': LIST, 'N': NLST, 'M': MLSD).
+*    Flags    IP_FS_DIR_ENTRY_..., passed to _ForEachDirEntry().
+*    pf       Callback formatting a single entry. Sets pContext->ListError
+*             and returns 1 if the output fails.
+*
+*  Return value
+*     0    O.K.
+*    -1    Error, data connection closed
+*/
+static int _SendDirList(FTPS_CONTEXT * pContext, const char * sDir, char Format, unsigned Flags, int (*pf)(void * pContext, void * pFileEntry)) {
+  const FTPS_APPLICATION * pApplication;
+  const void * pData;
+  void * hEntry;
+  uint32_t NumBytes;
+  int r;
+
+  pApplication = pContext->pApplication;
+  pContext->sListDir = sDir;
+  hEntry = NULL;
+  r      = IP_FTPS_LIST_CACHE_MISS;
+  if ((pApplication->pfListCacheOpen != NULL) && (pContext->pListFilter == NULL)) {
+    r = pApplication->pfListCacheOpen(pContext->UserId, Format, sDir, &hEntry, &pData, &NumBytes);
+  }
+  if (r == IP_FTPS_LIST_CACHE_HIT) {
+    r = 0;
+    if (NumBytes > 0) {
+      r = pContext->DataOut.pIP_API->pfSend((const unsigned char *)pData, NumBytes, pContext->DataOut.Sock);
+    }
+    pApplication->pfListCacheClose(hEntry, 0);
+    return (r < 0) ? -1 : 0;
+  }
+  _AllocDataBuffer(pContext);
+  pContext->ListYear = (pApplication->pfGetTimeDate() >> 25) & 0x7F;
+  if (r == IP_FTPS_LIST_CACHE_FILL) {
+    pContext->DataOut.hCapture  = hEntry;
+    pContext->DataOut.pfCapture = pApplication->pfListCacheWrite;
+  }
+  pContext->ListError = 0;
+  _ForEachDirEntry(pContext, sDir, Flags, pf);
+  r = _Flush(&pContext->DataOut);
+  if (pContext->ListError) {
+    r = -1;
+  }
+  if (hEntry != NULL) {
+    pApplication->pfListCacheClose(hEntry, ((r < 0) || (pContext->DataOut.hCapture == NULL)) ? -1 : 0);
+    pContext->DataOut.hCapture = NULL;
+  }
+  return (r < 0) ? -1 : 0;
+}
+
+/*********************************************************************
+*
+*       _NextFilterToken
+*
+*  Function description
+*    Parses a token of a pattern and checks if it accepts a character.
+*    Tokens are "?", "[abc]", "[a-z]", "[!abc]", "\c" and any other
+*    single character. A '[' without closing ']' is a plain character.
+*
+*  Parameters
+*    s           Start of the token.
+*    c           Character to check.
+*    pAccepts    Set to 1 if the token accepts c, 0 if not.
+*    pLiteral    Set to the character of a plain token, -1 for '?' and "[...]".
+*
+*  Return value
+*    Pointer to the next token.
+*/
+static const char * _NextFilterToken(const char * s, unsigned c, int * pAccepts, int * pLiteral) {
+  const char * sEnd;
+  unsigned First;
+  int IsNegated;
+  int Accepts;
+
+  if (*s == '?') {
+    *pAccepts = 1;
+    *pLiteral = -1;
+    return s + 1;
+  }
+  if (*s == '[') {
+    sEnd = s + 1;
+    if ((*sEnd == '!') || (*sEnd == '^')) {
+      sEnd++;
+    }
+    if (*sEnd == ']') {
+      sEnd++;                 // ']' right after '[' is part of the set
+    }
+    sEnd = strchr(sEnd, ']');
+    if (sEnd != NULL) {
+      s++;
+      IsNegated = 0;
+      if ((*s == '!') || (*s == '^')) {
+        IsNegated = 1;
+        s++;
+      }
+      Accepts = 0;
+      do {
+        First = (uint8_t)*s++;
+        if ((*s == '-') && (s + 1 < sEnd)) {
+          if ((c >= First) && (c <= (uint8_t)*(s + 1))) {
+            Accepts = 1;
+          }
+          s += 2;
+        } else if (c == First) {
+          Accepts = 1;
+        }
+      } while (s < sEnd);
+      *pAccepts = Accepts ^ IsNegated;
+      *pLiteral = -1;
+      return sEnd + 1;
+    }
+  }
+  if ((*s == '\\') && (*(s + 1) != 0)) {
+    s++;
+  }
+  *pAccepts = ((uint8_t)*s == c);
+  *pLiteral = (uint8_t)*s;
+  return s + 1;
+}
+
+/*********************************************************************
+*
+*       _CompileFilter
+*
+*  Function description
+*    Compiles a pattern with the wildcards '*', '?' and "[...]" into the
+*    state masks of a LIST_FILTER. Plain characters the pattern starts
+*    with are compared with memcmp() before the masks are used.
+*
+*  Return value
+*     0    O.K.
+*    -1    Pattern has too many tokens or character classes
+*/
+static int _CompileFilter(LIST_FILTER * pFilter, const char * sPattern) {
+  const char * s;
+  uint64_t Mask;
+  unsigned c;
+  int NumTokens;
+  int NumClasses;
+  int InPrefix;
+  int Accepts;
+  int Literal;
+  int i;
+
+  //
+  // Count tokens, find the '*' positions and the literal prefix.
+  //
+  memset(pFilter, 0, sizeof(*pFilter));
+  NumTokens = 0;
+  InPrefix  = 1;
+  s = sPattern;
+  while (*s) {
+    if (*s == '*') {
+      pFilter->Loop |= (uint64_t)1 << NumTokens;
+      InPrefix = 0;
+      s++;
+      continue;
+    }
+    if (NumTokens == LIST_FILTER_MAX_TOKENS) {
+      return -1;
+    }
+    s = _NextFilterToken(s, 0, &Accepts, &Literal);
+    if (Literal < 0) {
+      InPrefix = 0;
+    }
+    if (InPrefix) {
+      pFilter->acPrefix[pFilter->PrefixLen++] = (char)Literal;
+    }
+    NumTokens++;
+  }
+  pFilter->Final = (uint64_t)1 << NumTokens;
+  //
+  // Compute the mask of every character and assign it to a class.
+  //
+  NumClasses = 0;
+  for (c = 1; c < 256; c++) {
+    Mask = 0;
+    i    = 0;
+    s    = sPattern;
+    while (*s) {
+      if (*s == '*') {
+        s++;
+        continue;
+      }
+      s = _NextFilterToken(s, c, &Accepts, &Literal);
+      i++;
+      if (Accepts) {
+        Mask |= (uint64_t)1 << i;
+      }
+    }
+    for (i = 0; i < NumClasses; i++) {
+      if (pFilter->aMask[i] == Mask) {
+        break;
+      }
+    }
+    if (i == NumClasses) {
+      if (NumClasses == LIST_FILTER_NUM_CLASSES) {
+        return -1;
+      }
+      pFilter->aMask[NumClasses++] = Mask;
+    }
+    pFilter->aClass[c] = (uint8_t)i;
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _MatchFilter
+*
+*  Function description
+*    Checks if a name matches a compiled pattern. Takes a single pass
+*    over the name. As in a shell, wildcards do not match a leading '.'.
+*
+*  Return value
+*    1    Name matches
+*    0    Name does not match
+*/
+static int _MatchFilter(const LIST_FILTER * pFilter, const char * sName) {
+  const uint8_t * s;
+  uint64_t State;
+  int Len;
+
+  if (pFilter->IsLiteral) {
+    return (strcmp(sName, pFilter->acPrefix) == 0);
+  }
+  if ((*sName == '.') && (pFilter->PrefixLen == 0)) {
+    return 0;                     // Hidden entry
+  }
+  Len = strlen(sName);
+  if ((Len < pFilter->PrefixLen) || (memcmp(sName, pFilter->acPrefix, pFilter->PrefixLen) != 0)) {
+    return 0;
+  }
+  State = (uint64_t)1 << pFilter->PrefixLen;
+  for (s = (const uint8_t *)sName + pFilter->PrefixLen; *s; s++) {
+    State = ((State << 1) & pFilter->aMask[pFilter->aClass[*s]]) | (State & pFilter->Loop);
+    if (State == 0) {
+      return 0;
+    }
+  }
+  return ((State & pFilter->Final) != 0);
+}
+
+/*********************************************************************
+*
+*       _cbFind
+*
+*  Function description
+*    Looks for the entry named pContext->sListName. pContext->sListName
+*    is cleared once it has been found.
+*/
+static int _cbFind (void * pvoidContext, void * pFileEntry) {
+  char ac[LIST_NAME_SIZE];
+  FTPS_CONTEXT * pContext;
+  pContext = (FTPS_CONTEXT *)pvoidContext;
+  pContext->pFS_API->pfGetDirEntryFileName(pFileEntry, ac, sizeof(ac));
+  if (strcmp(ac, pContext->sListName) == 0) {
+    pContext->sListName = NULL;
+    pContext->ListFoundDir = pContext->pFS_API->pfGetDirEntryAttributes(pFileEntry);
+    return 1;
   }
   return 0;
 }
 
+/*********************************************************************
+*
+*       _GetListArg
+*
+*  Function description
+*    Reads the argument of a listing command: an optional path, whose
+*    last component may be a pattern. Options such as "-l" or "-la",
+*    which many clients send with LIST, are skipped. A group of "ls"
+*    flags containing "R", such as "-R" or "-lR", is reported in
+*    *pRecursive. The directory to list is returned in sDir. A pattern,
+*    or the name of a single file, is returned in pFilter. An error
+*    reply is sent on failure. The user needs read permission for the
+*    directory before the server tells whether a name exists in it.
+*
+*  Parameters
+*    sDir      Buffer of FTPS_MAX_PATH bytes, receives the absolute directory with trailing slash.
+*    pFilter   Receives the compiled pattern if the return value is 1.
+*    pRecursive  Set to 1 if the options contain a flag "R", else 0. May be NULL if not supported.
+*
+*  Return value
+*     0    List the directory
+*     1    List the entries of the directory matching pFilter
+*    -1    Error, reply sent
+*/
+static int _GetListArg(FTPS_CONTEXT * pContext, char * sDir, LIST_FILTER * pFilter, int * pRecursive) {
+  IP_FS_FILE_STAT Stat;
+  char * s;
+  char * sName;
+  int IsFlags;
+  int IsRecursive;
+  int Len;
+  int r;
+
+  _GetArg(&pContext->InBufferDesc, &s);
+  if (pRecursive) {
+    *pRecursive = 0;
+  }
+  while (*s == '-') {
+    s++;
+    IsFlags     = 1;
+    IsRecursive = 0;
+    while ((*s != 0) && (_IsWhite(*s) == 0)) {
+      if (strchr(LIST_FLAGS, *s) == NULL) {
+        IsFlags = 0;                  // Not a group of single letter flags, e.g. "--full-time"
+      } else if (*s == 'R') {
+        IsRecursive = 1;
+      }
+      s++;
+    }
+    if (IsFlags && IsRecursive && pRecursive) {
+      *pRecursive = 1;
+    }
+    while (_IsWhite(*s)) {
+      s++;
+    }
+  }
+  Len = strlen(s);
+  if (Len >= FTPS_MAX_PATH) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Filename too long.\r\n");
+    return -1;
+  }
+  memcpy(sDir, s, Len + 1);
+  r = 0;
+  if (*sDir == 0) {
+    strcpy(sDir, pContext->acCurDir);
+  } else {
+    if (_GenerateAbsFilename(pContext, sDir, FTPS_MAX_PATH)) {
+      SEND_REPLY(&pContext->CtrlOut, "550 Filename too long.\r\n");
+      return -1;
+    }
+    sName = strrchr(sDir, '/') + 1;
+    if (strcmp(sName, ".") == 0) {
+      *sName = 0;
+    } else if (strpbrk(sName, "*?[") != NULL) {
+      //
+      // Pattern
+      //
+      if (_CompileFilter(pFilter, sName)) {
+        SEND_REPLY(&pContext->CtrlOut, "501 Pattern too complex.\r\n");
+        return -1;
+      }
+      *sName = 0;
+      r = 1;
+    } else if (*sName != 0) {
+      //
+      // Name of a directory to be listed or of a single file.
+      //
+      Len = strlen(sName);
+      if (Len >= LIST_NAME_SIZE) {
+        SEND_REPLY(&pContext->CtrlOut, "550 Filename too long.\r\n");
+        return -1;
+      }
+      memset(pFilter, 0, sizeof(*pFilter));
+      memcpy(pFilter->acPrefix, sName, Len + 1);
+      pFilter->IsLiteral = 1;
+      *sName = 0;
+      if ((pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, sDir, NULL, 0) & IP_FTPS_PERM_READ) == 0) {
+        SEND_REPLY(&pContext->CtrlOut, "550 Access denied.\r\n");
+        return -1;
+      }
+      //
+      // Look the name up with a single query of the file system if possible, else search the directory for it
+      //
+      pContext->sListName = pFilter->acPrefix;
+      if (pContext->pFS_API->pfGetFileStat != NULL) {
+        *sName = pFilter->acPrefix[0];          // sDir is the path of the entry again
+        if (pContext->pFS_API->pfGetFileStat(sDir, &Stat) == 0) {
+          pContext->sListName    = NULL;
+          pContext->ListFoundDir = (Stat.Attributes & IP_FS_ATTRIB_DIR) ? 1 : 0;
+        }
+        *sName = 0;
+      } else {
+        _ForEachDirEntry(pContext, sDir, 0, _cbFind);
+      }
+      if (pContext->sListName != NULL) {
+        pContext->sListName = NULL;
+        SEND_REPLY(&pContext->CtrlOut, "550 No such file or directory.\r\n");
+        return -1;
+      }
+      if (pContext->ListFoundDir) {
+        if ((sName - sDir) + Len + 2 > FTPS_MAX_PATH) {
+          SEND_REPLY(&pContext->CtrlOut, "550 Filename too long.\r\n");
+          return -1;
+        }
+        memcpy(sName, pFilter->acPrefix, Len);
+        sName[Len]     = '/';
+        sName[Len + 1] = 0;
+      } else {
+        r = 1;
+      }
+    }
+  }
+  if ((pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, sDir, NULL, 0) & IP_FTPS_PERM_READ) == 0) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Access denied.\r\n");
+    return -1;
+  }
+  return r;
+}
+
 /*********************************************************************
 *
 *       _cbList
+*
+*  Function description
+*    Formats a LIST entry in one pass directly into the output buffer.
 */
-static void _cbList (void * pvoidContext, void * pFileEntry) {
-  char ac[64];
+static int _cbList (void * pvoidContext, void * pFileEntry) {
+  char ac[LIST_NAME_SIZE];
   FTPS_CONTEXT * pContext;
-  int FileLen;
   uint32_t FileSize;
-  uint32_t FileTime;
+  uint32_t FileSizeHigh;
   uint32_t IsDir;
+  char * p;
+  int Len;
   int i;
   pContext = (FTPS_CONTEXT *)pvoidContext;
 
   pContext->pFS_API->pfGetDirEntryFileName(pFileEntry, ac, sizeof(ac));
+  if (pContext->pListFilter && (_MatchFilter(pContext->pListFilter, ac) == 0)) {
+    return 0;
+  }
+  IsDir = pContext->pFS_API->pfGetDirEntryAttributes(pFileEntry);
+  if (IsDir) {
+    i = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, ac, NULL, 0);
+    if ((i & IP_FTPS_PERM_VISIBLE) == 0) {
+      return 0;    // No permission to see this directory
+    }
+  }
+  p = _ReserveOut(&pContext->DataOut, LIST_LINE_SIZE);
+  if (p == NULL) {
+    pContext->ListError = 1;
+    return 1;       // Data connection failed, stop listing
+  }
+  memcpy(p, _aListType[IsDir != 0], sizeof(_aListType[0]) - 1);
+  p += sizeof(_aListType[0]) - 1;
+  FileSizeHigh = 0;
+  FileSize = pContext->pFS_API->pfGetDirEntryFileSize(pFileEntry, &FileSizeHigh);
+  p = _StoreDec64(p, FileSizeHigh, FileSize);
+  p = _StoreListTime(p, pContext->pFS_API->pfGetDirEntryFileTime(pFileEntry), pContext->ListYear);
+  Len = strlen(ac);
+  memcpy(p, ac, Len);
+  p += Len;
+  *p++ = CR;
+  *p++ = LF;
+  if (_CommitOut(&pContext->DataOut, p) < 0) {
+    pContext->ListError = 1;
+    return 1;
+  }
+  if (pContext->pListFilter && pContext->pListFilter->IsLiteral) {
+    return 1;       // The only entry of the name has been listed
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _cbListTree
+*
+*  Function description
+*    Lists a subdirectory of pContext->sListPath, preceded by a line
+*    "/Dir/Sub:" as "ls -R" does, followed by its own subdirectories.
+*    Only directories the user may read are listed. The pattern of the
+*    command only selects the subdirectories of the listed directory,
+*    their own entries are listed completely. Subdirectories whose path
+*    exceeds FTPS_MAX_PATH are skipped. Symbolic links are not followed
+*    (IP_FS_DIR_ENTRY_TREE), a link to a parent would never end the walk.
+*
+*  Return value
+*     0    O.K.
+*     1    Data connection failed, stop listing
+*/
+static int _cbListTree (void * pvoidContext, void * pFileEntry) {
+  char ac[LIST_NAME_SIZE];
+  const LIST_FILTER * pFilter;
+  FTPS_CONTEXT * pContext;
+  char * sDir;
+  char * p;
+  int LenDir;
+  int Len;
+  int r;
+  pContext = (FTPS_CONTEXT *)pvoidContext;
+
+  if (pContext->pFS_API->pfGetDirEntryAttributes(pFileEntry) == 0) {
+    return 0;
+  }
+  pContext->pFS_API->pfGetDirEntryFileName(pFileEntry, ac, sizeof(ac));
+  if ((strcmp(ac, ".") == 0) || (strcmp(ac, "..") == 0)) {
+    return 0;
+  }
+  pFilter = pContext->pListFilter;
+  if (pFilter && (_MatchFilter(pFilter, ac) == 0)) {
+    return 0;
+  }
+  sDir   = pContext->sListPath;
+  LenDir = strlen(sDir);
+  Len    = strlen(ac);
+  if (LenDir + Len + 2 > FTPS_MAX_PATH) {
+    return 0;
+  }
+  memcpy(sDir + LenDir, ac, Len);
+  sDir[LenDir + Len]     = '/';
+  sDir[LenDir + Len + 1] = 0;
+  r = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, sDir, NULL, 0);
+  if ((r & (IP_FTPS_PERM_VISIBLE | IP_FTPS_PERM_READ)) == (IP_FTPS_PERM_VISIBLE | IP_FTPS_PERM_READ)) {
+    p = _ReserveOut(&pContext->DataOut, FTPS_MAX_PATH + 4);
+    if (p == NULL) {
+      pContext->ListError = 1;
+    } else {
+      *p++ = CR;
+      *p++ = LF;
+      memcpy(p, sDir, LenDir + Len);
+      p += LenDir + Len;
+      *p++ = ':';
+      *p++ = CR;
+      *p++ = LF;
+      if (_CommitOut(&pContext->DataOut, p) < 0) {
+        pContext->ListError = 1;
+      } else {
+        pContext->pListFilter = NULL;
+        _ForEachDirEntry(pContext, sDir, IP_FS_DIR_ENTRY_STAT, _cbList);
+        if (pContext->ListError == 0) {
+          _ForEachDirEntry(pContext, sDir, IP_FS_DIR_ENTRY_TREE, _cbListTree);
+        }
+        pContext->pListFilter = pFilter;
+      }
+    }
+  }
+  sDir[LenDir] = 0;
+  return pContext->ListError;
+}
+
+/*********************************************************************
+*
+*       _SendDirTree
+*
+*  Function description
+*    Sends the listing of a directory and of all its subdirectories on
+*    the data connection as a single listing. Directories are listed
+*    one after the other, so memory use does not depend on the size of
+*    the tree. The file system is told when the subdirectories of a
+*    directory are listed next, so it can read them ahead. Tree listings
+*    are not cached.
+*
+*  Parameters
+*    sDir     Directory to list, "/" or "/Dir/" or "/Dir/Sub/...".
+*
+*  Return value
+*     0    O.K.
+*    -1    Error, data connection closed
+*/
+static int _SendDirTree(FTPS_CONTEXT * pContext, const char * sDir) {
+  char acPath[FTPS_MAX_PATH];
+  int r;
+
+  _AllocDataBuffer(pContext);
+  pContext->ListYear  = (pContext->pApplication->pfGetTimeDate() >> 25) & 0x7F;
+  pContext->ListError = 0;
+  strcpy(acPath, sDir);
+  pContext->sListPath = acPath;
+  pContext->sListDir  = acPath;                 // Extended in place for the subdirectories
+  _ForEachDirEntry(pContext, acPath, IP_FS_DIR_ENTRY_STAT, _cbList);
+  if (pContext->ListError == 0) {
+    _ForEachDirEntry(pContext, acPath, IP_FS_DIR_ENTRY_TREE, _cbListTree);
+  }
+  pContext->sListPath = NULL;
+  r = _Flush(&pContext->DataOut);
+  if (pContext->ListError) {
+    r = -1;
+  }
+  return (r < 0) ? -1 : 0;
+}
+
+/*********************************************************************
+*
+*       _ExecLIST
+*
+*  Function description
+*    Execute LIST command: List
+*
+*  Add. information
+*    RFC 959 says:
+*         LIST (LIST)
+*
+*           This command causes a list to be sent from the server to the
+*           passive DTP.  If the pathname specifies a directory or other
+*           group of files, the server should transfer a list of files
+*           in the specified directory.  If the pathname specifies a
+*           file then the server should send current information on the
+*           file.  A null argument implies the user's current working or
+*           default directory.
+*
+*    "LIST -R" lists the whole subtree, so mirroring clients do not need
+*    a round trip per directory.
+*/
+static int _ExecLIST(FTPS_CONTEXT * pContext) {
+  char acDir[FTPS_MAX_PATH];
+  LIST_FILTER Filter;
+  int Recursive;
+  int r;
+
+  r = _GetListArg(pContext, acDir, &Filter, &Recursive);
+  if (r < 0) {
+    _Disconnect(pContext);
+    return 0;
+  }
+  if (_StartDataTransfer(pContext)) {
+    return 0;
+  }
+  pContext->pListFilter = r ? &Filter : NULL;
+  if (Recursive) {
+    r = _SendDirTree(pContext, acDir);
+  } else if (pContext->pListFilter && Filter.IsLiteral) {
+    r = _SendDirList(pContext, acDir, 'L', 0, _cbList);   // Single file, metadata of the other entries is not needed
+  } else {
+    r = _SendDirList(pContext, acDir, 'L', IP_FS_DIR_ENTRY_STAT, _cbList);
+  }
+  pContext->pListFilter = NULL;
+  if (r == -1) {
+    SEND_REPLY(&pContext->CtrlOut, "426 Connection closed; transfer aborted.\r\n");
+  } else {
+    SEND_REPLY(&pContext->CtrlOut, "226 Closing data connection. Requested file action successful.\r\n");
+  }
+  _Disconnect(pContext);
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _ExecMDTM
+*
+*  Function description
+*    Execute MDTM command: Modification time
+*
+*  Add. information
+*    RFC 3659 says:
+*         The FTP command, MODIFICATION TIME (MDTM), can be used to
+*         determine when a file in the server NVFS was last modified.
+*
+*    The time is requested from the file system without opening the
+*    file, the command is not available if the file system can not do so.
+*/
+static int _ExecMDTM(FTPS_CONTEXT * pContext) {
+  char acFilename[FTPS_MAX_PATH];
+  const char * sFilename;
+  IP_FS_FILE_STAT Stat;
+  char ac[16];
+  char * s;
+
+  if (pContext->pFS_API->pfGetFileStat == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "502 Command not implemented.\r\n");
+    return 0;
+  }
+  sFilename = _GetPathArg(pContext, acFilename);
+  if (sFilename == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Filename too long.\r\n");
+    return 1;
+  }
+  if ((pContext->pFS_API->pfGetFileStat(sFilename, &Stat) < 0) || (Stat.Attributes & IP_FS_ATTRIB_DIR) || (Stat.FileTime == 0)) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
+    return 0;
+  }
+  s = _StoreFactTime(&ac[0], Stat.FileTime);
+  *s = 0;
+  return _SendFTPString(&pContext->CtrlOut, 213, ac);
+}
+
+/*********************************************************************
+*
+*       _ExecMKD
+*
+*  Function description
+*    Execute MKD command: Make directory
+*
+*  Add. information
+*    RFC 959 says:
+*         MAKE DIRECTORY (MKD)
+*
+*           This command causes the directory specified in the pathname
+*           to be created as a directory (if the pathname is absolute)
+*           or as a subdirectory of the current working directory (if
+*           the pathname is relative).
+*/
+static int _ExecMKD(FTPS_CONTEXT * pContext) {
+  char acDirname[FTPS_MAX_PATH];
+  const char * sDirname;
+  int r;
+
+  sDirname = _GetPathArg(pContext, acDirname);
+  if (sDirname == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Dir name too long.\r\n");
+    return 1;
+  }
+  r = pContext->pFS_API->pfMKDir(sDirname);
+  if (r < 0) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
+  } else {
+    _InvalidateDirList(pContext, sDirname);
+    SEND_REPLY(&pContext->CtrlOut, "227 Directory successfully created.\r\n");
+  }
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _GetFactPerm
+*
+*  Function description
+*    Stores the "perm" fact of a directory entry (RFC 3659, 7.5.5).
+*    Files get the permissions of the directory they are located in,
+*    directories their own.
+*
+*  Parameters
+*    sPath     Full path of a directory entry with trailing slash, ignored for files.
+*    DirPerm   Permissions (IP_FTPS_PERM_...) of the directory the entry is located in.
+*
+*  Return value
+*     0    O.K.
+*    -1    Entry is not visible for the user
+*/
+static int _GetFactPerm(FTPS_CONTEXT * pContext, const char * sPath, int DirPerm, int IsDir, char * sPerm) {
+  int Perm;
+
+  if (IsDir) {
+    Perm = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, sPath, NULL, 0);
+    if ((Perm & IP_FTPS_PERM_VISIBLE) == 0) {
+      return -1;    // No permission to see this directory
+    }
+    if (DirPerm & IP_FTPS_PERM_WRITE) {
+      *sPerm++ = 'd';
+    }
+    if (Perm & IP_FTPS_PERM_READ) {
+      *sPerm++ = 'e';
+      *sPerm++ = 'l';
+    }
+    if (Perm & IP_FTPS_PERM_WRITE) {
+      *sPerm++ = 'c';
+      *sPerm++ = 'm';
+      *sPerm++ = 'p';
+    }
+  } else {
+    if (DirPerm & IP_FTPS_PERM_READ) {
+      *sPerm++ = 'r';
+    }
+    if (DirPerm & IP_FTPS_PERM_WRITE) {
+      *sPerm++ = 'd';
+      *sPerm++ = 'w';
+    }
+  }
+  *sPerm = 0;
+  return 0;
+}
+
+/*********************************************************************
+*
+*       _StoreFacts
+*
+*  Function description
+*    Stores the facts of a directory entry as defined by RFC 3659,
+*    for example "type=file;size=1234;modify=20240131235958;perm=rdw;".
+*    The time stamp is UTC with a resolution of 2 seconds.
+*/
+static char * _StoreFacts(FTPS_CONTEXT * pContext, char * p, void * pFileEntry, int IsDir, const char * sPerm) {
+  uint32_t SizeHigh;
+  uint32_t Size;
+  uint32_t FileTime;
+  int Len;
+
+  if (IsDir) {
+    memcpy(p, "type=dir;", 9);
+    p += 9;
+  } else {
+    memcpy(p, "type=file;size=", 15);
+    p += 15;
+    SizeHigh = 0;    // File systems limited to 4 GB may leave it untouched
+    Size     = pContext->pFS_API->pfGetDirEntryFileSize(pFileEntry, &SizeHigh);
+    p = _StoreDec64(p, SizeHigh, Size);
+    *p++ = ';';
+  }
+  FileTime = pContext->pFS_API->pfGetDirEntryFileTime(pFileEntry);
+  if (FileTime != 0) {
+    memcpy(p, "modify=", 7);
+    p += 7;
+    p = _StoreFactTime(p, FileTime);
+    *p++ = ';';
+  }
+  memcpy(p, "perm=", 5);
+  p += 5;
+  Len = strlen(sPerm);
+  memcpy(p, sPerm, Len);
+  p += Len;
+  *p++ = ';';
+  return p;
+}
+
+/*********************************************************************
+*
+*       _GetEntryPerm
+*
+*  Function description
+*    Checks the permissions of an entry of the directory being listed
+*    (pContext->sListDir) and stores its "perm" fact.
+*
+*  Return value
+*     0    O.K.
+*    -1    Entry is not visible for the user
+*/
+static int _GetEntryPerm(FTPS_CONTEXT * pContext, const char * sName, int IsDir, char * sPerm) {
+  char acPath[FTPS_MAX_PATH];
+  int DirPerm;
+  int LenDir;
+  int LenName;
+
+  LenDir  = strlen(pContext->sListDir);
+  LenName = strlen(sName);
+  if (LenDir + LenName + 2 > (int)sizeof(acPath)) {
+    return -1;      // Path of entry too long, it can not be accessed anyhow
+  }
+  memcpy(&acPath[0], pContext->sListDir, LenDir);
+  memcpy(&acPath[LenDir], sName, LenName);
+  acPath[LenDir + LenName]     = '/';
+  acPath[LenDir + LenName + 1] = 0;
+  DirPerm = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, pContext->sListDir, NULL, 0);
+  return _GetFactPerm(pContext, acPath, DirPerm, IsDir, sPerm);
+}
+
+/*********************************************************************
+*
+*       _cbMLSD
+*/
+static int _cbMLSD (void * pvoidContext, void * pFileEntry) {
+  char ac[LIST_NAME_SIZE];
+  char acPerm[8];
+  FTPS_CONTEXT * pContext;
+  int IsDir;
+  char * p;
+  int Len;
+  pContext = (FTPS_CONTEXT *)pvoidContext;
+
+  pContext->pFS_API->pfGetDirEntryFileName(pFileEntry, ac, sizeof(ac));
+  if ((strcmp(ac, ".") == 0) || (strcmp(ac, "..") == 0)) {
+    return 0;         // "cdir" and "pdir" entries are optional and not sent
+  }
   IsDir = pContext->pFS_API->pfGetDirEntryAttributes(pFileEntry);
-  if (IsDir) {
-    i = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, ac, NULL, 0);
-    if ((i & IP_FTPS_PERM_VISIBLE) == 0) {
-      return;    // No permission to see this directory
-    }
-    _WriteStringDataPort(pContext, "drw-r--r--   1 root ");
-  } else {
-    _WriteStringDataPort(pContext, "-rw-r--r--   1 root ");
+  if (_GetEntryPerm(pContext, ac, IsDir, acPerm)) {
+    return 0;
   }
-  FileLen = pContext->pFS_API->pfGetDirEntryFileSize(pFileEntry, &FileSize);
-  _WriteUnsignedDataPort(pContext, FileLen, 10, 0);
-  FileTime = pContext->pFS_API->pfGetDirEntryFileTime(pFileEntry);
-  if ((FileTime == 0x00210000) || (FileTime == 0x0)) {  // Check if timestamp of file correlates with the MSDOS file system initialization date/time (1980-01-01 00:00)
-    _WriteStringDataPort(pContext, " Jan  1  1980 ");
-  } else {
-    _WriteFileTimeDataPort(pContext, FileTime);
+  p = _ReserveOut(&pContext->DataOut, LIST_LINE_SIZE);
+  if (p == NULL) {
+    pContext->ListError = 1;
+    return 1;       // Data connection failed, stop listing
+  }
+  p = _StoreFacts(pContext, p, pFileEntry, IsDir, acPerm);
+  *p++ = ' ';
+  Len = strlen(ac);
+  memcpy(p, ac, Len);
+  p += Len;
+  *p++ = CR;
+  *p++ = LF;
+  if (_CommitOut(&pContext->DataOut, p) < 0) {
+    pContext->ListError = 1;
+    return 1;
   }
-  _WriteStringDataPort(pContext, &ac[0]);
-  _WriteDataPort(pContext, "\r\n", 2);
+  return 0;
 }
 
 /*********************************************************************
 *
-*       _ExecLIST
+*       _ExecMLSD
 *
 *  Function description
-*    Execute LIST command: List
+*    Execute MLSD command: Machine readable directory listing
 *
 *  Add. information
-*    RFC 959 says:
-*         LIST (LIST)
-*
-*           This command causes a list to be sent from the server to the
-*           passive DTP.  If the pathname specifies a directory or other
-*           group of files, the server should transfer a list of files
-*           in the specified directory.  If the pathname specifies a
-*           file then the server should send current information on the
-*           file.  A null argument implies the user's current working or
-*           default directory.
+*    RFC 3659 says:
+*         The MLSD command is intended to standardize the file and
+*         directory information returned by the server-FTP process.  This
+*         command differs from the LIST command in that the format of the
+*         replies is strictly defined although extensible.
+*
+*         MLSD lists the contents of a directory if a directory is named,
+*         otherwise a 501 reply is returned.  If no object is named, the
+*         current directory is assumed.
 */
-static int _ExecLIST(FTPS_CONTEXT * pContext) {
+static int _ExecMLSD(FTPS_CONTEXT * pContext) {
+  char acDir[FTPS_MAX_PATH];
+  LIST_FILTER Filter;
   int r;
 
-  _EatLine(&pContext->InBufferDesc);
-  _SendFTPString(&pContext->CtrlOut, 150, "File status okay; about to open data connection.");
-  pContext->pFS_API->pfForEachDirEntry (pContext, pContext->acCurDir, _cbList);
-  r = _Flush(&pContext->DataOut);
+  r = _GetListArg(pContext, acDir, &Filter, NULL);
+  if (r > 0) {
+    SEND_REPLY(&pContext->CtrlOut, "501 Not a directory.\r\n");
+  }
+  if (r != 0) {
+    _Disconnect(pContext);
+    return 0;
+  }
+  if (_StartDataTransfer(pContext)) {
+    return 0;
+  }
+  r = _SendDirList(pContext, acDir, 'M', IP_FS_DIR_ENTRY_STAT, _cbMLSD);
   if (r == -1) {
-    _SendFTPString(&pContext->CtrlOut, 426, "Connection closed; transfer aborted.");
+    SEND_REPLY(&pContext->CtrlOut, "426 Connection closed; transfer aborted.\r\n");
   } else {
-    _SendFTPString(&pContext->CtrlOut, 226, "Closing data connection. Requested file action successful.");
+    SEND_REPLY(&pContext->CtrlOut, "226 Closing data connection. Requested file action successful.\r\n");
   }
   _Disconnect(pContext);
   return 0;
@@ -1530,61 +2707,159 @@ static int _ExecLIST(FTPS_CONTEXT * pContext) {
 
 /*********************************************************************
 *
-*       _ExecMKD
+*       _cbMLST
 *
 *  Function description
-*    Execute MKD command: Make directory
+*    Reports the entry named pContext->sListName on the control
+*    connection. pContext->sListName is cleared once it has been found.
+*/
+static int _cbMLST (void * pvoidContext, void * pFileEntry) {
+  char ac[LIST_NAME_SIZE];
+  char acPerm[8];
+  FTPS_CONTEXT * pContext;
+  int IsDir;
+  char * p;
+  pContext = (FTPS_CONTEXT *)pvoidContext;
+  pContext->pFS_API->pfGetDirEntryFileName(pFileEntry, ac, sizeof(ac));
+  if (strcmp(ac, pContext->sListName) != 0) {
+    return 0;
+  }
+  IsDir = pContext->pFS_API->pfGetDirEntryAttributes(pFileEntry);
+  if (_GetEntryPerm(pContext, ac, IsDir, acPerm)) {
+    return 1;       // Names are unique, no need to look further
+  }
+  pContext->sListName = NULL;
+  _WriteString(&pContext->CtrlOut, "250-Listing ");
+  _WriteString(&pContext->CtrlOut, pContext->sListDir);
+  _WriteString(&pContext->CtrlOut, ac);
+  _WriteString(&pContext->CtrlOut, "\r\n ");
+  p = _ReserveOut(&pContext->CtrlOut, LIST_LINE_SIZE);
+  if (p == NULL) {
+    return 1;
+  }
+  p = _StoreFacts(pContext, p, pFileEntry, IsDir, acPerm);
+  _CommitOut(&pContext->CtrlOut, p);
+  _WriteChar(&pContext->CtrlOut, ' ');
+  _WriteString(&pContext->CtrlOut, pContext->sListDir);
+  _WriteString(&pContext->CtrlOut, ac);
+  _WriteString(&pContext->CtrlOut, "\r\n");
+  return 1;
+}
+
+/*********************************************************************
 *
-*  Add. information
-*    RFC 959 says:
-*         MAKE DIRECTORY (MKD)
+*       _ExecMLST
 *
-*           This command causes the directory specified in the pathname
-*           to be created as a directory (if the pathname is absolute)
-*           or as a subdirectory of the current working directory (if
-*           the pathname is relative).
+*  Function description
+*    Execute MLST command: Machine readable facts of a single entry
+*
+*  Add. information
+*    RFC 3659 says:
+*         The MLST command is intended to provide data about exactly the
+*         object named in its pathname argument, and no others.  If the
+*         pathname argument is omitted, the current directory is assumed.
+*         The data is returned on the control connection.
+*
+*    The entry is looked up by listing the directory it is located in,
+*    so no file system function beyond the directory query is required.
 */
-static int _ExecMKD(FTPS_CONTEXT * pContext) {
-  char acDirname[64];
-  int r;
+static int _ExecMLST(FTPS_CONTEXT * pContext) {
+  char acPath[FTPS_MAX_PATH];
+  char acDir[FTPS_MAX_PATH];
+  char acPerm[8];
+  const char * sPath;
+  char * sName;
+  int Perm;
+  int Len;
 
-  _EatWhite(&pContext->InBufferDesc);
-  _GetLine(&pContext->InBufferDesc, &acDirname[0], sizeof(acDirname));
-  _EatLine(&pContext->InBufferDesc);
-  if (_GenerateAbsFilename(pContext, &acDirname[0], sizeof(acDirname))) {
-    _SendFTPString(&pContext->CtrlOut, 550, "Dir name too long.");
+  sPath = _GetPathArg(pContext, acPath);     // No argument: current directory
+  if (sPath == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Filename too long.\r\n");
     return 1;
   }
-  r = pContext->pFS_API->pfMKDir(acDirname);
-  if (r < 0) {
-    _SendFTPString(&pContext->CtrlOut, 550, "Requested action not taken.");
-  } else {
-    _SendFTPString(&pContext->CtrlOut, 227, "Directory successfully created.");
+  Len = strlen(sPath);
+  if (sPath != acPath) {
+    memcpy(acPath, sPath, Len + 1);
   }
-  return 0;
+  if ((Len > 1) && (acPath[Len - 1] == '/')) {
+    acPath[--Len] = 0;        // "/Dir/" -> "/Dir"
+  }
+  if (Len <= 1) {
+    //
+    // Root directory, it is not located in any directory.
+    //
+    _GetFactPerm(pContext, "/", 0, 1, acPerm);
+    _WriteString(&pContext->CtrlOut, "250-Listing /\r\n type=dir;perm=");
+    _WriteString(&pContext->CtrlOut, acPerm);
+    _WriteString(&pContext->CtrlOut, "; /\r\n");
+    return SEND_REPLY(&pContext->CtrlOut, "250 End\r\n");
+  }
+  //
+  // Split the path into directory (with trailing slash) and name.
+  //
+  sName = strrchr(acPath, '/') + 1;
+  Len   = sName - acPath;
+  memcpy(acDir, acPath, Len);
+  acDir[Len] = 0;
+  Perm = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, acDir, NULL, 0);
+  if ((Perm & IP_FTPS_PERM_READ) == 0) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
+    return 0;
+  }
+  pContext->sListDir  = acDir;
+  pContext->sListName = sName;
+  _ForEachDirEntry(pContext, acDir, 0, _cbMLST);
+  if (pContext->sListName != NULL) {
+    pContext->sListName = NULL;
+    SEND_REPLY(&pContext->CtrlOut, "550 File not found.\r\n");
+    return 0;
+  }
+  return SEND_REPLY(&pContext->CtrlOut, "250 End\r\n");
 }
 
 /*********************************************************************
 *
 *       _cbNLST
+*
+*  Function description
+*    Stores the name of the entry directly in the output buffer.
 */
-static void _cbNLST (void * pvoidContext, void * pFileEntry) {
-  char ac[64];
+static int _cbNLST (void * pvoidContext, void * pFileEntry) {
   FTPS_CONTEXT * pContext;
   uint32_t IsDir;
+  char * p;
+  int Len;
   int i;
   pContext = (FTPS_CONTEXT *)pvoidContext;
 
-  pContext->pFS_API->pfGetDirEntryFileName(pFileEntry, ac, sizeof(ac));
+  p = _ReserveOut(&pContext->DataOut, LIST_NAME_SIZE + 2);
+  if (p == NULL) {
+    pContext->ListError = 1;
+    return 1;       // Data connection failed, stop listing
+  }
+  pContext->pFS_API->pfGetDirEntryFileName(pFileEntry, p, LIST_NAME_SIZE);
+  if (pContext->pListFilter && (_MatchFilter(pContext->pListFilter, p) == 0)) {
+    return 0;
+  }
   IsDir = pContext->pFS_API->pfGetDirEntryAttributes(pFileEntry);
   if (IsDir) {
-    i = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, ac, NULL, 0);
+    i = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, p, NULL, 0);
     if ((i & IP_FTPS_PERM_VISIBLE) == 0) {
-      return;    // No permission to see this directory
+      return 0;    // No permission to see this directory
     }
   }
-  _WriteStringDataPort(pContext, &ac[0]);
-  _WriteDataPort(pContext, "\r\n", 2);
+  Len = strlen(p);
+  p += Len;
+  *p++ = CR;
+  *p++ = LF;
+  if (_CommitOut(&pContext->DataOut, p) < 0) {
+    pContext->ListError = 1;
+    return 1;
+  }
+  if (pContext->pListFilter && pContext->pListFilter->IsLiteral) {
+    return 1;       // The only entry of the name has been listed
+  }
+  return 0;
 }
 
 /*********************************************************************
@@ -1606,21 +2881,41 @@ static void _cbNLST (void * pvoidContext, void * pFileEntry) {
 *            information.
 */
 static int _ExecNLST(FTPS_CONTEXT * pContext) {
+  char acDir[FTPS_MAX_PATH];
+  LIST_FILTER Filter;
   int r;
 
-  _EatLine(&pContext->InBufferDesc);
-  _SendFTPString(&pContext->CtrlOut, 150, "File status okay; about to open data connection.");
-  pContext->pFS_API->pfForEachDirEntry (pContext, pContext->acCurDir, _cbNLST);
-  r = _Flush(&pContext->DataOut);
+  r = _GetListArg(pContext, acDir, &Filter, NULL);
+  if (r < 0) {
+    _Disconnect(pContext);
+    return 0;
+  }
+  if (_StartDataTransfer(pContext)) {
+    return 0;
+  }
+  pContext->pListFilter = r ? &Filter : NULL;
+  r = _SendDirList(pContext, acDir, 'N', 0, _cbNLST);
+  pContext->pListFilter = NULL;
   if (r == -1) {
-    _SendFTPString(&pContext->CtrlOut, 426, "Connection closed; transfer aborted.");
+    SEND_REPLY(&pContext->CtrlOut, "426 Connection closed; transfer aborted.\r\n");
   } else {
-    _SendFTPString(&pContext->CtrlOut, 226, "Closing data connection. Requested file action successful.");
+    SEND_REPLY(&pContext->CtrlOut, "226 Closing data connection. Requested file action successful.\r\n");
   }
   _Disconnect(pContext);
   return 0;
 }
 
+/*********************************************************************
+*
+*       _ExecNOOP
+*
+*  Function description
+*    Execute NOOP command: No operation
+*/
+static int _ExecNOOP(FTPS_CONTEXT * pContext) {
+  return SEND_REPLY(&pContext->CtrlOut, "200 Command okay.\r\n");
+}
+
 /*********************************************************************
 *
 *       _ExecPASS
@@ -1649,25 +2944,24 @@ static int _ExecNLST(FTPS_CONTEXT * pContext) {
 */
 static int _ExecPASS(FTPS_CONTEXT * pContext) {
   FTPS_ACCESS_CONTROL * pAccess;
-  char acPass[32] = {0};
+  char * sPass;
   int r;
 
   if (pContext->UserId == 0) {
-    _SendFTPString(&pContext->CtrlOut, 530, "Login incorrect.");
+    SEND_REPLY(&pContext->CtrlOut, "530 Login incorrect.\r\n");
   }
   if (pContext->UserId > 0) {
-    _SendFTPString(&pContext->CtrlOut, 230, "User logged in, proceed.");
+    SEND_REPLY(&pContext->CtrlOut, "230 User logged in, proceed.\r\n");
     return 0;
   } else {
     pAccess = pContext->pApplication->pAccess;
-    _GetLine(&pContext->InBufferDesc, acPass, sizeof(acPass));
-    _EatLine(&pContext->InBufferDesc);
-    r = pAccess->pfCheckPass(-pContext->UserId, acPass);
+    _GetArg(&pContext->InBufferDesc, &sPass);
+    r = pAccess->pfCheckPass(-pContext->UserId, sPass);
     if (r == 0) {
-      _SendFTPString(&pContext->CtrlOut, 230, "User logged in, proceed.");
+      SEND_REPLY(&pContext->CtrlOut, "230 User logged in, proceed.\r\n");
       pContext->UserId = -pContext->UserId;
     } else {
-      _SendFTPString(&pContext->CtrlOut, 530, "Login incorrect.");
+      SEND_REPLY(&pContext->CtrlOut, "530 Login incorrect.\r\n");
     }
     return r;
   }
@@ -1699,17 +2993,15 @@ static int _ExecPASV(FTPS_CONTEXT * pContext) {
   uint16_t Port;
   uint8_t acIPAddr[4];
   int i;
-  int r;
 
   pOutContext = &pContext->CtrlOut;
-  _EatLine(&pContext->InBufferDesc);
   _Disconnect(pContext);
   //
   // Create data socket and connect to "Port"
   //
   pContext->DataOut.Sock = pContext->DataOut.pIP_API->pfListen(pContext->CtrlOut.Sock, &Port, &acIPAddr[0]);
   if (pContext->DataOut.Sock == NULL) {
-    _SendFTPString(&pContext->CtrlOut, 530, "Could not create socket!");
+    SEND_REPLY(&pContext->CtrlOut, "530 Could not create socket!\r\n");
     return 1;
   }
   //
@@ -1724,14 +3016,10 @@ static int _ExecPASV(FTPS_CONTEXT * pContext) {
   _WriteChar    (pOutContext, ',');
   _WriteUnsigned(pOutContext, Port & 255, 10, 0);
   _WriteString  (pOutContext, ")\r\n" );
-  _Flush(pOutContext);
   //
-  // Wait for client to connect on data port
+  // The connection from the client is accepted by the next transfer command
   //
-  r = pContext->DataOut.pIP_API->pfAccept(pContext->CtrlOut.Sock, &pContext->DataOut.Sock);
-  if (r == 0) {
-    return 1;
-  }
+  pContext->DataState = DATA_STATE_LISTEN;
   return 0;
 }
 
@@ -1790,16 +3078,22 @@ static int _ExecPORT(FTPS_CONTEXT * pContext) {
     return -1;            // Error
   }
   Port += _GetDec(&pContext->InBufferDesc);
-  _EatLine(&pContext->InBufferDesc);
+  _Disconnect(pContext);
   //
-  // Create data socket and connect to "Port"
+  // Create data socket and connect to "Port". With a non-blocking connect
+  // the handshake runs while the client sends the transfer command.
   //
   pContext->DataOut.Sock = pContext->CtrlOut.pIP_API->pfConnect(pContext->CtrlOut.Sock, Port);
   if (pContext->DataOut.Sock == NULL) {
-    _SendFTPString(&pContext->CtrlOut, 530, "Could not create socket!");
+    SEND_REPLY(&pContext->CtrlOut, "530 Could not create socket!\r\n");
     return 1;
   }
-  _SendFTPString(&pContext->CtrlOut, 200, "Command okay.");
+  if (pContext->CtrlOut.pIP_API->pfConnectWait != NULL) {
+    pContext->DataState = DATA_STATE_CONNECTING;
+  } else {
+    pContext->DataState = DATA_STATE_CONNECTED;
+  }
+  SEND_REPLY(&pContext->CtrlOut, "200 Command okay.\r\n");
   return 0;
 }
 
@@ -1821,7 +3115,6 @@ static int _ExecPWD(FTPS_CONTEXT * pContext) {
   _WriteString(&pContext->CtrlOut, "257 \"");
   _WriteString(&pContext->CtrlOut, pContext->acCurDir);
   _WriteString(&pContext->CtrlOut, "\" is current directory\r\n");
-  _Flush(&pContext->CtrlOut);
   return 0;
 }
 
@@ -1846,41 +3139,32 @@ static int _ExecPWD(FTPS_CONTEXT * pContext) {
 *            contents of the file at the server site shall be unaffected.
 */
 static int _ExecRETR(FTPS_CONTEXT * pContext) {
-  char acFilename[64];
+  char acFilename[FTPS_MAX_PATH];
+  const char * sFilename;
   void * hFile;
-  int LenFileName;
-  int i;
   int r;
 
-  _EatWhite(&pContext->InBufferDesc);
-  _GetLine(&pContext->InBufferDesc, &acFilename[0], sizeof(acFilename));
-  _EatLine(&pContext->InBufferDesc);
-  if (acFilename[0] != '/') {            // Relative file name ?
-    //
-    // Add current directory to file name
-    //
-    i = strlen(pContext->acCurDir);
-    LenFileName = strlen(acFilename);
-    if (LenFileName + i >= sizeof(acFilename)) {
-      _SendFTPString(&pContext->CtrlOut, 550, "Filename size too long");
-      _Disconnect(pContext);
-      return 1;
-    }
-    memmove(&acFilename[i], &acFilename[0], LenFileName + 1);
-    memcpy(&acFilename[0], pContext->acCurDir, i);
+  sFilename = _GetPathArg(pContext, acFilename);
+  if (sFilename == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Filename size too long\r\n");
+    _Disconnect(pContext);
+    return 1;
   }
-  hFile = _OpenFile(pContext, &acFilename[0]);
+  hFile = _OpenFile(pContext, sFilename);
   if (hFile) {
-    _SendFTPString(&pContext->CtrlOut, 150, "File status okay; about to open data connection.");
+    if (_StartDataTransfer(pContext)) {
+      _CloseFile(pContext, hFile);
+      return 0;
+    }
     r = _SendFile(pContext, hFile);
     if (r == -1) {
-      _SendFTPString(&pContext->CtrlOut, 426, "Connection closed; transfer aborted.");
+      SEND_REPLY(&pContext->CtrlOut, "426 Connection closed; transfer aborted.\r\n");
     } else {
-      _SendFTPString(&pContext->CtrlOut, 226, "Closing data connection. Requested file action successful.");
+      SEND_REPLY(&pContext->CtrlOut, "226 Closing data connection. Requested file action successful.\r\n");
     }
     _CloseFile(pContext, hFile);
   } else {
-    _SendFTPString(&pContext->CtrlOut, 550, "Requested action not taken.");
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
   }
   _Disconnect(pContext);
   return 0;
@@ -1907,7 +3191,8 @@ static int _ExecRETR(FTPS_CONTEXT * pContext) {
 *           the pathname is relative).
 */
 static int _ExecRMD(FTPS_CONTEXT * pContext) {
-  char acDirname[64];
+  char acDirname[FTPS_MAX_PATH];
+  const char * sDirname;
   int r;
 
   //
@@ -1915,21 +3200,20 @@ static int _ExecRMD(FTPS_CONTEXT * pContext) {
   //
   r = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, pContext->acCurDir, NULL, 0);
   if ((r & IP_FTPS_PERM_WRITE) == 0) {
-    _SendFTPString(&pContext->CtrlOut, 553, "Requested action not taken - Not allowed.");
+    SEND_REPLY(&pContext->CtrlOut, "553 Requested action not taken - Not allowed.\r\n");
     return 0;   // No write permission for this directory
   }
-  _EatWhite(&pContext->InBufferDesc);
-  _GetLine(&pContext->InBufferDesc, &acDirname[0], sizeof(acDirname));
-  _EatLine(&pContext->InBufferDesc);
-  if (_GenerateAbsFilename(pContext, &acDirname[0], sizeof(acDirname))) {
-    _SendFTPString(&pContext->CtrlOut, 550, "Dir name too long.");
+  sDirname = _GetPathArg(pContext, acDirname);
+  if (sDirname == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Dir name too long.\r\n");
     return 1;
   }
-  r = pContext->pFS_API->pfRMDir(acDirname);
+  r = pContext->pFS_API->pfRMDir(sDirname);
   if (r < 0) {
-    _SendFTPString(&pContext->CtrlOut, 550, "Requested action not taken.");
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
   } else {
-    _SendFTPString(&pContext->CtrlOut, 250, "Directory successfully removed.");
+    _InvalidateDirList(pContext, sDirname);
+    SEND_REPLY(&pContext->CtrlOut, "250 Directory successfully removed.\r\n");
   }
   return 0;
 }
@@ -1946,20 +3230,33 @@ static int _ExecRMD(FTPS_CONTEXT * pContext) {
 *  != 0    Error
 */
 static int _ExecSIZE(FTPS_CONTEXT * pContext) {
-  char acFilename[64];
+  char acFilename[FTPS_MAX_PATH];
+  const char * sFilename;
+  IP_FS_FILE_STAT Stat;
   void * hFile;
   int FileSize;
-  char ac[12];
+  char ac[24];
   char * s;
 
-  _EatWhite(&pContext->InBufferDesc);
-  _GetLine(&pContext->InBufferDesc, &acFilename[0], sizeof(acFilename));
-  _EatLine(&pContext->InBufferDesc);
-  if (_GenerateAbsFilename(pContext, &acFilename[0], sizeof(acFilename))) {
-    _SendFTPString(&pContext->CtrlOut, 550, "Filename too long.");
+  sFilename = _GetPathArg(pContext, acFilename);
+  if (sFilename == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "550 Filename too long.\r\n");
     return 1;
   }
-  hFile = _OpenFile(pContext, &acFilename[0]);
+  //
+  // Answer from the metadata of the file system if it provides them, without opening the file.
+  //
+  if (pContext->pFS_API->pfGetFileStat != NULL) {
+    Stat.FileSizeHigh = 0;    // File systems limited to 4 GB may leave it untouched
+    if ((pContext->pFS_API->pfGetFileStat(sFilename, &Stat) < 0) || (Stat.Attributes & IP_FS_ATTRIB_DIR)) {
+      SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
+      return 0;
+    }
+    s = _StoreDec64(&ac[0], Stat.FileSizeHigh, Stat.FileSize);
+    *s = 0;
+    return _SendFTPString(&pContext->CtrlOut, 213, ac);
+  }
+  hFile = _OpenFile(pContext, sFilename);
   if (hFile) {
     FileSize = pContext->pFS_API->pfGetLen(hFile);
     s = _StoreUnsigned(&ac[0], FileSize, 10, 0);
@@ -1967,7 +3264,7 @@ static int _ExecSIZE(FTPS_CONTEXT * pContext) {
     _SendFTPString(&pContext->CtrlOut, 213, ac);
     _CloseFile(pContext, hFile);
   } else {
-    _SendFTPString(&pContext->CtrlOut, 550, "Requested action not taken.");
+    SEND_REPLY(&pContext->CtrlOut, "550 Requested action not taken.\r\n");
   }
   return 0;
 }
@@ -1998,6 +3295,7 @@ static int _ExecSIZE(FTPS_CONTEXT * pContext) {
 static int _ExecSTOR(FTPS_CONTEXT * pContext) {
   void * hFile;
   char acFileName[FTPS_MAX_PATH];
+  const char * sFileName;
   int i;
   int r;
 
@@ -2006,34 +3304,47 @@ static int _ExecSTOR(FTPS_CONTEXT * pContext) {
   //
   i = pContext->pApplication->pAccess->pfGetDirInfo(pContext->UserId, pContext->acCurDir, NULL, 0);
   if ((i & IP_FTPS_PERM_WRITE) == 0) {
-    _EatLine(&pContext->InBufferDesc);
-    _SendFTPString(&pContext->CtrlOut, 553, "Requested action not taken - Not allowed.");
+    SEND_REPLY(&pContext->CtrlOut, "553 Requested action not taken - Not allowed.\r\n");
     return 1;   // No write permission for this directory
   }
-  _EatWhite(&pContext->InBufferDesc);
-  _GetLine(&pContext->InBufferDesc, &acFileName[0], sizeof(acFileName));
-  _EatLine(&pContext->InBufferDesc);
-  if (_GenerateAbsFilename(pContext, &acFileName[0], sizeof(acFileName))) {
-    _SendFTPString(&pContext->CtrlOut, 552, "Requested file action aborted.");
+  sFileName = _GetPathArg(pContext, acFileName);
+  if (sFileName == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "552 Requested file action aborted.\r\n");
     return 1;
   }
-  hFile = pContext->pFS_API->pfCreate(&acFileName[0]);
+  hFile = pContext->pFS_API->pfCreate(sFileName);
   if (hFile == NULL) {
-    _SendFTPString(&pContext->CtrlOut, 426, "Connection closed; transfer aborted.");
+    SEND_REPLY(&pContext->CtrlOut, "426 Connection closed; transfer aborted.\r\n");
   } else {
-    _SendFTPString(&pContext->CtrlOut, 150, "File status okay; about to open data connection.");
+    _InvalidateDirList(pContext, sFileName);     // File has been created
+    if (_StartDataTransfer(pContext)) {
+      pContext->pFS_API->pfCloseFile(hFile);
+      return 0;
+    }
     r = _ReceiveFile(pContext, hFile);
+    pContext->pFS_API->pfCloseFile(hFile);
+    _InvalidateDirList(pContext, sFileName);     // Size and time have changed
     if (r == 0) {
-      _SendFTPString(&pContext->CtrlOut, 226, "Closing data connection. Requested file action successful.");
+      SEND_REPLY(&pContext->CtrlOut, "226 Closing data connection. Requested file action successful.\r\n");
     } else {
-      _SendFTPString(&pContext->CtrlOut, 426, "Connection closed; transfer aborted.");
+      SEND_REPLY(&pContext->CtrlOut, "426 Connection closed; transfer aborted.\r\n");
     }
-    pContext->pFS_API->pfCloseFile(hFile);
   }
   _Disconnect(pContext);
   return 0;
 }
 
+/*********************************************************************
+*
+*       _ExecSYST
+*
+*  Function description
+*    Execute SYST command: System type
+*/
+static int _ExecSYST(FTPS_CONTEXT * pContext) {
+  return SEND_REPLY(&pContext->CtrlOut, "215 UNIX Type: L8\r\n");
+}
+
 /*********************************************************************
 *
 *       _ExecType
@@ -2065,29 +3376,26 @@ static int _ExecTYPE(FTPS_CONTEXT * pContext) {
   c = _GetChar(&pContext->InBufferDesc);
   c = tolower(c);
   if (c == 'i') {
-    _EatLine(&pContext->InBufferDesc);
-    _SendFTPString(&pContext->CtrlOut, 200, "Command okay.");
+    SEND_REPLY(&pContext->CtrlOut, "200 Command okay.\r\n");
   } else if (c == 'a') {
     _EatWhite(&pContext->InBufferDesc);
     i = _GetLineLen(&pContext->InBufferDesc);
     if (i > 2) {
       c = _GetChar(&pContext->InBufferDesc);
       c = tolower(c);
-      _EatLine(&pContext->InBufferDesc);
       switch (c) {
         case 'n':
-          _SendFTPString(&pContext->CtrlOut, 200, "Command okay.");
+          SEND_REPLY(&pContext->CtrlOut, "200 Command okay.\r\n");
           break;
         case 't':
-          _SendFTPString(&pContext->CtrlOut, 200, "Command okay.");
+          SEND_REPLY(&pContext->CtrlOut, "200 Command okay.\r\n");
           break;
         case 'c':
-          _SendFTPString(&pContext->CtrlOut, 200, "Command okay.");
+          SEND_REPLY(&pContext->CtrlOut, "200 Command okay.\r\n");
           break;
       }
     } else {
-      _EatLine(&pContext->InBufferDesc);
-      _SendFTPString(&pContext->CtrlOut, 200, "Command okay.");
+      SEND_REPLY(&pContext->CtrlOut, "200 Command okay.\r\n");
     }
   }
   return 0;
@@ -2133,128 +3441,219 @@ static int _ExecTYPE(FTPS_CONTEXT * pContext) {
 */
 static int _ExecUSER(FTPS_CONTEXT * pContext) {
   FTPS_ACCESS_CONTROL * pAccess;
-  char acUser[32] = {0};
+  char * sUser;
 
   pAccess = pContext->pApplication->pAccess;
-  _GetLine(&pContext->InBufferDesc, acUser, sizeof(acUser));
-  _EatLine(&pContext->InBufferDesc);
-  pContext->UserId = pAccess->pfFindUser(acUser);
-  _SendFTPString(&pContext->CtrlOut, 331, "Password required.");
-  return pContext->UserId;
+  _GetArg(&pContext->InBufferDesc, &sUser);
+  pContext->UserId = pAccess->pfFindUser(sUser);
+  SEND_REPLY(&pContext->CtrlOut, "331 Password required.\r\n");
+  return 0;
 }
 
 
+/*********************************************************************
+*
+*       _aCmd
+*
+*  Sorted by Key for _FindCmd().
+*/
+static const CMD_DESC _aCmd[] = {
+  { CMD_KEY('C', 'D', 'U', 'P'), CMD_FLAG_LOGIN,                                 _ExecCDUP },
+  { CMD_KEY('C', 'W', 'D',  0 ), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecCWD  },
+  { CMD_KEY('D', 'E', 'L', 'E'), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecDELE },
+  { CMD_KEY('F', 'E', 'A', 'T'), 0,                                              _ExecFEAT },
+  { CMD_KEY('L', 'I', 'S', 'T'), CMD_FLAG_LOGIN | CMD_FLAG_DATA,                 _ExecLIST },
+  { CMD_KEY('M', 'D', 'T', 'M'), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecMDTM },
+  { CMD_KEY('M', 'K', 'D',  0 ), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecMKD  },
+  { CMD_KEY('M', 'L', 'S', 'D'), CMD_FLAG_LOGIN | CMD_FLAG_DATA,                 _ExecMLSD },
+  { CMD_KEY('M', 'L', 'S', 'T'), CMD_FLAG_LOGIN,                                 _ExecMLST },
+  { CMD_KEY('N', 'L', 'S', 'T'), CMD_FLAG_LOGIN | CMD_FLAG_DATA,                 _ExecNLST },
+  { CMD_KEY('N', 'O', 'O', 'P'), 0,                                              _ExecNOOP },
+  { CMD_KEY('P', 'A', 'S', 'S'), 0,                                              _ExecPASS },
+  { CMD_KEY('P', 'A', 'S', 'V'), CMD_FLAG_LOGIN,                                 _ExecPASV },
+  { CMD_KEY('P', 'O', 'R', 'T'), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecPORT },
+  { CMD_KEY('P', 'W', 'D',  0 ), CMD_FLAG_LOGIN,                                 _ExecPWD  },
+  { CMD_KEY('R', 'E', 'T', 'R'), CMD_FLAG_LOGIN | CMD_FLAG_ARG | CMD_FLAG_DATA,  _ExecRETR },
+  { CMD_KEY('R', 'M', 'D',  0 ), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecRMD  },
+  { CMD_KEY('S', 'I', 'Z', 'E'), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecSIZE },
+  { CMD_KEY('S', 'T', 'O', 'R'), CMD_FLAG_LOGIN | CMD_FLAG_ARG | CMD_FLAG_DATA,  _ExecSTOR },
+  { CMD_KEY('S', 'Y', 'S', 'T'), 0,                                              _ExecSYST },
+  { CMD_KEY('T', 'Y', 'P', 'E'), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecTYPE },
+  { CMD_KEY('U', 'S', 'E', 'R'), CMD_FLAG_ARG,                                   _ExecUSER },
+  //
+  // DIRECTORY ORIENTED FTP COMMANDS (Added for compatibility)
+  // Refer to [RFC775] - http://tools.ietf.org/html/rfc775
+  //
+  { CMD_KEY('X', 'C', 'U', 'P'), CMD_FLAG_LOGIN,                                 _ExecCDUP },
+  { CMD_KEY('X', 'M', 'K', 'D'), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecMKD  },
+  { CMD_KEY('X', 'P', 'W', 'D'), CMD_FLAG_LOGIN,                                 _ExecPWD  },
+  { CMD_KEY('X', 'R', 'M', 'D'), CMD_FLAG_LOGIN | CMD_FLAG_ARG,                  _ExecRMD  }
+};
+
+/*********************************************************************
+*
+*       _FindCmd
+*
+*  Function description
+*    Looks up a command by the key of its verb. A binary search takes
+*    at most 5 comparisons for the commands of _aCmd and, unlike a
+*    perfect hash, needs no tuning when commands are added.
+*
+*  Return value
+*    != NULL   Command
+*    == NULL   Unknown command
+*/
+static const CMD_DESC * _FindCmd(uint32_t Key) {
+  unsigned Lo;
+  unsigned Hi;
+  unsigned i;
+
+  Lo = 0;
+  Hi = _COUNTOF(_aCmd);
+  while (Lo < Hi) {
+    i = (Lo + Hi) >> 1;
+    if (_aCmd[i].Key == Key) {
+      return &_aCmd[i];
+    }
+    if (_aCmd[i].Key < Key) {
+      Lo = i + 1;
+    } else {
+      Hi = i;
+    }
+  }
+  return NULL;
+}
+
 /*********************************************************************
 *
 *       _ParseInput
 *
 *  Function description
+*    Executes the command line at the start of the input buffer. The
+*    requirements of the command (CMD_FLAG_...) are checked before it
+*    is called. The line is removed from the buffer completely, no
+*    matter how much of it the command has read.
+*
+*  Return value
+*    0    O.K.
+*    1    Command failed or rejected
+*   -1    Error, close connection
 */
 static int _ParseInput(FTPS_CONTEXT * pContext) {
   IN_BUFFER_DESC * pBufferDesc;
+  const CMD_DESC * pCmd;
+  uint32_t Key;
+  int NumChars;
+  int LineLen;
+  int Cnt;
+  int c;
+  int r;
 
   pBufferDesc = &pContext->InBufferDesc;
-
-  if (_CompareCmd(pBufferDesc, "CDUP")) {
-    _EatLine(&pContext->InBufferDesc);
-    _ExecCDUP(pContext);
-    return 0;
-  } else if (_CompareCmd(pBufferDesc, "CWD")) {
-    _EatBytes(pBufferDesc, 4);
-    return _ExecCWD(pContext);
-  } else if (_CompareCmd(pBufferDesc, "DELE")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecDELE(pContext);
-  } else if (_CompareCmd(pBufferDesc, "LIST")) {
-    _EatBytes(pBufferDesc, 4);
-    return _ExecLIST(pContext);
-  } else if (_CompareCmd(pBufferDesc, "MKD")) {
-    _EatBytes(pBufferDesc, 4);
-    return _ExecMKD(pContext);
-  } else if (_CompareCmd(pBufferDesc, "NLST")) {
-    _EatBytes(pBufferDesc, 4);
-    return _ExecNLST(pContext);
-  } else if (_CompareCmd(pBufferDesc, "NOOP")) {
-    _EatLine(&pContext->InBufferDesc);
-    return _SendFTPString(&pContext->CtrlOut, 200, "Command okay.");
-  } else if (_CompareCmd(pBufferDesc, "PASS")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecPASS(pContext);
-  } else if (_CompareCmd(pBufferDesc, "PASV")) {
-    _EatBytes(pBufferDesc, 4);
-    return _ExecPASV(pContext);
-  } else if (_CompareCmd(pBufferDesc, "PORT")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecPORT(pContext);
-  } else if (_CompareCmd(pBufferDesc, "PWD")) {
-    _EatLine(&pContext->InBufferDesc);
-    return _ExecPWD(pContext);
-  } else if (_CompareCmd(pBufferDesc, "RETR")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecRETR(pContext);
-  } else if (_CompareCmd(pBufferDesc, "RMD")) {
-    _EatBytes(pBufferDesc, 4);
-    return _ExecRMD(pContext);
-  } else if (_CompareCmd(pBufferDesc, "SIZE")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecSIZE(pContext);
-  } else if (_CompareCmd(pBufferDesc, "STOR")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecSTOR(pContext);
-  } else if (_CompareCmd(pBufferDesc, "SYST")) {
-    _EatLine(&pContext->InBufferDesc);
-    return _SendFTPString(&pContext->CtrlOut, 215, "UNIX Type: L8");
-  } else if (_CompareCmd(pBufferDesc, "TYPE")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecTYPE(pContext);
-  } else if (_CompareCmd(pBufferDesc, "USER")) {
-    _EatBytes(pBufferDesc, 5);
-    _ExecUSER(pContext);
-    return 0;
+  LineLen     = _GetLineLen(pBufferDesc);
+  Cnt         = pBufferDesc->Cnt;
+  pCmd        = NULL;
+  Key = _GetCmdKey(pBufferDesc, &NumChars);
+  if (Key != 0) {
+    pCmd = _FindCmd(Key);
+  }
+  if (pCmd != NULL) {
+    c = _GetCharND(pBufferDesc, NumChars);
+    if (c == SPACE) {
+      NumChars++;
+      c = _GetCharND(pBufferDesc, NumChars);
+    }
+  }
+  r = 1;
+  if (pCmd == NULL) {
+    SEND_REPLY(&pContext->CtrlOut, "502 Command not implemented.\r\n");
+  } else if ((pCmd->Flags & CMD_FLAG_LOGIN) && (pContext->UserId <= 0)) {
+    SEND_REPLY(&pContext->CtrlOut, "530 Not logged in.\r\n");
+  } else if ((pCmd->Flags & CMD_FLAG_ARG) && (c == CR)) {
+    SEND_REPLY(&pContext->CtrlOut, "501 Syntax error in parameters or arguments.\r\n");
+  } else if ((pCmd->Flags & CMD_FLAG_DATA) && (pContext->DataState == DATA_STATE_NONE)) {
+    SEND_REPLY(&pContext->CtrlOut, "425 Use PORT or PASV first.\r\n");
+  } else {
+    _EatBytes(pBufferDesc, NumChars);
+    r = pCmd->pfExec(pContext);
+  }
   //
-  // DIRECTORY ORIENTED FTP COMMANDS (Added for compatibility)
-  // Refer to [RFC775] - http://tools.ietf.org/html/rfc775
+  // Remove what the command has left of the line
   //
-  } else if (_CompareCmd(pBufferDesc, "XPWD")) {
-    _EatLine(&pContext->InBufferDesc);
-    return _ExecPWD(pContext);
-  } else if (_CompareCmd(pBufferDesc, "XMKD")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecMKD(pContext);
-  } else if (_CompareCmd(pBufferDesc, "XRMD")) {
-    _EatBytes(pBufferDesc, 5);
-    return _ExecRMD(pContext);
-  } else if (_CompareCmd(pBufferDesc, "XCUP")) {
-    _EatLine(&pContext->InBufferDesc);
-    return _ExecCDUP(pContext);
-  } else {
-    _SendFTPString(&pContext->CtrlOut, 502, "Command not implemented.");
-    _EatLine(&pContext->InBufferDesc);
-    return 1;     // Error, unknown command
+  Cnt -= pBufferDesc->Cnt;
+  if (LineLen > Cnt) {
+    _EatBytes(pBufferDesc, LineLen - Cnt);
+  }
+  return r;
+}
+
+/*********************************************************************
+*
+*       _SkipLine
+*
+*  Function description
+*    Discards the input up to the end of the current line. Returns 0 if
+*    the end has not been received yet, the discarding continues with
+*    the next input then. A CR at the end of the input is kept, as the
+*    LF ending the line may follow in the next input.
+*/
+static int _SkipLine(IN_BUFFER_DESC * pBufferDesc) {
+  int Len;
+
+  Len = _GetLineLen(pBufferDesc);
+  if (Len > 0) {
+    _EatChars(pBufferDesc, Len);
+    pBufferDesc->IsSkipLine = 0;
+    return 1;
+  }
+  Len = pBufferDesc->Cnt;
+  if ((Len > 0) && (*(pBufferDesc->pBuffer + pBufferDesc->RdOff + Len - 1) == CR)) {
+    Len--;
   }
+  _EatChars(pBufferDesc, Len);
+  pBufferDesc->IsSkipLine = 1;
+  return 0;
 }
 
 /*********************************************************************
 *
-*       _Process
+*       _ProcessLines
+*
+*  Function description
+*    Executes all complete command lines in the input buffer and sends
+*    their replies together. A line that does not fit into the input
+*    buffer is rejected and discarded.
 *
-*  This is the main loop of the FTP server
+*  Return value
+*    0    O.K., more input required
+*   -1    Error, close connection
 */
-static void _Process(FTPS_CONTEXT * pContext) {
+static int _ProcessLines(FTPS_CONTEXT * pContext) {
+  IN_BUFFER_DESC * pBufferDesc;
   int i;
 
-  _SendFTPString(&pContext->CtrlOut, 220, FTPS_SIGN_ON_MSG);
-  do {
-    i = _ReadLine(&pContext->InBufferDesc);
-    if (i <= 0) {
-      return;     // Error, close connection
-    }
+  pBufferDesc = &pContext->InBufferDesc;
+  if (pBufferDesc->IsSkipLine && (_SkipLine(pBufferDesc) == 0)) {
+    return 0;
+  }
+  while (_GetLineLen(pBufferDesc) > 0) {
     i = _ParseInput(pContext);
     if (i < 0) {
-      return;     // Error, close connection
+      _Flush(&pContext->CtrlOut);
+      return -1;  // Error, close connection
     }
-    _EatLine(&pContext->InBufferDesc);
-  } while (1);
+  }
+  if (pBufferDesc->Cnt == pBufferDesc->Size) {
+    SEND_REPLY(&pContext->CtrlOut, "500 Line too long.\r\n");
+    _SkipLine(pBufferDesc);
+  }
+  //
+  // Send the replies to all commands at once
+  //
+  if (_Flush(&pContext->CtrlOut) < 0) {
+    return -1;
+  }
+  return 0;
 }
 
 /*********************************************************************
@@ -2266,38 +3665,114 @@ static void _Process(FTPS_CONTEXT * pContext) {
 
 /*********************************************************************
 *
-*       IP_FTPS_Process
+*       IP_FTPS_GetSessionSize
 *
 *  Function description
-*    Thread functionality of the FTP server.
-*    Returns when the connection is closed or a fatal error occurs.
+*    Returns the number of bytes required for the state of one session.
+*    The application allocates this memory and passes it to IP_FTPS_Start().
 */
-int  IP_FTPS_Process (const IP_FTPS_API * pIP_API, FTPS_SOCKET CtrlSock, const _FS_API * pFS_API, const FTPS_APPLICATION * pApplication) {
-  uint8_t acIn[FTPS_BUFFER_SIZE];
-  uint8_t acOut[FTPS_BUFFER_SIZE];
-  FTPS_CONTEXT Context;
+unsigned IP_FTPS_GetSessionSize(void) {
+  return sizeof(FTPS_CONTEXT);
+}
+
+/*********************************************************************
+*
+*       IP_FTPS_Start
+*
+*  Function description
+*    Initializes a session on a new control connection and sends the
+*    sign-on message. The session is then driven by IP_FTPS_Resume().
+*
+*  Parameters
+*    pSession      Memory of IP_FTPS_GetSessionSize() bytes that holds the session state
+*
+*  Return value
+*    0    O.K.
+*   -1    Error, close connection
+*/
+int IP_FTPS_Start(void * pSession, const IP_FTPS_API * pIP_API, FTPS_SOCKET CtrlSock, const _FS_API * pFS_API, const FTPS_APPLICATION * pApplication) {
+  FTPS_CONTEXT * pContext;
+
+  pContext = (FTPS_CONTEXT *)pSession;
+  memset(pContext, 0, sizeof(FTPS_CONTEXT));
+
+  pContext->pFS_API                  = pFS_API;
+  pContext->pApplication             = pApplication;
+
+  pContext->InBufferDesc.pIP_API     = pIP_API;
+  pContext->InBufferDesc.Sock        = CtrlSock;
+  pContext->InBufferDesc.pBuffer     = pContext->acIn;
+  pContext->InBufferDesc.Size        = sizeof(pContext->acIn);
+
+  pContext->CtrlOut.pIP_API          = pIP_API;
+  pContext->CtrlOut.Sock             = CtrlSock;
+  pContext->CtrlOut.pBuffer          = pContext->acOut;
+  pContext->CtrlOut.BufferSize       = sizeof(pContext->acOut);
+
+  pContext->DataOut.pIP_API          = pIP_API;
+  pContext->DataOut.pBuffer          = pContext->acData;
+  pContext->DataOut.BufferSize       = sizeof(pContext->acData);
 
-  memset(&Context, 0, sizeof(Context));
+  strcpy(pContext->acCurDir, "/");
+  SEND_REPLY(&pContext->CtrlOut, "220 " FTPS_SIGN_ON_MSG "\r\n");
+  if (_Flush(&pContext->CtrlOut) < 0) {
+    return -1;
+  }
+  return 0;
+}
 
-  Context.pFS_API                  = pFS_API;
-  Context.pApplication             = pApplication;
+/*********************************************************************
+*
+*       IP_FTPS_Resume
+*
+*  Function description
+*    Continues a session when data is available on its control connection.
+*    Receives once and executes every complete command in the input buffer.
+*    Called from an event loop, it does not block waiting for the next command.
+*
+*  Return value
+*    0    O.K., call again when the control connection is readable
+*   -1    Connection closed or error. Call IP_FTPS_End().
+*/
+int IP_FTPS_Resume(void * pSession) {
+  FTPS_CONTEXT * pContext;
 
-  Context.InBufferDesc.pIP_API     = pIP_API;
-  Context.InBufferDesc.Sock        = CtrlSock;
-  Context.InBufferDesc.pBuffer     = acIn;
-  Context.InBufferDesc.Size        = sizeof(acIn);
+  pContext = (FTPS_CONTEXT *)pSession;
+  if (_Read(&pContext->InBufferDesc) <= 0) {
+    return -1;    // Connection closed
+  }
+  return _ProcessLines(pContext);
+}
 
-  Context.CtrlOut.pIP_API        = pIP_API;
-  Context.CtrlOut.Sock           = CtrlSock;
-  Context.CtrlOut.pBuffer        = acOut;
-  Context.CtrlOut.BufferSize     = sizeof(acOut);
+/*********************************************************************
+*
+*       IP_FTPS_End
+*
+*  Function description
+*    Releases the data connection and data buffer of a session.
+*    The control connection is closed by the caller.
+*/
+void IP_FTPS_End(void * pSession) {
+  _Disconnect((FTPS_CONTEXT *)pSession);
+}
 
-  Context.DataOut.pIP_API        =  pIP_API;
-  Context.DataOut.pBuffer        = acOut;
-  Context.DataOut.BufferSize     = sizeof(acOut);
+/*********************************************************************
+*
+*       IP_FTPS_Process
+*
+*  Function description
+*    Thread functionality of the FTP server.
+*    Returns when the connection is closed or a fatal error occurs.
+*/
+int  IP_FTPS_Process (const IP_FTPS_API * pIP_API, FTPS_SOCKET CtrlSock, const _FS_API * pFS_API, const FTPS_APPLICATION * pApplication) {
+  FTPS_CONTEXT Context;
 
-  strcpy(Context.acCurDir, "/");
-  _Process(&Context);
+  if (IP_FTPS_Start(&Context, pIP_API, CtrlSock, pFS_API, pApplication) == 0) {
+    while (IP_FTPS_Resume(&Context) == 0) {
+      ;
+    }
+  }
+  IP_FTPS_End(&Context);
   return 0;
 }
 
@@ -2322,7 +3797,8 @@ void IP_FTPS_OnConnectionLimit(const IP_FTPS_API * pIP_API, FTPS_SOCKET CtrlSock
 
   OutContext.pBuffer       = acOut;
   OutContext.BufferSize    = sizeof(acOut);
-  _SendFTPString(&OutContext, 421, "Connection limit reached");
+  SEND_REPLY(&OutContext, "421 Connection limit reached\r\n");
+  _Flush(&OutContext);
 }
 
 /*************************** end of file ****************************/
@@ -27,6 +27,9 @@ void _FTPServerParentTask(void);
 *       main()
 */
 int main(int argc, char* argv[], char* envp[]) {
+  (void)argc;
+  (void)argv;
+  (void)envp;
   _FTPServerParentTask();
   return (0);
 }